@@ -40,6 +40,15 @@ eFB = {
     decryptString : function() {},
     encryptFileInImage : function() {},
     decryptFileFromImage : function() {},
+    decryptFilesFromImages : function() {},
+    encryptBufferInImage : function() {},
+    decryptBufferFromImage : function() {},
+    freeBuffer : function() {},
+    encryptFileInImageSet : function() {},
+    decryptFileFromImageSet : function() {},
+    getCacheStatistics : function() {},
+    setTimersEnabled : function() {},
+    getTimerSnapshot : function() {},
     calculateBitErrorRate : function() {},
     close : function() {},
 
@@ -174,6 +183,70 @@ eFB = {
                                      ctypes.char.ptr, // parameter 1
                                      ctypes.char.ptr // parameter 2
             );
+            eFB.decryptFilesFromImages= lib.declare("c_decryptFilesFromImages",
+                                     ctypes.default_abi,
+                                     ctypes.uint32_t, // return type
+                                     ctypes.uint32_t, // parameter 1
+                                     ctypes.char.ptr.ptr, // parameter 2
+                                     ctypes.char.ptr.ptr, // parameter 3
+                                     ctypes.uint32_t.ptr // parameter 4
+            );
+            eFB.encryptBufferInImage= lib.declare("c_encryptBufferInImage",
+                                     ctypes.default_abi,
+                                     ctypes.uint32_t, // return type
+                                     ctypes.char.ptr, // parameter 1
+                                     ctypes.unsigned_char.ptr, // parameter 2
+                                     ctypes.uint32_t, // parameter 3
+                                     ctypes.unsigned_char.ptr, // parameter 4
+                                     ctypes.uint32_t, // parameter 5
+                                     ctypes.unsigned_char.ptr.ptr, // parameter 6
+                                     ctypes.uint32_t.ptr // parameter 7
+            );
+            eFB.decryptBufferFromImage= lib.declare("c_decryptBufferFromImage",
+                                     ctypes.default_abi,
+                                     ctypes.uint32_t, // return type
+                                     ctypes.unsigned_char.ptr, // parameter 1
+                                     ctypes.uint32_t, // parameter 2
+                                     ctypes.unsigned_char.ptr.ptr, // parameter 3
+                                     ctypes.uint32_t.ptr // parameter 4
+            );
+            eFB.freeBuffer= lib.declare("c_freeBuffer",
+                                     ctypes.default_abi,
+                                     ctypes.void_t, // return type
+                                     ctypes.voidptr_t // parameter 1
+            );
+            eFB.encryptFileInImageSet= lib.declare("c_encryptFileInImageSet",
+                                     ctypes.default_abi,
+                                     ctypes.uint32_t, // return type
+                                     ctypes.char.ptr, // parameter 1
+                                     ctypes.char.ptr, // parameter 2
+                                     ctypes.uint32_t, // parameter 3
+                                     ctypes.char.ptr.ptr, // parameter 4
+                                     ctypes.uint32_t // parameter 5
+            );
+            eFB.decryptFileFromImageSet= lib.declare("c_decryptFileFromImageSet",
+                                     ctypes.default_abi,
+                                     ctypes.uint32_t, // return type
+                                     ctypes.uint32_t, // parameter 1
+                                     ctypes.char.ptr.ptr, // parameter 2
+                                     ctypes.char.ptr // parameter 3
+            );
+            eFB.getCacheStatistics= lib.declare("c_getCacheStatistics",
+                                     ctypes.default_abi,
+                                     ctypes.void_t, // return type
+                                     ctypes.uint32_t.ptr, // parameter 1
+                                     ctypes.uint32_t.ptr // parameter 2
+            );
+            eFB.setTimersEnabled= lib.declare("c_setTimersEnabled",
+                                     ctypes.default_abi,
+                                     ctypes.void_t, // return type
+                                     ctypes.uint32_t // parameter 1
+            );
+            eFB.getTimerSnapshot= lib.declare("c_getTimerSnapshot",
+                                     ctypes.default_abi,
+                                     ctypes.char.ptr, // return type
+                                     ctypes.uint32_t // parameter 1
+            );
             eFB.calculateBitErrorRate= lib.declare("c_calculateBitErrorRate",
                                      ctypes.default_abi,
                                      ctypes.uint32_t, // return type
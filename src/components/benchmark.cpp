@@ -0,0 +1,358 @@
+/**
+################################################################################
+    Benchmark program timing each stage of the eFB pipeline for each library factory, on synthetic images and payloads.
+
+    Usage: benchmark [iterations] [working directory]
+
+    Results are written to stdout as JSON, one record per (factory, stage), giving the median and 99th percentile latency in milliseconds and the throughput at the median in MB/s. Progress messages from the library go to stdout too, so the JSON is delimited by BEGIN/END marker lines.
+################################################################################
+*/
+
+// Standard library includes
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+// eFB Library includes
+#include "efb/Haar20KiBFactory.h"
+#include "efb/Upsampled165KiBFactory.h"
+#include "efb/crypto/BotanCipherStream.h"
+#include "efb/crypto/PayloadCompression.h"
+
+using namespace efb;
+using cimg_library::CImg;
+
+//! Monotonic wall clock time in milliseconds.
+static double nowMs()
+{
+    timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+//! A single pipeline stage. prepare() is called, untimed, before each timed call to run().
+struct Stage
+{
+    virtual ~Stage() {}
+    virtual void prepare() {}
+    virtual void run() = 0;
+};
+
+//! Summary statistics for one (factory, stage) pair.
+struct Result
+{
+    std::string factory, stage;
+    unsigned int bytes, samples;
+    double median_ms, p99_ms;
+};
+
+//! Time a stage over a number of iterations, after one untimed warm-up run.
+static Result measure( const std::string& factory, const std::string& name, Stage& stage, unsigned int bytes, unsigned int iterations )
+{
+    stage.prepare();
+    stage.run();
+    std::vector<double> samples;
+    for (unsigned int i=0; i<iterations; i++) {
+        stage.prepare();
+        double start = nowMs();
+        stage.run();
+        samples.push_back( nowMs() - start );
+    }
+    std::sort( samples.begin(), samples.end() );
+    Result r;
+    r.factory = factory;
+    r.stage = name;
+    r.bytes = bytes;
+    r.samples = iterations;
+    unsigned int n = samples.size();
+    r.median_ms = (n % 2) ? samples[n/2] : (samples[n/2-1] + samples[n/2]) / 2;
+    unsigned int p99 = (unsigned int) std::ceil( 0.99 * n );
+    r.p99_ms = samples[ (p99 > 0 ? p99 : 1) - 1 ];
+    std::cerr << factory << " " << name << ": " << r.median_ms << " ms" << std::endl;
+    return r;
+}
+
+//! Random bytes.
+static std::vector<byte> randomBytes( unsigned int size )
+{
+    std::vector<byte> data( size );
+    for (unsigned int i=0; i<size; i++) data[i] = (byte) std::rand();
+    return data;
+}
+
+//! Text-like bytes, which compress roughly as well as a typical message.
+static std::vector<byte> textBytes( unsigned int size )
+{
+    static const char* words[] = { "the ", "photo ", "from ", "last ", "weekend ", "was ", "great, ", "see ", "you ", "soon. " };
+    std::vector<byte> data;
+    while (data.size() < size) {
+        const char* w = words[ std::rand() % 10 ];
+        data.insert( data.end(), w, w + std::strlen(w) );
+    }
+    data.resize( size );
+    return data;
+}
+
+//! Encode an image as a JPEG in memory.
+static std::vector<byte> saveJpeg( const CImg<byte>& img, unsigned int quality )
+{
+    char* buffer = NULL;
+    size_t size = 0;
+    std::FILE* file = open_memstream( &buffer, &size );
+    img.save_jpeg( file, quality );
+    std::fclose( file );
+    std::vector<byte> jpeg( buffer, buffer + size );
+    std::free( buffer );
+    return jpeg;
+}
+
+//! Decode a JPEG held in memory.
+static void loadJpeg( CImg<byte>& img, std::vector<byte>& jpeg )
+{
+    std::FILE* file = fmemopen( &jpeg[0], jpeg.size(), "rb" );
+    img.load_jpeg( file );
+    std::fclose( file );
+}
+
+//! Decode a JPEG held in memory for extraction, as the library does.
+static void loadJpegForExtraction( IConduitImage& img, std::vector<byte>& jpeg )
+{
+    std::FILE* file = fmemopen( &jpeg[0], jpeg.size(), "rb" );
+    img.loadJpegForExtraction( file );
+    std::fclose( file );
+}
+
+//! Synthetic photo-like colour image: smooth gradients with some texture.
+static CImg<byte> syntheticPhoto( unsigned int width, unsigned int height )
+{
+    CImg<byte> img( width, height, 1, 3 );
+    cimg_forXYC( img, x, y, c ) {
+        double v = 128 + 60*std::sin( x*(0.01+0.004*c) ) + 40*std::cos( y*0.013 + c ) + (std::rand() % 24);
+        img( x, y, 0, c ) = (byte) std::max( 0.0, std::min( 255.0, v ) );
+    }
+    return img;
+}
+
+// Image stages
+struct LoadJpegStage : Stage {
+    IConduitImage& img; std::vector<byte>& jpeg;
+    LoadJpegStage( IConduitImage& i, std::vector<byte>& j ) : img(i), jpeg(j) {}
+    void run() { loadJpeg( img, jpeg ); }
+};
+struct LoadLumaStage : Stage {
+    IConduitImage& img; std::vector<byte>& jpeg;
+    LoadLumaStage( IConduitImage& i, std::vector<byte>& j ) : img(i), jpeg(j) {}
+    void run() { loadJpegForExtraction( img, jpeg ); }
+};
+struct ResizeStage : Stage {
+    const CImg<byte>& source; CImg<byte> img;
+    ResizeStage( const CImg<byte>& s ) : source(s) {}
+    void prepare() { img = source; }
+    void run() { LanczosResize::formatImage( img, 720, 720 ); } // as formatForImplantation
+};
+struct ImplantStage : Stage {
+    IConduitImage& img; const CImg<byte>& formatted; const std::vector<byte>& code; std::vector<byte> data;
+    ImplantStage( IConduitImage& i, const CImg<byte>& f, const std::vector<byte>& c ) : img(i), formatted(f), code(c) {}
+    void prepare() { img.assign( formatted ); data = code; }
+    void run() { img.implantData( data ); }
+};
+struct SaveJpegStage : Stage {
+    const CImg<byte>& img; std::vector<byte> jpeg;
+    SaveJpegStage( const CImg<byte>& i ) : img(i) {}
+    void run() { jpeg = saveJpeg( img, 85 ); }
+};
+struct ExtractStage : Stage {
+    IConduitImage& img; std::vector<byte>& jpeg; std::vector<byte> data, reliability;
+    ExtractStage( IConduitImage& i, std::vector<byte>& j ) : img(i), jpeg(j) {}
+    void prepare() { loadJpegForExtraction( img, jpeg ); }
+    void run() { img.extractDataWithReliability( data, reliability ); }
+};
+
+// Error correction stages
+struct FecEncodeStage : Stage {
+    const IFec& fec; const std::vector<byte>& payload; std::vector<byte> data;
+    FecEncodeStage( const IFec& f, const std::vector<byte>& p ) : fec(f), payload(p) {}
+    void prepare() { data = payload; }
+    void run() { fec.encode( data ); }
+};
+struct FecDecodeStage : Stage {
+    const IFec& fec; const std::vector<byte>& code; unsigned int errors; std::vector<byte> data;
+    FecDecodeStage( const IFec& f, const std::vector<byte>& c, unsigned int e ) : fec(f), code(c), errors(e) {}
+    void prepare() {
+        data = code;
+        for (unsigned int i=0; i<errors; i++) data[ std::rand() % data.size() ] ^= (byte) (1 + std::rand() % 255);
+    }
+    void run() { fec.decode( data ); }
+};
+struct InterleaveStage : Stage {
+    const IInterleaver& interleaver; const std::vector<byte>& code; std::vector<byte> data;
+    InterleaveStage( const IInterleaver& i, const std::vector<byte>& c ) : interleaver(i), code(c) {}
+    void prepare() { data = code; }
+    void run() { interleaver.interleave( data ); }
+};
+
+// Cryptography stages
+struct CompressStage : Stage {
+    const std::vector<byte>& payload; std::vector<byte> data;
+    CompressStage( const std::vector<byte>& p ) : payload(p) {}
+    void prepare() { data = payload; }
+    void run() { compressPayload( data, 0 ); }
+};
+struct AesStage : Stage {
+    Botan::SymmetricKey key; Botan::InitializationVector iv; std::vector<byte> data;
+    AesStage( const std::vector<byte>& p ) : data(p) {
+        Botan::AutoSeeded_RNG rng;
+        key = Botan::SymmetricKey( rng, 32 );
+        iv = Botan::InitializationVector( rng, 16 );
+    }
+    void run() { cipherInPlace( get_cipher( "AES-256/CFB", key, iv, Botan::ENCRYPTION ), &data[0], data.size() ); }
+};
+struct WrapStage : Stage {
+    ICrypto& crypto; std::vector<FacebookId>& ids; std::vector<byte> data;
+    WrapStage( ICrypto& c, std::vector<FacebookId>& i ) : crypto(c), ids(i) {}
+    void prepare() { data.assign( crypto.calculateHeaderSize( ids.size() ) + 16, 0 ); }
+    void run() { crypto.encryptMessage( ids, data ); }
+};
+struct UnwrapStage : Stage {
+    ICrypto& crypto; const std::vector<byte>& message; std::vector<byte> data;
+    UnwrapStage( ICrypto& c, const std::vector<byte>& m ) : crypto(c), message(m) {}
+    void prepare() { data = message; crypto.wipeCachedKeys(); } // so every run does the private key operation
+    void run() { crypto.decryptMessage( data ); }
+};
+
+// String codec stages
+struct StringEncodeStage : Stage {
+    const IStringCodec& codec; std::vector<byte> data; std::string str;
+    StringEncodeStage( const IStringCodec& c, const std::vector<byte>& d ) : codec(c), data(d) {}
+    void run() { str = codec.binaryToFbReady( data ); }
+};
+struct StringDecodeStage : Stage {
+    const IStringCodec& codec; std::string str; std::vector<byte> data;
+    StringDecodeStage( const IStringCodec& c, const std::string& s ) : codec(c), str(s) {}
+    void run() { data = codec.fbReadyToBinary( str ); }
+};
+
+//! Benchmark every stage for one factory.
+static void benchmarkFactory( const std::string& name, const ILibFactory& factory, unsigned int iterations, const std::string& dir, std::vector<Result>& results )
+{
+    IConduitImage& img = factory.create_IConduitImage();
+    const IFec& fec = factory.create_IFec();
+    const IInterleaver& interleaver = factory.create_IInterleaver();
+    ICrypto& crypto = factory.create_ICrypto();
+    const IStringCodec& codec = factory.create_IStringCodec();
+
+    // Synthetic source photo, and the same formatted for implantation
+    CImg<byte> source = syntheticPhoto( 960, 720 );
+    std::vector<byte> source_jpeg = saveJpeg( source, 90 );
+    CImg<byte> formatted = source;
+    LanczosResize::formatImage( formatted, 720, 720 );
+    unsigned int pixels = source.width() * source.height() * source.spectrum();
+
+    // A payload filling the image, and its error correction encoding
+    unsigned int capacity = img.getMaxData();
+    std::vector<byte> payload = randomBytes( fec.dataLength( capacity ) );
+    std::vector<byte> code = payload;
+    fec.encode( code );
+
+    // Image stages, with the output of each feeding the next
+    LoadJpegStage load( img, source_jpeg );
+    results.push_back( measure( name, "image_load", load, pixels, iterations ) );
+    ResizeStage resize( source );
+    results.push_back( measure( name, "format_resize", resize, pixels, iterations ) );
+    ImplantStage implant( img, formatted, code );
+    results.push_back( measure( name, "implant", implant, code.size(), iterations ) );
+    SaveJpegStage save( img );
+    results.push_back( measure( name, "jpeg_save", save, 720*720, iterations ) );
+    LoadJpegStage extract_load( img, save.jpeg );
+    results.push_back( measure( name, "extract_load", extract_load, 720*720, iterations ) );
+    LoadLumaStage extract_load_luma( img, save.jpeg );
+    results.push_back( measure( name, "extract_load_luma", extract_load_luma, 720*720, iterations ) );
+    ExtractStage extract( img, save.jpeg );
+    results.push_back( measure( name, "extract", extract, capacity, iterations ) );
+
+    // Error correction stages
+    FecEncodeStage fec_encode( fec, payload );
+    results.push_back( measure( name, "fec_encode", fec_encode, payload.size(), iterations ) );
+    FecDecodeStage fec_decode( fec, code, 0 );
+    results.push_back( measure( name, "fec_decode_clean", fec_decode, code.size(), iterations ) );
+    FecDecodeStage fec_decode_noisy( fec, code, code.size() / 200 ); // 0.5% of bytes in error
+    results.push_back( measure( name, "fec_decode_noisy", fec_decode_noisy, code.size(), iterations ) );
+    InterleaveStage interleave( interleaver, code );
+    results.push_back( measure( name, "interleave", interleave, code.size(), iterations ) );
+
+    // Key wrapping and unwrapping, for a single recipient, with a freshly generated identity
+    std::string private_key_filename = dir + "/benchmark_private.pem";
+    std::string public_key_filename = dir + "/benchmark_public.pem";
+    std::string passphrase = "benchmark";
+    {
+        std::ofstream private_key_file( private_key_filename.c_str(), std::ios::binary );
+        std::ofstream public_key_file( public_key_filename.c_str(), std::ios::binary );
+        crypto.generateKeys( private_key_file, public_key_file, passphrase );
+    }
+    FacebookId id( "1234" );
+    crypto.setUserId( id );
+    crypto.loadKeys( private_key_filename, public_key_filename, passphrase );
+    std::vector<FacebookId> ids( 1, id );
+    WrapStage wrap( crypto, ids );
+    results.push_back( measure( name, "key_wrap", wrap, 16, iterations ) );
+    UnwrapStage unwrap( crypto, wrap.data );
+    results.push_back( measure( name, "key_unwrap", unwrap, 16, iterations ) );
+
+    // String codec stages, on a message-sized payload
+    StringEncodeStage string_encode( codec, randomBytes( 4096 ) );
+    results.push_back( measure( name, "string_encode", string_encode, 4096, iterations ) );
+    StringDecodeStage string_decode( codec, string_encode.str );
+    results.push_back( measure( name, "string_decode", string_decode, 4096, iterations ) );
+
+    delete &img;
+    delete &fec;
+    delete &interleaver;
+    delete &crypto;
+}
+
+//! Write the results as JSON.
+static void writeJson( const std::vector<Result>& results )
+{
+    std::printf( "{\"benchmarks\":[\n" );
+    for (unsigned int i=0; i<results.size(); i++) {
+        const Result& r = results[i];
+        double mb_per_s = (r.median_ms > 0) ? (r.bytes / 1e6) / (r.median_ms / 1000) : 0;
+        std::printf( "  {\"factory\":\"%s\",\"stage\":\"%s\",\"bytes\":%u,\"samples\":%u,\"median_ms\":%.4f,\"p99_ms\":%.4f,\"mb_per_s\":%.3f}%s\n",
+            r.factory.c_str(), r.stage.c_str(), r.bytes, r.samples, r.median_ms, r.p99_ms, mb_per_s,
+            (i+1 < results.size()) ? "," : "" );
+    }
+    std::printf( "]}\n" );
+}
+
+int main( int argc, const char* argv[] )
+{
+    unsigned int iterations = (argc > 1) ? std::atoi( argv[1] ) : 25;
+    std::string dir = (argc > 2) ? argv[2] : "/tmp";
+    if (iterations == 0) iterations = 1;
+    std::srand( 1 ); // the same synthetic data every run
+
+    Botan::LibraryInitializer init( "thread_safe=true" );
+    std::vector<Result> results;
+
+    // Stages which don't depend on the factory, on a full-image sized payload
+    std::vector<byte> text = textBytes( 169926 );
+    CompressStage compress( text );
+    results.push_back( measure( "common", "compress", compress, text.size(), iterations ) );
+    AesStage aes( randomBytes( 169926 ) );
+    results.push_back( measure( "common", "aes", aes, aes.data.size(), iterations ) );
+
+    benchmarkFactory( "Haar20KiBFactory", Haar20KiBFactory(), iterations, dir, results );
+    benchmarkFactory( "Upsampled165KiBFactory", Upsampled165KiBFactory(), iterations, dir, results );
+
+    std::printf( "BEGIN BENCHMARK RESULTS\n" );
+    writeJson( results );
+    std::printf( "END BENCHMARK RESULTS\n" );
+    return 0;
+}
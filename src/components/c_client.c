@@ -51,6 +51,60 @@ const unsigned int c_decryptFileFromImage(const char* img_in_filename, const cha
   return decryptFileFromImage( lib,img_in_filename,data_out_filename);
 }
 
+/* Takes the bytes of a template image (JPEG or BMP) and encrypts a data buffer into it, using the given set of intended recipients. The resulting BMP bytes are returned in a new buffer, which must be released with c_freeBuffer. */
+const unsigned int c_encryptBufferInImage(const char* ids, const unsigned char* data_in, unsigned int data_size, const unsigned char* img_in, unsigned int img_in_size, unsigned char** img_out, unsigned int* img_out_size)
+{
+  return encryptBufferInImage( lib,ids,data_in,data_size,img_in,img_in_size,img_out,img_out_size );
+}
+
+/* Takes the bytes of an image (JPEG or BMP) and attempts to extract and decrypt any stored data into a new buffer, which must be released with c_freeBuffer. */
+const unsigned int c_decryptBufferFromImage(const unsigned char* img_in, unsigned int img_in_size, unsigned char** data_out, unsigned int* data_out_size)
+{
+  return decryptBufferFromImage( lib,img_in,img_in_size,data_out,data_out_size );
+}
+
+/* Release a buffer (or timer snapshot string) returned by the library. */
+void c_freeBuffer(void* buffer)
+{
+  freeBuffer( lib,buffer );
+}
+
+/* Takes arrays of full paths to images and destination files, and attempts to extract and decrypt them all in parallel. Per-image status codes are written to results. */
+const unsigned int c_decryptFilesFromImages(unsigned int count, const char** img_in_filenames, const char** data_out_filenames, unsigned int* results)
+{
+  return decryptFilesFromImages( lib,count,img_in_filenames,data_out_filenames,results );
+}
+
+/* Takes a full path to a data file and encrypts it across a set of images, for the given set of intended recipients. If parity is non-zero the last image is a parity image, allowing any one image to be lost. */
+const unsigned int c_encryptFileInImageSet(const char* ids, const char* data_in_filename, unsigned int count, const char** img_out_filenames, unsigned int parity)
+{
+  return encryptFileInImageSet( lib,ids,data_in_filename,count,img_out_filenames,parity );
+}
+
+/* Takes full paths to the images of a set, in any order, and attempts to reassemble and decrypt the data stored across them. */
+const unsigned int c_decryptFileFromImageSet(unsigned int count, const char** img_in_filenames, const char* data_out_filename)
+{
+  return decryptFileFromImageSet( lib,count,img_in_filenames,data_out_filename );
+}
+
+/* Get the number of decryptions answered from the library's cache of decrypted messages (hits) and the number which had to be decrypted (misses). */
+void c_getCacheStatistics(unsigned int* hits, unsigned int* misses)
+{
+  getCacheStatistics( lib,hits,misses );
+}
+
+/* Switch the library's stage timers on (non-zero) or off. */
+void c_setTimersEnabled(unsigned int enabled)
+{
+  setTimersEnabled( lib,enabled );
+}
+
+/* Get a JSON snapshot of the library's stage timers, optionally resetting them. The string must be released with c_freeBuffer. */
+char* c_getTimerSnapshot(unsigned int reset)
+{
+  return getTimerSnapshot( lib,reset );
+}
+
 /* Debug function to calculate the bit error rate of two files. */
 const unsigned int c_calculateBitErrorRate(const char* file1, const char* file2)
 {
@@ -3,10 +3,13 @@
 // Required eFB Libary component includes
 #include "efb/BasicLibary.h"
 #include "efb/Upsampled165KiBFactory.h"
+#include "efb/StageTimers.h"
 
 IeFBLibrary* create_IeFBLibrary(const char* id, const char* dir)
 {
 /* For now we use this concrete implementation. Potentially the exact library implementation which is instantiated could be decided at runtime, e.g. by passing parameters (specified in browser) to this function. */
+  static const unsigned int stage = efb::StageTimers::instance().stage( "create_IeFBLibrary" );
+  efb::ScopedStageTimer timer( stage );
   return (IeFBLibrary*) new efb::BasicLibary(
       *(new efb::Upsampled165KiBFactory()),
       id, dir
@@ -16,6 +19,8 @@ IeFBLibrary* create_IeFBLibrary(const char* id, const char* dir)
 /* Load a cryptographic identity from the filenames provided. */
 const unsigned int loadIdentity(IeFBLibrary* This, const char* private_key_filename, const char* public_key_filename, const char* passphrase)
 {
+  static const unsigned int stage = efb::StageTimers::instance().stage( "loadIdentity" );
+  efb::ScopedStageTimer timer( stage );
   return This->loadIdentity(private_key_filename, public_key_filename, passphrase);
 }
 
@@ -23,12 +28,16 @@ const unsigned int loadIdentity(IeFBLibrary* This, const char* private_key_filen
 const unsigned int generateIdentity(
    IeFBLibrary* This, const char* private_key_filename, const char* public_key_filename, const char* passphrase)
 {
+  static const unsigned int stage = efb::StageTimers::instance().stage( "generateIdentity" );
+  efb::ScopedStageTimer timer( stage );
   return This->generateIdentity(private_key_filename, public_key_filename, passphrase);
 }
 
 /* Load a set of Facebook ID / public key pairs from the provided directory, which will be used for encrypting messages/photos. */
 const unsigned int loadIdKeyPair( IeFBLibrary* This, const char* id, const char* key_filename)
 {
+  static const unsigned int stage = efb::StageTimers::instance().stage( "loadIdKeyPair" );
+  efb::ScopedStageTimer timer( stage );
   return This->loadIdKeyPair(id,key_filename);
 }
 
@@ -36,12 +45,16 @@ const unsigned int loadIdKeyPair( IeFBLibrary* This, const char* id, const char*
 const char* encryptString(
   IeFBLibrary* This, const char* ids, const char* str_in)
 {
+  static const unsigned int stage = efb::StageTimers::instance().stage( "encryptString" );
+  efb::ScopedStageTimer timer( stage );
   return This->encryptString( ids, str_in );
 }
 
 /* Take a null terminated UTF8 string which has been downloaded from Facebook. Remove the null terminal and decode from the Facebook-ready UTF8 format into arbitrary binary data. Attempt to parse a message header and decrypt the data. If succesful the output should be a valid UTF8 string (with no null characters). Terminate with a null character and return. */
 const char* decryptString( IeFBLibrary* This, const char* str_in)
 {
+  static const unsigned int stage = efb::StageTimers::instance().stage( "decryptString" );
+  efb::ScopedStageTimer timer( stage );
   return This->decryptString( str_in );
 }
 
@@ -54,6 +67,8 @@ const unsigned int encryptFileInImage
   const char* img_out_filename
 )
 {
+  static const unsigned int stage = efb::StageTimers::instance().stage( "encryptFileInImage" );
+  efb::ScopedStageTimer timer( stage );
   return This->encryptFileInImage( ids, data_in_filename, img_out_filename );
 }
 
@@ -65,16 +80,130 @@ const unsigned int decryptFileFromImage
     const char* data_out_filename
 )
 {
+  static const unsigned int stage = efb::StageTimers::instance().stage( "decryptFileFromImage" );
+  efb::ScopedStageTimer timer( stage );
   return This->decryptFileFromImage( img_in_filename, data_out_filename );
 }
 
+/* Given the bytes of a JPEG or BMP template image, encrypt and store the data buffer within it. The encoded image is returned as BMP bytes in a new buffer owned by the caller, which must be released with freeBuffer. */
+const unsigned int encryptBufferInImage
+(
+  IeFBLibrary* This,
+  const char* ids,
+  const unsigned char* data_in,
+  unsigned int data_size,
+  const unsigned char* img_in,
+  unsigned int img_in_size,
+  unsigned char** img_out,
+  unsigned int* img_out_size
+)
+{
+  static const unsigned int stage = efb::StageTimers::instance().stage( "encryptBufferInImage" );
+  efb::ScopedStageTimer timer( stage );
+  return This->encryptBufferInImage( ids, data_in, data_size, img_in, img_in_size, img_out, img_out_size );
+}
+
+/* Given the bytes of a JPEG or BMP image, attempt to extract and decrypt data from it. The data is returned in a new buffer owned by the caller, which must be released with freeBuffer. */
+const unsigned int decryptBufferFromImage
+(
+    IeFBLibrary* This,
+    const unsigned char* img_in,
+    unsigned int img_in_size,
+    unsigned char** data_out,
+    unsigned int* data_out_size
+)
+{
+  static const unsigned int stage = efb::StageTimers::instance().stage( "decryptBufferFromImage" );
+  efb::ScopedStageTimer timer( stage );
+  return This->decryptBufferFromImage( img_in, img_in_size, data_out, data_out_size );
+}
+
+/* Release a buffer returned by encryptBufferInImage, decryptBufferFromImage or getTimerSnapshot. Any pointer type can be passed without a cast. */
+void freeBuffer( IeFBLibrary* This, void* buffer )
+{
+  This->freeBuffer( buffer );
+}
+
+/* Given arrays of source image paths and destination file paths, attempt to extract and decrypt data from every image using a pool of worker threads. A status code is written to results for each image, and the number of failures is returned. */
+const unsigned int decryptFilesFromImages
+(
+    IeFBLibrary* This,
+    unsigned int count,
+    const char** img_in_filenames,
+    const char** data_out_filenames,
+    unsigned int* results
+)
+{
+  static const unsigned int stage = efb::StageTimers::instance().stage( "decryptFilesFromImages" );
+  efb::ScopedStageTimer timer( stage );
+  return This->decryptFilesFromImages( count, img_in_filenames, data_out_filenames, results );
+}
+
+/* Encrypt a file across a set of images, optionally with an extra parity image so that any one image may be lost. */
+const unsigned int encryptFileInImageSet
+(
+    IeFBLibrary* This,
+    const char* ids,
+    const char* data_in_filename,
+    unsigned int count,
+    const char** img_out_filenames,
+    unsigned int parity
+)
+{
+  static const unsigned int stage = efb::StageTimers::instance().stage( "encryptFileInImageSet" );
+  efb::ScopedStageTimer timer( stage );
+  return This->encryptFileInImageSet( ids, data_in_filename, count, img_out_filenames, parity );
+}
+
+/* Given the paths of a set of images, in any order, reassemble and decrypt the file stored across them. */
+const unsigned int decryptFileFromImageSet
+(
+    IeFBLibrary* This,
+    unsigned int count,
+    const char** img_in_filenames,
+    const char* data_out_filename
+)
+{
+  static const unsigned int stage = efb::StageTimers::instance().stage( "decryptFileFromImageSet" );
+  efb::ScopedStageTimer timer( stage );
+  return This->decryptFileFromImageSet( count, img_in_filenames, data_out_filename );
+}
+
+/* Get the number of decryptions which were, and were not, answered from the library's cache of decrypted messages. */
+void getCacheStatistics( IeFBLibrary* This, unsigned int* hits, unsigned int* misses )
+{
+  static const unsigned int stage = efb::StageTimers::instance().stage( "getCacheStatistics" );
+  efb::ScopedStageTimer timer( stage );
+  This->getCacheStatistics( hits, misses );
+}
+
 /* Helper function calculates bit error rate. */
 const unsigned int calculateBitErrorRate( IeFBLibrary* This, const char file1[], const char file2[] )
 {
+  static const unsigned int stage = efb::StageTimers::instance().stage( "calculateBitErrorRate" );
+  efb::ScopedStageTimer timer( stage );
   return This->calculateBitErrorRate( file1,file2 );
 }
 
 void destroy_object( IeFBLibrary* This )
 {
+  static const unsigned int stage = efb::StageTimers::instance().stage( "destroy_object" );
+  efb::ScopedStageTimer timer( stage );
+  This->close(); // wipe sensitive information before releasing the library
   delete This;
-}
\ No newline at end of file
+}
+
+/* Switch the stage timers on (non-zero) or off. They are off by default, when they cost almost nothing. */
+void setTimersEnabled( IeFBLibrary* This, unsigned int enabled )
+{
+  efb::StageTimers::instance().setEnabled( enabled != 0 );
+}
+
+/* Get a JSON snapshot of the stage timers - for each stage, the number of runs, total and maximum time, and a latency histogram - optionally resetting them. The string is returned in a new buffer, which must be released with freeBuffer. */
+char* getTimerSnapshot( IeFBLibrary* This, unsigned int reset )
+{
+  std::string json = efb::StageTimers::instance().snapshot( reset != 0 );
+  char* buffer = (char*) std::malloc( json.size() + 1 );
+  if (buffer != NULL) std::memcpy( buffer, json.c_str(), json.size() + 1 );
+  return buffer;
+}
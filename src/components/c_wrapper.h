@@ -23,6 +23,24 @@ const unsigned int encryptFileInImage(IeFBLibrary* This, const char* ids, const
 
 const unsigned int decryptFileFromImage(IeFBLibrary* This, const char* img_in_filename, const char* data_out_filename);
 
+const unsigned int encryptBufferInImage(IeFBLibrary* This, const char* ids, const unsigned char* data_in, unsigned int data_size, const unsigned char* img_in, unsigned int img_in_size, unsigned char** img_out, unsigned int* img_out_size);
+
+const unsigned int decryptBufferFromImage(IeFBLibrary* This, const unsigned char* img_in, unsigned int img_in_size, unsigned char** data_out, unsigned int* data_out_size);
+
+void freeBuffer(IeFBLibrary* This, void* buffer);
+
+const unsigned int decryptFilesFromImages(IeFBLibrary* This, unsigned int count, const char** img_in_filenames, const char** data_out_filenames, unsigned int* results);
+
+const unsigned int encryptFileInImageSet(IeFBLibrary* This, const char* ids, const char* data_in_filename, unsigned int count, const char** img_out_filenames, unsigned int parity);
+
+const unsigned int decryptFileFromImageSet(IeFBLibrary* This, unsigned int count, const char** img_in_filenames, const char* data_out_filename);
+
+void getCacheStatistics(IeFBLibrary* This, unsigned int* hits, unsigned int* misses);
+
+void setTimersEnabled(IeFBLibrary* This, unsigned int enabled);
+
+char* getTimerSnapshot(IeFBLibrary* This, unsigned int reset);
+
 const unsigned int calculateBitErrorRate( IeFBLibrary* This, const char* file1, const char* file2 );
 
 void destroy_object( IeFBLibrary* This ) ;
@@ -6,12 +6,28 @@
 #include <iostream>
 #include <fstream>
 #include <iterator>
+#include <map>
 #include <numeric>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
 #include <sys/stat.h> 
 
 // eFB Library sub-component includes
 #include "IeFBLibrary.h"
 #include "ILibFactory.h"
+#include "Threading.h"
+#include "MessageCache.h"
+#include "StageTimers.h"
+#include "TemplateCache.h"
+#include "crypto/PayloadCompression.h"
+#include "conduit_image/HaarKernels.h"
+#include "conduit_image/LanczosResize.h"
+#include "conduit_image/UpsampledConduitImage.h"
+#include "fec/GaloisKernels.h"
+#include "fec/schifra/schifra_sequential_root_generator_polynomial_creator.hpp"
     
 namespace efb {
         
@@ -38,9 +54,12 @@ namespace efb {
                 factory_( factory ),
                 crypto_( factory_.create_ICrypto() ),
                 fec_( factory_.create_IFec() ),
+                interleaver_( factory_.create_IInterleaver() ),
                 string_codec_( factory_.create_IStringCodec() ),
                 id_( id ),
-                working_directory_( working_directory )
+                working_directory_( working_directory ),
+                cache_( CACHE_ENTRIES, CACHE_BYTES ),
+                templates_( working_directory_ )
             {
                 std::cout << "Library initialised." << std::endl;
                 std::cout << "Facebook ID is " << id_.val << "." << std::endl;
@@ -99,6 +118,8 @@ namespace efb {
                 std::string public_key_filename_full =
                     working_directory_ + *(new std::string(public_key_filename));
                 
+                // Messages decrypted under the previous identity must not be handed out under this one
+                cache_.clear();
                 
                 crypto_.loadKeys(
                     private_key_filename_full,
@@ -127,8 +148,13 @@ namespace efb {
                 return 0;
             }
             
-            //! Close the library and wipe any volatile directories.
-            void close() {}
+            //! Close the library and wipe any volatile directories, and any decrypted messages or keys held in memory.
+            void close()
+            {
+                cache_.clear();
+                templates_.clear();
+                crypto_.wipeCachedKeys();
+            }
             
             unsigned int encryptFileInImage
             (
@@ -137,36 +163,15 @@ namespace efb {
                 const char*  img_out_filename
             )
             {
-                // !!!TODO!!! - For now we use a specific template image located on the desktop
-                const char* template_filename =  "/home/chris/Desktop/src.bmp";
-                //	 
+                const char* template_filename = templateFilename();
                 std::ifstream 	data_file; // input data file
                 std::vector<byte> data; // byte array for our data bytes we wish to transfer
-                IConduitImage& img = factory_.create_IConduitImage(); // conduit image object
-                data.reserve( img.getMaxData() ); // we know the max number of items possible to store
                 unsigned int head_size, data_size; // size of the raw data we are sending
-                unsigned int final_size=0; // size before we insert into image
                 
-                // Load IDs into a vector (currently they are semi-colon delimited)
-                std::string id_string;
-                std::vector<FacebookId> ids_vector;
-                unsigned int i = 0;
-                while ( ids[i] != '\0' )
-                {
-                    id_string = "";
-                    while (ids[i] != ';')
-                    {
-                        id_string.push_back( ids[i++] );
-                    }
-                    FacebookId id_object( id_string );
-                    ids_vector.push_back(id_object);
-                    i++;
-                }
+                // Load IDs into a vector, adding the user's ID
+                std::vector<FacebookId> ids_vector = parseIds( ids );
                 
-                // Add the user's ID
-                ids_vector.push_back( id_ );
-                
-                // Load the file, leaving room for the encryption header
+                // Open the file and get its length
                 head_size = crypto_.calculateHeaderSize( ids_vector.size() );
                 data_file.open( data_filename, std::ios::binary );
                 if(!data_file.is_open()) {
@@ -175,113 +180,1141 @@ namespace efb {
                 }
                 data_file.seekg(0, std::ios::end);
                 data_size = data_file.tellg(); // get the length of the file 
-                // read the file into the data byte vector
+                
+                // Load the template image, already formatted, into a ConduitImage object
+                IConduitImage& img = factory_.create_IConduitImage(); // conduit image object
+                try {templates_.load( img, template_filename );}
+                catch (cimg_library::CImgException &e) {
+                  std::cout << "Error loading template image: " << e.what() << std::endl;
+                  delete &img;
+                  return 3;
+                }
+                
+                // Refuse files which can't fit, even allowing for compression, before reading them - so memory use is bounded by the image capacity
+                if (!fitsInImage( (head_size + data_size) / MAX_COMPRESSION_RATIO, img )) {
+                    std::cout << "File is too big." << std::endl;
+                    delete &img;
+                    return 1;
+                }
+                
+                // Read the file straight into the data byte vector, leaving room for the encryption header
+                data.reserve( std::max( head_size + data_size, img.getMaxData() ) );
+                data.assign( head_size, (byte) '|' );
+                data.resize( head_size + data_size );
                 data_file.seekg(0, std::ios::beg);
-                data = std::vector<byte>( head_size, (byte) '|' );
-                data.resize(head_size + data_size);
                 data_file.read((char*) &data[head_size], data_size);
                 
+                // Encrypt, add error correction and store the data in the image
+                unsigned int result = implantMessage( ids_vector, data, img );
+              
+                // Save our final image (in a lossless format)
+                if (result == 0) {
+                    try {img.save( img_out_filename );}
+                    catch (cimg_library::CImgException &e) {
+                      std::cout << "Error saving output image: " << e.what() << std::endl;
+                      result = 3;
+                    }
+                }
+                
+                // delete the image object
+                delete &img;
+                
+                return result;
+            }
+            
+            //! Encrypt a buffer into an image held in memory, see IeFBLibrary::encryptBufferInImage.
+            unsigned int encryptBufferInImage
+            (
+                const char* ids,
+                const unsigned char* data_in,
+                unsigned int data_size,
+                const unsigned char* img_in,
+                unsigned int img_in_size,
+                unsigned char** img_out,
+                unsigned int* img_out_size
+            )
+            {
+                *img_out = NULL;
+                *img_out_size = 0;
+                
+                // Load IDs into a vector, adding the user's ID
+                std::vector<FacebookId> ids_vector = parseIds( ids );
+                
+                // Decode the template image straight from the caller's buffer
+                IConduitImage& img = factory_.create_IConduitImage();
+                unsigned int result = 3;
+                if ( loadImageBuffer( img, img_in, img_in_size ) )
+                {
+                    // Copy the data, leaving room for the encryption header
+                    unsigned int head_size = crypto_.calculateHeaderSize( ids_vector.size() );
+                    std::vector<byte> data;
+                    data.reserve( img.getMaxData() );
+                    data.assign( head_size, (byte) '|' );
+                    data.insert( data.end(), data_in, data_in + data_size );
+                    result = implantMessage( ids_vector, data, img );
+                }
+                
+                // Encode the final image (in a lossless format) into a new buffer
+                if ( result == 0 && !saveImageBuffer( img, img_out, img_out_size ) )
+                    result = 3;
+                
+                delete &img;
+                return result;
+            }
+            
+            unsigned int decryptFileFromImage
+            (
+                const char*  img_in_filename,
+                const char*  data_filename
+            )
+            {
+                IConduitImage&      img = factory_.create_IConduitImage();        // source image object
+                
+                // Extract, decrypt and save the data, unless it is already cached
+                unsigned int result = decryptImageFile( img, fec_, img_in_filename, data_filename );
+                
+                // delete the image object
+                delete &img;
+                return result;
+            }
+            
+            //! Attempt to extract and decrypt data from an image held in memory, see IeFBLibrary::decryptBufferFromImage.
+            unsigned int decryptBufferFromImage
+            (
+                const unsigned char* img_in,
+                unsigned int img_in_size,
+                unsigned char** data_out,
+                unsigned int* data_out_size
+            )
+            {
+                *data_out = NULL;
+                *data_out_size = 0;
+                
+                // Look for the image in the cache before doing any decoding
+                std::vector<byte>   plaintext;
+                std::vector<byte>   key = cacheKey( IMAGE_ENTRY, img_in, img_in_size );
+                if ( !cache_.find( key, plaintext ) )
+                {
+                    // Decode the image straight from the caller's buffer, extract the data and correct errors
+                    IConduitImage&      img = factory_.create_IConduitImage();
+                    std::vector<byte>   data;
+                    unsigned int result = 1;
+                    if ( loadImageBuffer( img, img_in, img_in_size, true ) )
+                        result = extractFromLoadedImage( img, fec_, data );
+                    delete &img;
+                    if (result != 0) return result;
+                    
+                    // Retrieve the message key from the header and decrypt the data
+                    result = decryptExtractedData( data );
+                    if (result != 0) return result;
+                    
+                    // Keep the data, less the header
+                    unsigned int head_size = crypto_.retrieveHeaderSize(data);
+                    plaintext.assign( data.begin() + head_size, data.end() );
+                    cache_.insert( key, plaintext );
+                }
+                
+                // Hand the data to the caller
+                unsigned int size = plaintext.size();
+                *data_out = (unsigned char*) std::malloc( size > 0 ? size : 1 );
+                if (*data_out == NULL) return 1;
+                if (size > 0) std::memcpy( *data_out, &plaintext[0], size );
+                *data_out_size = size;
+                return 0;
+            }
+            
+            //! Release a buffer returned by encryptBufferInImage, decryptBufferFromImage or the C API's getTimerSnapshot.
+            void freeBuffer( void* buffer ) const
+            {
+                std::free( buffer );
+            }
+            
+            //! Attempt to extract and decrypt files from a batch of images, using a pool of worker threads.
+            unsigned int decryptFilesFromImages
+            (
+                unsigned int count,
+                const char** img_in_filenames,
+                const char** data_filenames,
+                unsigned int* results
+            )
+            {
+                // Each worker gets its own conduit image and FEC objects
+                WorkerPool pool;
+                unsigned int num_workers = (count < pool.size()) ? count : pool.size();
+                std::vector<IConduitImage*> imgs( num_workers );
+                std::vector<IFec*> fecs( num_workers );
+                for (unsigned int i=0; i<num_workers; i++) {
+                    imgs[i] = &factory_.create_IConduitImage();
+                    fecs[i] = &factory_.create_IFec();
+                }
+                
+                // Decode the images
+                BatchDecryptTask task(
+                    *this, img_in_filenames, data_filenames, results, imgs, fecs );
+                pool.run( task, count );
+                
+                // Delete the per-worker objects
+                for (unsigned int i=0; i<num_workers; i++) {
+                    delete imgs[i];
+                    delete fecs[i];
+                }
+                
+                // Return the number of images which could not be decrypted
+                unsigned int failures = 0;
+                for (unsigned int i=0; i<count; i++)
+                    if (results[i] != 0) failures++;
+                return failures;
+            }
+            
+            //! Encrypt a file across a set of images, see IeFBLibrary::encryptFileInImageSet.
+            unsigned int encryptFileInImageSet
+            (
+                const char* ids,
+                const char* data_filename,
+                unsigned int count,
+                const char** img_out_filenames,
+                unsigned int parity
+            )
+            {
+                // Work out how the set is made up
+                unsigned int num_parity = parity ? 1 : 0;
+                if (count <= num_parity || count > MAX_SET_IMAGES) {
+                    std::cout << "Invalid number of images." << std::endl;
+                    return 1;
+                }
+                unsigned int num_data = count - num_parity;
+                
+                // Load IDs into a vector, adding the user's ID
+                std::vector<FacebookId> ids_vector = parseIds( ids );
+                unsigned int head_size = crypto_.calculateHeaderSize( ids_vector.size() );
+                
+                // Open the file and get its length
+                std::ifstream data_file( data_filename, std::ios::binary );
+                if(!data_file.is_open()) {
+                    std::cout << "Error opening data file." << std::endl;
+                    return 1;
+                }
+                data_file.seekg(0, std::ios::end);
+                unsigned int data_size = data_file.tellg();
+                
+                // Check each image's share of the message could fit, even allowing for compression, before reading the file
+                IConduitImage& img = factory_.create_IConduitImage();
+                try {templates_.load( img, templateFilename() );}
+                catch (cimg_library::CImgException &e) {
+                  std::cout << "Error loading template image: " << e.what() << std::endl;
+                  delete &img;
+                  return 3;
+                }
+                unsigned int max_segment_size = fec_.dataLength( img.getMaxData() ) - 3 - SET_HEADER_SIZE; // less the length tag and set header
+                delete &img;
+                if ((head_size + data_size) / MAX_COMPRESSION_RATIO > num_data * max_segment_size) {
+                    std::cout << "File is too big." << std::endl;
+                    return 1;
+                }
+                
+                // Compress the file once just to measure it, since the set header needs the size of the whole message before the first image is encoded. It is only compressed if that makes it smaller, and if it isn't too big to be decompressed again.
+                bool compressed = false;
+                unsigned int payload_size = data_size;
+                if (data_size > 0 && data_size <= MAX_DECOMPRESSED_SIZE) {
+                    try {
+                        PayloadCompressor compressor( data_size );
+                        std::vector<byte> chunk, out;
+                        unsigned int zsize = 0;
+                        data_file.seekg(0, std::ios::beg);
+                        for (unsigned int offset = 0; offset < data_size; offset += chunk.size()) {
+                            if (!readFileChunk( data_file, data_size - offset, chunk )) {
+                                std::cout << "Error reading data file." << std::endl;
+                                return 1;
+                            }
+                            out.clear();
+                            compressor.write( &chunk[0], chunk.size(), out, offset + chunk.size() == data_size );
+                            zsize += out.size();
+                        }
+                        if (zsize < data_size) {
+                            compressed = true;
+                            payload_size = zsize;
+                        }
+                    }
+                    catch (EncryptionException &e) {
+                      std::cout << "Error compressing: " << e.what() << std::endl;
+                      return 4;
+                    }
+                }
+                
+                // Check each image's share of the message fits
+                unsigned int message_size = head_size + payload_size;
+                unsigned int segment_size = (message_size + num_data - 1) / num_data;
+                if (segment_size > max_segment_size) {
+                    std::cout << "File is too big." << std::endl;
+                    return 1;
+                }
+                
+                // Each worker has its own FEC object
+                WorkerPool pool;
+                unsigned int num_workers = (count < pool.size()) ? count : pool.size();
+                std::vector<IFec*> fecs( num_workers );
+                for (unsigned int i=0; i<num_workers; i++)
+                    fecs[i] = &factory_.create_IFec();
+                std::vector<unsigned int> results( count, 0 );
+                
+                // Stream the file through compression and the cipher, a chunk at a time. Each full segment of the message goes into a batch, which is encoded into its images in parallel once there is one segment per worker, so only a few segments are held in memory at once. crypto_ is in the middle of a message throughout, so it is locked.
+                unsigned int result = 0;
+                {
+                    ScopedLock lock( crypto_mutex_ );
+                    std::vector<byte> pending; // message bytes not yet split into segments
+                    try {crypto_.beginMessage( ids_vector, pending, compressed );}
+                    catch (EncryptionException &e) {
+                      std::cout << "Error encrypting: " << e.what() << std::endl;
+                      result = 4;
+                    }
+                    
+                    // Describe the set. Its ID is taken from the crypto header, which starts with a random IV, so images from different sets can't be mixed up.
+                    SetHeader header;
+                    if (result == 0) {
+                        std::vector<byte> digest = crypto_.messageDigest( &pending[0], pending.size() );
+                        for (unsigned int i=0; i<sizeof(header.set_id); i++) header.set_id[i] = digest[i];
+                        header.num_data = num_data;
+                        header.num_parity = num_parity;
+                        header.message_size = message_size;
+                    }
+                    
+                    // The parity segment is all the data segments XORed together, the last padded with zeros
+                    std::vector<byte> parity_segment;
+                    if (num_parity) parity_segment.assign( segment_size, 0 );
+                    std::vector<std::vector<byte> > batch;
+                    unsigned int first = 0, emitted = pending.size();
+                    if (result == 0) {
+                        try {
+                            PayloadCompressor compressor( data_size );
+                            std::vector<byte> chunk, plain;
+                            data_file.clear();
+                            data_file.seekg(0, std::ios::beg);
+                            for (unsigned int offset = 0; offset < data_size && result == 0; offset += chunk.size()) {
+                                if (!readFileChunk( data_file, data_size - offset, chunk )) {
+                                    std::cout << "Error reading data file." << std::endl;
+                                    result = 1;
+                                    break;
+                                }
+                                unsigned int old_size = pending.size();
+                                if (compressed) {
+                                    plain.clear();
+                                    compressor.write( &chunk[0], chunk.size(), plain, offset + chunk.size() == data_size );
+                                    if (!plain.empty()) crypto_.encryptMessagePart( &plain[0], plain.size(), pending );
+                                }
+                                else crypto_.encryptMessagePart( &chunk[0], chunk.size(), pending );
+                                emitted += pending.size() - old_size;
+                                result = encodeSetSegments(
+                                    header, pending, false, parity_segment, segment_size, batch, first, pool, img_out_filenames, results, fecs );
+                            }
+                            if (result == 0) {
+                                unsigned int old_size = pending.size();
+                                crypto_.endMessage( pending );
+                                emitted += pending.size() - old_size;
+                            }
+                        }
+                        catch (EncryptionException &e) {
+                          std::cout << "Error encrypting: " << e.what() << std::endl;
+                          result = 4;
+                        }
+                    }
+                    
+                    // Drop the rest of the message if it failed part way through
+                    if (result != 0) {
+                        std::vector<byte> discard;
+                        crypto_.endMessage( discard );
+                    }
+                    
+                    // The message must be the size measured before encoding began, or the file changed in between
+                    else if (emitted != message_size) {
+                        std::cout << "Data file changed while it was being encrypted." << std::endl;
+                        result = 1;
+                    }
+                    
+                    // Encode the rest of the data segments, then the parity segment
+                    else {
+                        result = encodeSetSegments(
+                            header, pending, true, parity_segment, segment_size, batch, first, pool, img_out_filenames, results, fecs );
+                    }
+                }
+                for (unsigned int i=0; i<num_workers; i++)
+                    delete fecs[i];
+                if (result != 0) return result;
+                
+                // Report the first image which failed, if any
+                for (unsigned int i=0; i<count; i++)
+                    if (results[i] != 0) return results[i];
+                return 0;
+            }
+            
+            //! Reassemble and decrypt a file from a set of images, see IeFBLibrary::decryptFileFromImageSet.
+            unsigned int decryptFileFromImageSet
+            (
+                unsigned int count,
+                const char** img_in_filenames,
+                const char* data_filename
+            )
+            {
+                // Extract the images in parallel, each worker having its own conduit image and FEC objects
+                WorkerPool pool;
+                unsigned int num_workers = (count < pool.size()) ? count : pool.size();
+                std::vector<IConduitImage*> imgs( num_workers );
+                std::vector<IFec*> fecs( num_workers );
+                for (unsigned int i=0; i<num_workers; i++) {
+                    imgs[i] = &factory_.create_IConduitImage();
+                    fecs[i] = &factory_.create_IFec();
+                }
+                unsigned int result;
+                {
+                    // crypto_ is in the middle of a message throughout
+                    ScopedLock lock( crypto_mutex_ );
+                    SetDecryption decryption( crypto_, data_filename );
+                    try {
+                        result = readImageSet( pool, count, img_in_filenames, decryption, imgs, fecs );
+                        if (result == 0) result = decryption.finish();
+                    }
+                    catch (DecryptionException &e) {
+                        std::cout << "Error decrypting: " << e.what() << std::endl;
+                        result = 4;
+                    }
+                }
+                for (unsigned int i=0; i<num_workers; i++) {
+                    delete imgs[i];
+                    delete fecs[i];
+                }
+                return result;
+            }
+            
+            //! Take a message string and encrypt into a Facebook-ready string. Both will be null terminated.
+            const char* encryptString
+            (
+                const char* ids,
+                const char*  input
+            ) const
+            {
+                // Load IDs into a vector, adding the user's ID
+                std::vector<FacebookId> ids_vector = parseIds( ids );
+                
+                // Copy data into a vector<byte> **INCLUDING** the null terminal. Leave room for the header at the start.
+                unsigned int head_size = crypto_.calculateHeaderSize( ids_vector.size() );
+                std::vector<byte> data( head_size, (byte)0);
+                for (unsigned int i=0; i<strlen(input)+1; i++) data.push_back( input[i] );
+                                        
                 // Generate header and encrypt the data
                 try {crypto_.encryptMessage(ids_vector, data);}
                 catch (EncryptionException &e) {
-                  std::cout << "Error encrypting: " << e.what() << std::endl;
-                    return 4;
+                    std::cout << "Error encrypting: " << e.what() << std::endl;
+                    return "";
                 }
                 
-                // Pad the data to full length
-                final_size = data.size();
-                if (fec_.codeLength(final_size+3) > img.getMaxData()) {
-                    std::cout << "File is too big." << std::endl;
+                // Create Facebook ready string to upload
+                std::string str = string_codec_.binaryToFbReady( data );
+                char* cstr = new char [str.size()+1];
+                strcpy(cstr, str.c_str());
+                
+                return cstr;
+            }
+            
+            //! Take string from Facebook and decrypt to a message string. Both will be null terminated.
+            const char* decryptString
+            (
+                const char*  input
+            ) const
+            {
+                // Copy input into a std::string (strips null terminal)
+                std::string str( input );
+                
+                // Return a copy of the message if it has been decrypted before
+                std::vector<byte> plaintext;
+                std::vector<byte> key = cacheKey( STRING_ENTRY, (const byte*) str.data(), str.size() );
+                if ( cache_.find( key, plaintext ) ) {
+                    char* cstr = new char [plaintext.size()];
+                    strcpy( cstr, (char*) &plaintext[0] );
+                    return cstr;
+                }
+                
+                // Decode the string into a byte array
+                std::vector<byte> data;
+                try {
+                    data = string_codec_.fbReadyToBinary( str );
+                } catch (StringDecodeException &e) {
+                    std::cout << "UTF8 decode failed: " << e.what() << std::endl;
+                }
+                
+                // Retrieve the message key from the header and decrypt the data
+                try {crypto_.decryptMessage(data);}
+                catch (DecryptionException &e) {
+                    std::cout << "Error decrypting: " << e.what() << std::endl;
+                    return "You do not have sufficient privileges to read this message.";
+                }
+                
+                // Bytes should now be original (UTF8, null terminated) message. We must skip the header.
+                unsigned int head_size = crypto_.retrieveHeaderSize(data);
+                char* cstr = new char [data.size() - head_size];
+                strcpy( cstr, (char*) &data[head_size] );
+                cache_.insert( key, &data[0] + head_size, data.size() - head_size );
+                return cstr;
+            }
+            
+            //! Get the number of decryptions which were, and were not, answered from the cache of decrypted messages.
+            void getCacheStatistics( unsigned int* hits, unsigned int* misses ) const
+            {
+                cache_.getStatistics( *hits, *misses );
+            }
+            
+            //! Calculate bit error rate (for debugging purposes).
+            unsigned int calculateBitErrorRate
+            (
+                const char*  file1_path,
+                const char*  file2_path
+            )
+            {
+                //return testImageCoding();
+                //return testHaarKernels();
+                //return testGaloisKernels();
+                //return testLanczosResize();
+                //return testUpsampledReliability();
+            
+                // ifstream objects
+                std::ifstream file1, file2;
+                // open file 1
+                file1.open( file1_path, std::ios::binary );
+                if(!file1.is_open()) {
+                    std::cout << "Error opening data file 1:" << std::endl;
                     return 1;
                 }
-                srand( time(NULL) );
-                while ( fec_.codeLength( data.size()+3+1 ) < img.getMaxData() )
-                {
-                    data.push_back( (byte) rand() );
+                // and file 2
+                file2.open( file2_path, std::ios::binary );
+                if(!file2.is_open()) {
+                    std::cout << "Error opening data file 2:" << std::endl;
+                    return 1;
                 }
-                // Add the length to the end
-                data.push_back( (final_size >> 0) & 0x000000ff );
-                data.push_back( (final_size >> 8) & 0x000000ff );
-                data.push_back( (final_size >> 16) & 0x000000ff );
+                // vector byte arrays 
+                std::vector<byte> data1, data2;
+                // load file 1 into array
+                file1.seekg(0, std::ios::end);
+                size_t file1_size = file1.tellg(); // get the length of the file
+                file1.seekg(0, std::ios::beg);
+                data1.resize( file1_size );
+                // read into array
+                file1.read((char*) &data1[0], file1_size);
+                // load file 2 into array
+                file2.seekg(0, std::ios::end);
+                size_t file2_size = file2.tellg(); // get the length of the file
+                file2.seekg(0, std::ios::beg);
+                data2.resize( file2_size );
+                // read into array
+                file2.read((char*) &data2[0], file2_size);
                 
-                // Add error correction code
-                try {fec_.encode( data );}
-                catch (FecEncodeException &e) {
-                  std::cout << "Error adding error correction code: " << e.what() << std::endl;
-                  return 2;
+                // Calculate the BER and output to std::cout
+                unsigned int total=0, errors=0; std::vector<byte> e;
+                for (unsigned int i=0; i<data1.size(); i++) {
+                  byte error = data1[i] ^ data2[i];
+                  e.push_back( error );
+                  std::bitset<8> bs( error );
+                  errors += bs.count();
+                  total += 8;
                 }
+                std::cout << errors << " errors in " << total <<" bits. ";
+                std::cout << ((float) errors) / total << std::endl;
                 
-                // Load the template image file into a ConduitImage object
-                try {img.load( template_filename );}
-                catch (cimg_library::CImgInstanceException &e) {
-                  std::cout << "Error loading template image: " << e.what() << std::endl;
-                  return 3;
+                // Write out errors to a file
+                std::ofstream error_file;
+                error_file.open( "/home/chris/Desktop/errors.bin", std::ios::binary);
+                if(!error_file.is_open()) {
+                  std::cout << "Error creating error file:" << std::endl;
+                  return 1;
                 }
+                error_file.write((char*) &e[0], e.size() );
+                
+                return 0;
+            }
               
-                // Store the data vector in the image
-                try {img.implantData( data );}
-                catch (ConduitImageImplantException &e) {
-                    std::cout << "Error implanting data: " << e.what() << std::endl;
-                    return 4;
+        private :
+            const ILibFactory& factory_;
+            ICrypto& crypto_; // not const, has state (key and iv)
+            const IFec& fec_;
+            const IInterleaver& interleaver_;
+            const IStringCodec& string_codec_;
+            const FacebookId id_;
+            const std::string working_directory_;
+            // crypto_ has state (key and iv) so must only be used by one thread at a time
+            Mutex crypto_mutex_;
+            // Recently decrypted messages, so that re-rendered pages need not be decrypted again
+            enum { CACHE_ENTRIES = 256, CACHE_BYTES = 16*1024*1024 };
+            // Files are only read if they would fit when compressed by up to this ratio
+            enum { MAX_COMPRESSION_RATIO = 4 };
+            // Files are read a chunk at a time when they are streamed into an image set
+            enum { FILE_CHUNK = 64*1024 };
+            enum CacheEntryType { STRING_ENTRY = 's', IMAGE_ENTRY = 'i' };
+            mutable MessageCache cache_;
+            // Template images formatted for implantation, kept in memory and in the working directory
+            mutable TemplateCache templates_;
+            
+            //! Image set header limits. The header is an 8-byte set ID, the image's index in the set, the number of data and parity images, a version byte, and the size of the whole message (32-bit, little endian).
+            enum { SET_HEADER_SIZE = 16, SET_VERSION = 1, MAX_SET_IMAGES = 255 };
+            
+            //! Header stored at the start of the message in each image of a set.
+            struct SetHeader
+            {
+                byte set_id[8];
+                unsigned int index;
+                unsigned int num_data;
+                unsigned int num_parity;
+                unsigned int message_size;
+                
+                //! Size of each image's share of the message.
+                unsigned int segmentSize() const
+                    {return (message_size + num_data - 1) / num_data;}
+                
+                //! Check whether another header belongs to the same set.
+                bool sameSet( const SetHeader& other ) const
+                {
+                    return std::memcmp( set_id, other.set_id, sizeof(set_id) ) == 0
+                        && num_data == other.num_data
+                        && num_parity == other.num_parity
+                        && message_size == other.message_size;
                 }
-              
-                // Save our final image (in a lossless format)
-                try {img.save( img_out_filename );}
-                catch (cimg_library::CImgInstanceException &e) {
-                  std::cout << "Error saving output image: " << e.what() << std::endl;
-                  return 3;
+                
+                //! Write the header to the start of a message.
+                void write( byte data[] ) const
+                {
+                    std::memcpy( data, set_id, sizeof(set_id) );
+                    data[8] = (byte) index;
+                    data[9] = (byte) num_data;
+                    data[10] = (byte) num_parity;
+                    data[11] = (byte) SET_VERSION;
+                    for (unsigned int j=0; j<4; j++)
+                        data[12+j] = (byte) (message_size >> (j*8));
                 }
                 
-                // delete the image object
-                delete &img;
+                //! Read the header from the start of a message, checking that it is consistent with the message. Returns false if it isn't.
+                bool read( const std::vector<byte>& data )
+                {
+                    if (data.size() < SET_HEADER_SIZE || data[11] != SET_VERSION) return false;
+                    std::memcpy( set_id, &data[0], sizeof(set_id) );
+                    index = data[8];
+                    num_data = data[9];
+                    num_parity = data[10];
+                    message_size = 0;
+                    for (unsigned int j=0; j<4; j++)
+                        message_size |= ((unsigned int) data[12+j]) << (j*8);
+                    return num_data > 0 && num_parity <= 1
+                        && index < num_data + num_parity
+                        && data.size() == SET_HEADER_SIZE + segmentSize();
+                }
+            };
+            
+            //! Task for encoding a batch of consecutive images of a set, used by encodeSetSegments.
+            class SetEncodeTask : public IParallelTask
+            {
+                const BasicLibary& lib_;
+                const SetHeader& header_;
+                const std::vector<std::vector<byte> >& segments_;
+                unsigned int first_;
+                const char** img_out_filenames_;
+                std::vector<unsigned int>& results_;
+                std::vector<IFec*>& fecs_;
                 
-                // Return with succes
+                public :
+                    SetEncodeTask
+                    (
+                        const BasicLibary& lib,
+                        const SetHeader& header,
+                        const std::vector<std::vector<byte> >& segments,
+                        unsigned int first,
+                        const char** img_out_filenames,
+                        std::vector<unsigned int>& results,
+                        std::vector<IFec*>& fecs
+                    ) :
+                        lib_( lib ),
+                        header_( header ),
+                        segments_( segments ),
+                        first_( first ),
+                        img_out_filenames_( img_out_filenames ),
+                        results_( results ),
+                        fecs_( fecs )
+                    {}
+                    
+                    void run( unsigned int item, unsigned int worker )
+                    {
+                        // Data images come first, followed by the parity image
+                        unsigned int index = first_ + item;
+                        SetHeader header = header_;
+                        header.index = index;
+                        std::vector<byte> message( SET_HEADER_SIZE );
+                        header.write( &message[0] );
+                        message.insert( message.end(), segments_[item].begin(), segments_[item].end() );
+                        
+                        // Encode the message into a copy of the template and save it
+                        IConduitImage& img = lib_.factory_.create_IConduitImage();
+                        unsigned int result;
+                        try {
+                            lib_.templates_.load( img, templateFilename() );
+                            result = lib_.encodeInImage( message, img, *fecs_[worker] );
+                            if (result == 0) img.save( img_out_filenames_[index] );
+                        }
+                        catch (cimg_library::CImgException &e) {
+                            std::cout << "Error encoding image " << img_out_filenames_[index] << ": " << e.what() << std::endl;
+                            result = 3;
+                        }
+                        catch (std::exception &e) {
+                            std::cout << "Error encoding image " << img_out_filenames_[index] << ": " << e.what() << std::endl;
+                            result = 2;
+                        }
+                        delete &img;
+                        results_[index] = result;
+                    }
+            };
+            
+            //! Split the full segments off the front of a set's message, XORing them into the parity segment (if any), and encode them into their images a batch at a time.
+            /**
+                Segments are held in the batch until there is one for each worker. Once the last of the message is pending, it is padded with zeros to fill the set's data segments, and the remaining batch is encoded along with the parity segment. Returns non-zero if the message turns out to be bigger than the set.
+            */
+            unsigned int encodeSetSegments
+            (
+                const SetHeader& header,
+                std::vector<byte>& pending,
+                bool last,
+                std::vector<byte>& parity,
+                unsigned int segment_size,
+                std::vector<std::vector<byte> >& batch,
+                unsigned int& first,
+                const WorkerPool& pool,
+                const char** img_out_filenames,
+                std::vector<unsigned int>& results,
+                std::vector<IFec*>& fecs
+            ) const
+            {
+                if (last) {
+                    unsigned int rest = (header.num_data - first - batch.size()) * segment_size;
+                    if (pending.size() < rest) pending.resize( rest, 0 );
+                }
+                unsigned int used = 0;
+                while (pending.size() - used >= segment_size) {
+                    if (first + batch.size() == header.num_data) {
+                        std::cout << "Data file changed while it was being encrypted." << std::endl;
+                        return 1;
+                    }
+                    batch.push_back( std::vector<byte>( pending.begin() + used, pending.begin() + used + segment_size ) );
+                    for (unsigned int i=0; i<parity.size(); i++)
+                        parity[i] ^= batch.back()[i];
+                    used += segment_size;
+                    if (batch.size() == fecs.size()) encodeSetBatch( header, batch, first, pool, img_out_filenames, results, fecs );
+                }
+                pending.erase( pending.begin(), pending.begin() + used );
+                if (last) {
+                    if (!parity.empty()) batch.push_back( parity );
+                    encodeSetBatch( header, batch, first, pool, img_out_filenames, results, fecs );
+                }
                 return 0;
             }
             
-            unsigned int decryptFileFromImage
+            //! Encode a batch of segments into consecutive images of a set, starting at first, and empty the batch.
+            void encodeSetBatch
             (
-                const char*  img_in_filename,
-                const char*  data_filename
-            )
+                const SetHeader& header,
+                std::vector<std::vector<byte> >& batch,
+                unsigned int& first,
+                const WorkerPool& pool,
+                const char** img_out_filenames,
+                std::vector<unsigned int>& results,
+                std::vector<IFec*>& fecs
+            ) const
             {
-                std::ofstream       data_file;  // data file object	 
-                IConduitImage&      img = factory_.create_IConduitImage();        // source image object
-                std::vector<byte>   data;       // for data bytes we wish to transfer
-                unsigned int head_size;         // size of header so we can skip
+                if (batch.empty()) return;
+                SetEncodeTask task( *this, header, batch, first, img_out_filenames, results, fecs );
+                pool.run( task, batch.size() );
+                first += batch.size();
+                batch.clear();
+            }
+            
+            //! Decrypts the message of an image set as its segments are written, in index order, straight into the data file. crypto_mutex_ must be held for its lifetime. The file is only created once the message can be decrypted, and is removed again unless finish() succeeds.
+            class SetDecryption
+            {
+                ICrypto& crypto_;
+                const char* data_filename_;
+                std::ofstream data_file_;
+                unsigned int remaining_; // message bytes still to come, any more being padding
+                bool started_;
+                std::vector<byte> header_;
+                PayloadDecompressor* decompressor_;
+                std::vector<byte> plaintext_, output_;
                 
+                //! Decrypt (and decompress) a piece of the payload and write it out.
+                void process( const byte* data, unsigned int size )
+                {
+                    plaintext_.clear();
+                    if (size > 0) crypto_.decryptMessagePart( data, size, plaintext_ );
+                    output( plaintext_ );
+                }
                 
+                //! Write out plaintext, decompressing it first if need be.
+                void output( const std::vector<byte>& plaintext )
+                {
+                    if (plaintext.empty()) return;
+                    if (decompressor_ == NULL) {
+                        data_file_.write( (const char*) &plaintext[0], plaintext.size() );
+                        return;
+                    }
+                    output_.clear();
+                    decompressor_->write( &plaintext[0], plaintext.size(), output_ );
+                    if (!output_.empty()) data_file_.write( (const char*) &output_[0], output_.size() );
+                }
+                
+                // Not copyable
+                SetDecryption( const SetDecryption& );
+                SetDecryption& operator=( const SetDecryption& );
+                
+                public :
+                    SetDecryption( ICrypto& crypto, const char* data_filename ) :
+                        crypto_( crypto ),
+                        data_filename_( data_filename ),
+                        remaining_( 0 ),
+                        started_( false ),
+                        decompressor_( NULL )
+                    {}
+                    
+                    ~SetDecryption()
+                    {
+                        if (started_) {
+                            std::vector<byte> discard;
+                            crypto_.endMessage( discard );
+                        }
+                        delete decompressor_;
+                        if (data_file_.is_open()) {
+                            data_file_.close();
+                            std::remove( data_filename_ );
+                        }
+                    }
+                    
+                    //! Set the size of the message, once the set is known.
+                    void expect( unsigned int message_size ) { remaining_ = message_size; }
+                    
+                    //! Decrypt the next segment of the message. The crypto header is gathered first, since it may span segments. Throws a DecryptionException if the message can't be decrypted.
+                    void write( const byte* data, unsigned int size )
+                    {
+                        if (size > remaining_) size = remaining_;
+                        remaining_ -= size;
+                        if (started_) {
+                            process( data, size );
+                            return;
+                        }
+                        header_.insert( header_.end(), data, data + size );
+                        if (header_.size() < crypto_.calculateHeaderSize( 0 )) return;
+                        unsigned int head_size = crypto_.retrieveHeaderSize( header_ );
+                        if (header_.size() < head_size) return;
+                        bool compressed = crypto_.beginDecryption( header_ );
+                        started_ = true;
+                        if (compressed) decompressor_ = new PayloadDecompressor();
+                        data_file_.open( data_filename_, std::ios::binary ); // checked by finish()
+                        process( &header_[0] + head_size, header_.size() - head_size );
+                        std::vector<byte>().swap( header_ );
+                    }
+                    
+                    //! Finish decrypting the message, which must be complete, and close the data file. Returns zero on success.
+                    unsigned int finish()
+                    {
+                        if (!started_ || remaining_ != 0) throw DecryptionException("Message is truncated.");
+                        plaintext_.clear();
+                        crypto_.endMessage( plaintext_ );
+                        started_ = false;
+                        output( plaintext_ );
+                        if (decompressor_ != NULL) decompressor_->finish();
+                        if (!data_file_.is_open()) {
+                            std::cout << "Error creating data file." << std::endl;
+                            return 1;
+                        }
+                        data_file_.close();
+                        if (data_file_.fail()) {
+                            std::cout << "Error writing data file." << std::endl;
+                            std::remove( data_filename_ );
+                            return 1;
+                        }
+                        return 0;
+                    }
+            };
+            
+            //! Extract the messages of a batch of images in parallel.
+            void extractSetBatch
+            (
+                const WorkerPool& pool,
+                std::vector<const char*>& filenames,
+                std::vector<std::vector<byte> >& messages,
+                std::vector<unsigned int>& results,
+                std::vector<IConduitImage*>& imgs,
+                std::vector<IFec*>& fecs
+            ) const
+            {
+                messages.assign( filenames.size(), std::vector<byte>() );
+                results.assign( filenames.size(), 0 );
+                SetExtractTask task( *this, &filenames[0], messages, results, imgs, fecs );
+                pool.run( task, filenames.size() );
+            }
+            
+            //! Read the images of a set, a batch at a time, writing the data segments to the decryption in index order.
+            /**
+                The first image which can be read decides which set is being decoded. Segments are written as soon as every segment before them has been, so if the images are given in order only a batch is held in memory at once. A few segments which arrive early are held back; any more are read again from their images when their turn comes. Every segment read is XORed together, which, once all the images have been read, gives any one missing data segment if the parity segment is there. Returns zero if every data segment was written, otherwise the decryptFileFromImageSet error code.
+            */
+            unsigned int readImageSet
+            (
+                const WorkerPool& pool,
+                unsigned int count,
+                const char** img_in_filenames,
+                SetDecryption& decryption,
+                std::vector<IConduitImage*>& imgs,
+                std::vector<IFec*>& fecs
+            ) const
+            {
+                SetHeader set;
+                bool have_set = false;
+                unsigned int failure = 2; // reported if the set can't be completed
+                std::vector<const char*> files; // the image holding each segment, if any
+                std::vector<byte> rebuilt; // every segment read XORed together
+                std::map<unsigned int, std::vector<byte> > held; // data segments read before their turn
+                unsigned int next = 0, segment_size = 0, max_held = imgs.size();
+                std::vector<const char*> batch;
+                std::vector<std::vector<byte> > messages;
+                std::vector<unsigned int> results;
+                for (unsigned int first=0; first<count; first+=batch.size()) {
+                    unsigned int end = (first + imgs.size() < count) ? first + imgs.size() : count;
+                    batch.assign( img_in_filenames + first, img_in_filenames + end );
+                    extractSetBatch( pool, batch, messages, results, imgs, fecs );
+                    for (unsigned int i=0; i<batch.size(); i++) {
+                        if (results[i] != 0) {
+                            failure = results[i];
+                            continue;
+                        }
+                        SetHeader header;
+                        if (!header.read( messages[i] )) {
+                            std::cout << "Image " << batch[i] << " is not part of an image set." << std::endl;
+                            continue;
+                        }
+                        if (!have_set) {
+                            set = header;
+                            have_set = true;
+                            segment_size = set.segmentSize();
+                            files.assign( set.num_data + set.num_parity, NULL );
+                            if (set.num_parity) rebuilt.assign( segment_size, 0 );
+                            decryption.expect( set.message_size );
+                        }
+                        else if (!set.sameSet( header )) {
+                            std::cout << "Image " << batch[i] << " belongs to a different image set." << std::endl;
+                            continue;
+                        }
+                        if (files[header.index] != NULL) continue; // the same image twice
+                        files[header.index] = batch[i];
+                        const byte* segment = &messages[i][SET_HEADER_SIZE];
+                        for (unsigned int j=0; j<rebuilt.size(); j++)
+                            rebuilt[j] ^= segment[j];
+                        if (header.index == next) {
+                            decryption.write( segment, segment_size );
+                            for (next++; held.count( next ) != 0; next++) {
+                                decryption.write( &held[next][0], segment_size );
+                                held.erase( next );
+                            }
+                        }
+                        else if (header.index < set.num_data && held.size() < max_held)
+                            held[header.index].assign( segment, segment + segment_size );
+                    }
+                }
+                if (!have_set) return failure;
+                
+                // One missing data segment can be rebuilt from the parity segment
+                unsigned int num_missing = 0;
+                for (unsigned int k=next; k<set.num_data; k++)
+                    if (files[k] == NULL) num_missing++;
+                if (num_missing > 1 || (num_missing == 1 && (set.num_parity == 0 || files[set.num_data] == NULL))) {
+                    std::cout << "Error reassembling image set: " << num_missing << " images missing." << std::endl;
+                    return failure;
+                }
+                
+                // Write the rest of the segments in order, reading any which weren't held back again, a batch at a time
+                while (next < set.num_data) {
+                    if (held.count( next ) != 0) {
+                        decryption.write( &held[next][0], segment_size );
+                        held.erase( next++ );
+                        continue;
+                    }
+                    if (files[next] == NULL) {
+                        decryption.write( &rebuilt[0], segment_size );
+                        next++;
+                        continue;
+                    }
+                    batch.clear();
+                    std::vector<unsigned int> indices;
+                    for (unsigned int k=next; k<set.num_data && batch.size()<imgs.size(); k++)
+                        if (files[k] != NULL && held.count( k ) == 0) {
+                            batch.push_back( files[k] );
+                            indices.push_back( k );
+                        }
+                    extractSetBatch( pool, batch, messages, results, imgs, fecs );
+                    for (unsigned int i=0; i<batch.size(); i++) {
+                        SetHeader header;
+                        if (results[i] != 0 || !header.read( messages[i] ) || !set.sameSet( header ) || header.index != indices[i]) {
+                            std::cout << "Image " << batch[i] << " could not be read again." << std::endl;
+                            return (results[i] != 0) ? results[i] : 2;
+                        }
+                        held[indices[i]].assign( messages[i].begin() + SET_HEADER_SIZE, messages[i].end() );
+                    }
+                }
+                return 0;
+            }
+            
+            //! Task for extracting the message from each image of a batch, used by extractSetBatch.
+            class SetExtractTask : public IParallelTask
+            {
+                const BasicLibary& lib_;
+                const char** img_in_filenames_;
+                std::vector<std::vector<byte> >& messages_;
+                std::vector<unsigned int>& results_;
+                std::vector<IConduitImage*>& imgs_;
+                std::vector<IFec*>& fecs_;
+                
+                public :
+                    SetExtractTask
+                    (
+                        const BasicLibary& lib,
+                        const char** img_in_filenames,
+                        std::vector<std::vector<byte> >& messages,
+                        std::vector<unsigned int>& results,
+                        std::vector<IConduitImage*>& imgs,
+                        std::vector<IFec*>& fecs
+                    ) :
+                        lib_( lib ),
+                        img_in_filenames_( img_in_filenames ),
+                        messages_( messages ),
+                        results_( results ),
+                        imgs_( imgs ),
+                        fecs_( fecs )
+                    {}
+                    
+                    void run( unsigned int item, unsigned int worker )
+                    {
+                        unsigned int result;
+                        try {
+                            result = lib_.extractFromImage(
+                                *imgs_[worker], *fecs_[worker], img_in_filenames_[item], messages_[item] );
+                        }
+                        catch (std::exception &e) {
+                            std::cout << "Error extracting image " << img_in_filenames_[item] << ": " << e.what() << std::endl;
+                            result = 1;
+                        }
+                        results_[item] = result;
+                    }
+            };
+            
+            //! Task for decrypting a batch of images, used by decryptFilesFromImages.
+            class BatchDecryptTask : public IParallelTask
+            {
+                BasicLibary& lib_;
+                const char** img_in_filenames_;
+                const char** data_filenames_;
+                unsigned int* results_;
+                std::vector<IConduitImage*>& imgs_;
+                std::vector<IFec*>& fecs_;
+                
+                public :
+                    BatchDecryptTask
+                    (
+                        BasicLibary& lib,
+                        const char** img_in_filenames,
+                        const char** data_filenames,
+                        unsigned int* results,
+                        std::vector<IConduitImage*>& imgs,
+                        std::vector<IFec*>& fecs
+                    ) :
+                        lib_( lib ),
+                        img_in_filenames_( img_in_filenames ),
+                        data_filenames_( data_filenames ),
+                        results_( results ),
+                        imgs_( imgs ),
+                        fecs_( fecs )
+                    {}
+                    
+                    void run( unsigned int item, unsigned int worker )
+                    {
+                        unsigned int result;
+                        try {
+                            result = lib_.decryptImageFile(
+                                *imgs_[worker], *fecs_[worker], img_in_filenames_[item], data_filenames_[item] );
+                        }
+                        catch (std::exception &e) {
+                            std::cout << "Error decrypting image " << img_in_filenames_[item] << ": " << e.what() << std::endl;
+                            result = 1;
+                        }
+                        results_[item] = result;
+                    }
+            };
+            
+            //! Load an image, extract the stored data and correct any errors. Returns zero on success, otherwise the decryptFileFromImage error code.
+            unsigned int extractFromImage
+            (
+                IConduitImage& img,
+                const IFec& fec,
+                const char* img_in_filename,
+                std::vector<byte>& data
+            ) const
+            {
                 // Load the source image file into a CImg object
-                try {img.load( img_in_filename );}
-                catch (cimg_library::CImgInstanceException &e) {
-                  std::cout <<  "Error loading source image: " << e.what() << std::endl;
-                  return 1;
+                static const unsigned int load_stage = StageTimers::instance().stage( "load_image" );
+                {
+                    ScopedStageTimer timer( load_stage );
+                    try {img.loadForExtraction( img_in_filename );}
+                    catch (cimg_library::CImgException &e) {
+                      std::cout <<  "Error loading source image: " << e.what() << std::endl;
+                      return 1;
+                    }
                 }
                 
-                // Check that the dimensions are exactly 720x720
-                if (img.width() != 720 || img.height() != 720) {
+                return extractFromLoadedImage( img, fec, data );
+            }
+            
+            //! Extract the data stored in an image which has already been loaded and correct any errors. Returns zero on success, otherwise the decryptFileFromImage error code.
+            unsigned int extractFromLoadedImage
+            (
+                IConduitImage& img,
+                const IFec& fec,
+                std::vector<byte>& data
+            ) const
+            {
+                // Check that the dimensions are exactly those the conduit image is formatted at
+                if ((unsigned int) img.width() != img.getFormatWidth() || (unsigned int) img.height() != img.getFormatHeight()) {
                   std::cout << "Error extracting data: wrong image dimensions." << std::endl;
                   return 2;
                 }
                 
-                // Decode from image 
-                try {img.extractData( data );}
-                catch (ConduitImageExtractException &e) {
-                    std::cout << "Error extracting data: " << e.what() << std::endl;
-                    return 2;
+                // Decode from image, scoring how reliably each byte was read
+                static const unsigned int extract_stage = StageTimers::instance().stage( "extract_data" );
+                std::vector<byte> reliability;
+                {
+                    ScopedStageTimer timer( extract_stage );
+                    try {img.extractDataWithReliability( data, reliability );}
+                    catch (ConduitImageExtractException &e) {
+                        std::cout << "Error extracting data: " << e.what() << std::endl;
+                        return 2;
+                    }
                 }
                 
                 // Remove padding outside FEC blocksize
-                while ( fec_.codeLength( fec_.dataLength( data.size() ) ) != data.size() )
+                while ( fec.codeLength( fec.dataLength( data.size() ) ) != data.size() )
                 {
                     data.pop_back();
                 }
+                reliability.resize( data.size() );
                 
-                // Correct errors
-                try {fec_.decode( data );}
-                catch (FecDecodeException &e) {
-                  std::cout << "Error decoding FEC codes: " << e.what() << std::endl;
-                  return 3;
+                // Restore the order the data was encoded in
+                interleaver_.deinterleave( data );
+                interleaver_.deinterleave( reliability );
+                
+                // Correct errors, treating unreliable bytes as erasures
+                static const unsigned int fec_stage = StageTimers::instance().stage( "fec_decode" );
+                {
+                    ScopedStageTimer timer( fec_stage );
+                    try {fec.decodeWithReliability( data, reliability );}
+                    catch (FecDecodeException &e) {
+                      std::cout << "Error decoding FEC codes: " << e.what() << std::endl;
+                      return 3;
+                    }
                 }
                 
                 // Remove padding
@@ -291,37 +1324,110 @@ namespace efb {
                         |   (data[data.size()-1] << 16);
                 while (data.size() > final_size) data.pop_back();
                 
-                // Retrieve the message key from the header and decrypt the data
+                return 0;
+            }
+            
+            //! Decrypt an image file and save the data to another file, using the cache if the image has been decrypted before. Returns zero on success, otherwise the decryptFileFromImage error code.
+            /**
+                This may be called from several threads at once, provided each has its own image and FEC objects. Image decoding and error correction run in parallel, but decryption is serialised.
+            */
+            unsigned int decryptImageFile
+            (
+                IConduitImage& img,
+                const IFec& fec,
+                const char* img_in_filename,
+                const char* data_filename
+            )
+            {
+                // Key the cache on the image file's bytes. If they can't be read, let loading report the error.
+                std::vector<byte> key, data;
+                bool cacheable = readFileBytes( img_in_filename, data );
+                if (cacheable) {
+                    key = cacheKey( IMAGE_ENTRY, data.empty() ? NULL : &data[0], data.size() );
+                    if ( cache_.find( key, data ) )
+                        return writeDataFile( data, 0, data_filename );
+                }
+                
+                // Load the image, extract the data and correct errors
+                unsigned int result = extractFromImage( img, fec, img_in_filename, data );
+                if (result != 0) return result;
+                
+                // Retrieve the message key from the header and decrypt the data. The header size depends on the IV just parsed, which another thread may replace as soon as the lock is released.
+                unsigned int head_size = 0;
+                {
+                    ScopedLock lock( crypto_mutex_ );
+                    result = decryptExtractedData( data );
+                    if (result == 0) head_size = crypto_.retrieveHeaderSize(data);
+                }
+                if (result != 0) return result;
+                
+                // Save data to a file, skipping the header
+                if (cacheable)
+                    cache_.insert( key, &data[0] + head_size, data.size() - head_size );
+                return writeDataFile( data, head_size, data_filename );
+            }
+            
+            //! Digest used as a cache key. The entry type is appended so strings and images are never confused. Safe to call without crypto_mutex_, as messageDigest touches no crypto state.
+            std::vector<byte> cacheKey( CacheEntryType type, const byte* bytes, unsigned int size ) const
+            {
+                std::vector<byte> key = crypto_.messageDigest( bytes, size );
+                key.push_back( (byte) type );
+                return key;
+            }
+            
+            //! Read a whole file into a byte array. Returns false on failure.
+            static bool readFileBytes( const char* filename, std::vector<byte>& bytes )
+            {
+                std::ifstream file( filename, std::ios::binary );
+                if (!file.is_open()) return false;
+                file.seekg(0, std::ios::end);
+                std::streamoff size = file.tellg();
+                if (size < 0) return false;
+                file.seekg(0, std::ios::beg);
+                bytes.resize( size );
+                if (size > 0) file.read((char*) &bytes[0], size);
+                return !file.fail();
+            }
+            
+            //! Retrieve the message key from the header and decrypt data extracted from an image.
+            unsigned int decryptExtractedData( std::vector<byte>& data )
+            {
+                static const unsigned int stage = StageTimers::instance().stage( "decrypt" );
+                ScopedStageTimer timer( stage );
                 try {crypto_.decryptMessage(data);}
                 catch (DecryptionException &e) {
                   std::cout << "Error decrypting: " << e.what() << std::endl;
                   return 4;
                 }
-                
-                // Save data to a file, skipping the header
-                head_size = crypto_.retrieveHeaderSize(data);
+                return 0;
+            }
+            
+            //! Save decrypted data to a file, skipping the first head_size bytes.
+            static unsigned int writeDataFile( const std::vector<byte>& data, unsigned int head_size, const char* data_filename )
+            {
+                std::ofstream data_file;  // data file object
                 data_file.open( data_filename, std::ios::binary);
                 if(!data_file.is_open()) {
                   std::cout << "Error creating data file:" << std::endl;
                   return 1;
                 }
-                data_file.write((char*) &data[head_size], data.size()-head_size );
-                
-                // delete the image object
-                delete &img;
-                
-                // Return with success
-                return 0; 
+                if (data.size() > head_size)
+                    data_file.write((const char*) &data[head_size], data.size()-head_size );
+                return 0;
             }
             
-            //! Take a message string and encrypt into a Facebook-ready string. Both will be null terminated.
-            const char* encryptString
-            (
-                const char* ids,
-                const char*  input
-            ) const
+            //! Read the next chunk of a file, of up to FILE_CHUNK bytes but no more than remaining. Returns false if the file ends early.
+            static bool readFileChunk( std::ifstream& data_file, unsigned int remaining, std::vector<byte>& chunk )
+            {
+                chunk.resize( (remaining < FILE_CHUNK) ? remaining : (unsigned int) FILE_CHUNK );
+                data_file.read( (char*) &chunk[0], chunk.size() );
+                return data_file.gcount() == (std::streamsize) chunk.size();
+            }
+            
+            
+            //! Parse a semi-colon delimited (and terminated) list of recipient IDs, adding the user's own ID at the end.
+            std::vector<FacebookId> parseIds( const char* ids ) const
             {
-                // Load IDs into a vector (currently they are semi-colon delimited)
                 std::string id_string;
                 std::vector<FacebookId> ids_vector;
                 unsigned int i = 0;
@@ -336,133 +1442,160 @@ namespace efb {
                     ids_vector.push_back(id_object);
                     i++;
                 }
-                                
+                
                 // Add the user's ID
                 ids_vector.push_back( id_ );
-                
-                // Copy data into a vector<byte> **INCLUDING** the null terminal. Leave room for the header at the start.
-                unsigned int head_size = crypto_.calculateHeaderSize( ids_vector.size() );
-                std::vector<byte> data( head_size, (byte)0);
-                for (unsigned int i=0; i<strlen(input)+1; i++) data.push_back( input[i] );
-                                        
+                return ids_vector;
+            }
+            
+            //! Template image into which messages are encoded.
+            static const char* templateFilename()
+            {
+                // !!!TODO!!! - For now we use a specific template image located on the desktop
+                return "/home/chris/Desktop/src.bmp";
+            }
+            
+            //! Check whether a message of the given size (including its header) fits in an image once the length tag and error correction are added.
+            bool fitsInImage( unsigned int message_size, IConduitImage& img ) const
+            {
+                return fec_.codeLength( message_size + 3 ) <= img.getMaxData();
+            }
+            
+            //! Encrypt data (which starts with room for the header), add the length tag and error correction, and store it in a loaded template image. Returns zero on success, otherwise the encryptFileInImage error code.
+            unsigned int implantMessage
+            (
+                std::vector<FacebookId>& ids_vector,
+                std::vector<byte>& data,
+                IConduitImage& img
+            )
+            {
                 // Generate header and encrypt the data
-                try {crypto_.encryptMessage(ids_vector, data);}
-                catch (EncryptionException &e) {
-                    std::cout << "Error encrypting: " << e.what() << std::endl;
-                    return "";
+                static const unsigned int encrypt_stage = StageTimers::instance().stage( "encrypt" );
+                {
+                    ScopedStageTimer timer( encrypt_stage );
+                    try {crypto_.encryptMessage(ids_vector, data);}
+                    catch (EncryptionException &e) {
+                      std::cout << "Error encrypting: " << e.what() << std::endl;
+                        return 4;
+                    }
                 }
                 
-                // Create Facebook ready string to upload
-                std::string str = string_codec_.binaryToFbReady( data );
-                char* cstr = new char [str.size()+1];
-                strcpy(cstr, str.c_str());
-                
-                return cstr;
+                return encodeInImage( data, img, fec_ );
             }
             
-            //! Take string from Facebook and decrypt to a message string. Both will be null terminated.
-            const char* decryptString
+            //! Add the length tag and error correction to a message, and store it in a loaded template image. Returns zero on success, otherwise the encryptFileInImage error code.
+            unsigned int encodeInImage
             (
-                const char*  input
+                std::vector<byte>& data,
+                IConduitImage& img,
+                const IFec& fec
             ) const
             {
-                // Copy input into a std::string (strips null terminal)
-                std::string str( input );
+                unsigned int final_size=0; // size before we insert into image
                 
-                // Decode the string into a byte array
-                std::vector<byte> data;
-                try {
-                    data = string_codec_.fbReadyToBinary( str );
-                } catch (StringDecodeException &e) {
-                    std::cout << "UTF8 decode failed: " << e.what() << std::endl;
+                // Pad the data to full length
+                final_size = data.size();
+                if (!fitsInImage( final_size, img )) {
+                    std::cout << "File is too big." << std::endl;
+                    return 1;
                 }
+                data.reserve( img.getMaxData() ); // we know the max number of items possible to store
+                srand( time(NULL) );
+                while ( fec.codeLength( data.size()+3+1 ) < img.getMaxData() )
+                {
+                    data.push_back( (byte) rand() );
+                }
+                // Add the length to the end
+                data.push_back( (final_size >> 0) & 0x000000ff );
+                data.push_back( (final_size >> 8) & 0x000000ff );
+                data.push_back( (final_size >> 16) & 0x000000ff );
                 
-                // Retrieve the message key from the header and decrypt the data
-                try {crypto_.decryptMessage(data);}
-                catch (DecryptionException &e) {
-                    std::cout << "Error decrypting: " << e.what() << std::endl;
-                    return "You do not have sufficient privileges to read this message.";
+                // Add error correction code
+                static const unsigned int fec_stage = StageTimers::instance().stage( "fec_encode" );
+                {
+                    ScopedStageTimer timer( fec_stage );
+                    try {fec.encode( data );}
+                    catch (FecEncodeException &e) {
+                      std::cout << "Error adding error correction code: " << e.what() << std::endl;
+                      return 2;
+                    }
                 }
                 
-                // Bytes should now be original (UTF8, null terminated) message. We must skip the header.
-                unsigned int head_size = crypto_.retrieveHeaderSize(data);
-                char* cstr = new char [data.size() - head_size];
-                strcpy( cstr, (char*) &data[head_size] );
-                return cstr;
+                // Spread each codeword across the image
+                interleaver_.interleave( data );
+              
+                // Store the data vector in the image
+                static const unsigned int implant_stage = StageTimers::instance().stage( "implant_data" );
+                ScopedStageTimer timer( implant_stage );
+                try {img.implantData( data );}
+                catch (ConduitImageImplantException &e) {
+                    std::cout << "Error implanting data: " << e.what() << std::endl;
+                    return 4;
+                }
+                return 0;
             }
             
-            //! Calculate bit error rate (for debugging purposes).
-            unsigned int calculateBitErrorRate
-            (
-                const char*  file1_path,
-                const char*  file2_path
-            )
+            //! Load a JPEG or BMP image from memory (the format is detected from its signature), optionally to extract data from. Returns false on failure.
+            static bool loadImageBuffer( IConduitImage& img, const byte* buffer, unsigned int size, bool for_extraction = false )
             {
-                //return testImageCoding();
-            
-                // ifstream objects
-                std::ifstream file1, file2;
-                // open file 1
-                file1.open( file1_path, std::ios::binary );
-                if(!file1.is_open()) {
-                    std::cout << "Error opening data file 1:" << std::endl;
-                    return 1;
+                if (buffer == NULL || size < 2) {
+                    std::cout << "Error loading image: empty buffer." << std::endl;
+                    return false;
                 }
-                // and file 2
-                file2.open( file2_path, std::ios::binary );
-                if(!file2.is_open()) {
-                    std::cout << "Error opening data file 2:" << std::endl;
-                    return 1;
+                // Wrap the buffer in a read-only stream so CImg can decode it in place
+                static const unsigned int stage = StageTimers::instance().stage( "load_image" );
+                ScopedStageTimer timer( stage );
+                std::FILE* file = fmemopen( const_cast<byte*>(buffer), size, "rb" );
+                if (file == NULL) {
+                    std::cout << "Error loading image: could not open buffer." << std::endl;
+                    return false;
                 }
-                // vector byte arrays 
-                std::vector<byte> data1, data2;
-                // load file 1 into array
-                file1.seekg(0, std::ios::end);
-                size_t file1_size = file1.tellg(); // get the length of the file
-                file1.seekg(0, std::ios::beg);
-                data1.resize( file1_size );
-                // read into array
-                file1.read((char*) &data1[0], file1_size);
-                // load file 2 into array
-                file2.seekg(0, std::ios::end);
-                size_t file2_size = file2.tellg(); // get the length of the file
-                file2.seekg(0, std::ios::beg);
-                data2.resize( file2_size );
-                // read into array
-                file2.read((char*) &data2[0], file2_size);
-                
-                // Calculate the BER and output to std::cout
-                unsigned int total=0, errors=0; std::vector<byte> e;
-                for (unsigned int i=0; i<data1.size(); i++) {
-                  byte error = data1[i] ^ data2[i];
-                  e.push_back( error );
-                  std::bitset<8> bs( error );
-                  errors += bs.count();
-                  total += 8;
+                bool ok = true;
+                try {
+                    if (buffer[0] == 0xff && buffer[1] == 0xd8) {
+                        if (for_extraction) img.loadJpegForExtraction( file );
+                        else img.load_jpeg( file );
+                    }
+                    else if (buffer[0] == 'B' && buffer[1] == 'M') img.load_bmp( file );
+                    else {
+                        std::cout << "Error loading image: unsupported format." << std::endl;
+                        ok = false;
+                    }
                 }
-                std::cout << errors << " errors in " << total <<" bits. ";
-                std::cout << ((float) errors) / total << std::endl;
-                
-                // Write out errors to a file
-                std::ofstream error_file;
-                error_file.open( "/home/chris/Desktop/errors.bin", std::ios::binary);
-                if(!error_file.is_open()) {
-                  std::cout << "Error creating error file:" << std::endl;
-                  return 1;
+                catch (cimg_library::CImgException &e) {
+                    std::cout << "Error loading image: " << e.what() << std::endl;
+                    ok = false;
                 }
-                error_file.write((char*) &e[0], e.size() );
-                
-                return 0;
+                std::fclose( file );
+                return ok;
             }
-              
-        private :
-            const ILibFactory& factory_;
-            ICrypto& crypto_; // not const, has state (key and iv)
-            const IFec& fec_;
-            const IStringCodec& string_codec_;
-            const FacebookId id_;
-            const std::string working_directory_;
             
+            //! Encode an image as a BMP into a newly allocated buffer, which must be released with freeBuffer. Returns false on failure.
+            static bool saveImageBuffer( const IConduitImage& img, byte** buffer, unsigned int* size )
+            {
+                char* stream_buffer = NULL;
+                size_t stream_size = 0;
+                std::FILE* file = open_memstream( &stream_buffer, &stream_size );
+                if (file == NULL) {
+                    std::cout << "Error saving image: could not open buffer." << std::endl;
+                    return false;
+                }
+                bool ok = true;
+                try {img.save_bmp( file );}
+                catch (cimg_library::CImgException &e) {
+                    std::cout << "Error saving image: " << e.what() << std::endl;
+                    ok = false;
+                }
+                // The buffer is only complete once the stream is closed
+                if (std::fclose( file ) != 0) ok = false;
+                if (!ok) {
+                    std::free( stream_buffer );
+                    return false;
+                }
+                *buffer = (byte*) stream_buffer;
+                *size = stream_size;
+                return true;
+            }
             
             //! Testing function for image coding methods
             unsigned int testImageCoding()
@@ -629,6 +1762,211 @@ namespace efb {
                 return 0;
             }
     
+            //! Testing function checking the vectorised Haar kernels exactly match the scalar kernel.
+            /**
+                Each supported vector path is compared against the scalar path on random pixel tiles (forward transform), random coefficients in the range -1024 to 1023 (inverse transform, which exercises truncateCoefficients heavily) and whole rows of tiles (implant and extract). Tile counts are chosen so the scalar tail is exercised too. Returns the number of mismatches.
+            */
+            unsigned int testHaarKernels()
+            {
+                const unsigned int tiles = 725, stride = 720, row_tiles = 90;
+                std::vector<short int> in(64*tiles), ref(64*tiles), out(64*tiles);
+                std::vector<byte> img(8*stride), img_ref, img_out, data(3*row_tiles), data_ref, data_out;
+                unsigned int failures = 0;
+                srand( time(NULL) );
+                
+                HaarKernels::Path paths[2] = { HaarKernels::SSE2, HaarKernels::AVX2 };
+                for (unsigned int p=0; p<2; p++) {
+                    if (!HaarKernels::supported( paths[p] )) {
+                        std::cout << "Haar kernel path " << paths[p] << " not supported, skipping." << std::endl;
+                        continue;
+                    }
+                    unsigned int path_failures = 0;
+                    for (unsigned int trial=0; trial<100; trial++) {
+                        // Forward transform of random pixels
+                        for (unsigned int i=0; i<in.size(); i++) in[i] = rand() % 256;
+                        HaarKernels::forwardTiles( &in[0], &ref[0], tiles, HaarKernels::SCALAR );
+                        HaarKernels::forwardTiles( &in[0], &out[0], tiles, paths[p] );
+                        if (ref != out) path_failures++;
+                        
+                        // Inverse transform of random coefficients, many of which need clamping
+                        for (unsigned int i=0; i<in.size(); i++) in[i] = (rand() % 2048) - 1024;
+                        HaarKernels::inverseTiles( &in[0], &ref[0], tiles, HaarKernels::SCALAR );
+                        HaarKernels::inverseTiles( &in[0], &out[0], tiles, paths[p] );
+                        if (ref != out) path_failures++;
+                        
+                        // Implant and extract a row of tiles
+                        for (unsigned int i=0; i<img.size(); i++) img[i] = rand();
+                        for (unsigned int i=0; i<data.size(); i++) data[i] = rand();
+                        img_ref = img_out = img;
+                        HaarKernels::implantRow( &data[0], 3, &img_ref[0], stride, row_tiles, HaarKernels::SCALAR );
+                        HaarKernels::implantRow( &data[0], 3, &img_out[0], stride, row_tiles, paths[p] );
+                        if (img_ref != img_out) path_failures++;
+                        data_ref = data_out = data;
+                        HaarKernels::extractRow( &img[0], stride, &data_ref[0], 3, row_tiles, HaarKernels::SCALAR );
+                        HaarKernels::extractRow( &img[0], stride, &data_out[0], 3, row_tiles, paths[p] );
+                        if (data_ref != data_out) path_failures++;
+                    }
+                    std::cout << "Haar kernel path " << paths[p] << ": " << path_failures << " mismatches." << std::endl;
+                    failures += path_failures;
+                }
+                return failures;
+            }
+            
+            //! Testing function checking every GF(2^8) kernel path exactly matches Schifra.
+            /**
+                Random messages are encoded with each supported path and compared against Schifra's polynomial division (message x^fec mod generator), and random codewords (some of them valid) have their syndromes compared against Schifra's polynomial evaluation at each generator root. The (255,223) code used by ReedSolomon255Fec is tested, as well as shortened codes and fewer roots so that partial registers and odd root counts are exercised. Returns the number of mismatches.
+            */
+            unsigned int testGaloisKernels()
+            {
+                schifra::galois::field field( 8, schifra::galois::primitive_polynomial_size06, schifra::galois::primitive_polynomial06 );
+                const unsigned int codes[4][3] = { {255,32,120}, {255,16,120}, {100,31,1}, {40,7,0} };
+                unsigned int failures = 0;
+                srand( time(NULL) );
+                
+                GaloisKernels::Path paths[3] = { GaloisKernels::SCALAR, GaloisKernels::SSSE3, GaloisKernels::AVX2 };
+                for (unsigned int p=0; p<3; p++) {
+                    if (!GaloisKernels::supported( paths[p] )) {
+                        std::cout << "Galois kernel path " << paths[p] << " not supported, skipping." << std::endl;
+                        continue;
+                    }
+                    unsigned int path_failures = 0;
+                    for (unsigned int c=0; c<4; c++) {
+                        const unsigned int n = codes[c][0], fec = codes[c][1], root = codes[c][2], k = n - fec;
+                        schifra::galois::field_polynomial generator( field );
+                        schifra::sequential_root_generator_polynomial_creator( field, root, fec, generator );
+                        GaloisEncoderTables encoder;
+                        GaloisSyndromeTables syndromes;
+                        if (!GaloisKernels::init( encoder, field, generator, fec )) {
+                            path_failures++;
+                            continue;
+                        }
+                        GaloisKernels::init( syndromes, field, root, fec );
+                        
+                        std::vector<byte> codeword( n ), parity( fec ), syndrome( fec );
+                        for (unsigned int trial=0; trial<200; trial++) {
+                            // Encode a random message
+                            for (unsigned int i=0; i<k; i++) codeword[i] = rand();
+                            schifra::galois::field_polynomial message( field, n-1 );
+                            for (unsigned int i=0; i<k; i++) message[n-1-i] = codeword[i];
+                            schifra::galois::field_polynomial remainder = message % generator;
+                            GaloisKernels::encode( encoder, &codeword[0], k, &parity[0], paths[p] );
+                            for (unsigned int i=0; i<fec; i++)
+                                if (parity[i] != (byte) remainder[fec-1-i].poly()) { path_failures++; break; }
+                            
+                            // Evaluate the syndromes of the codeword, corrupted half of the time
+                            for (unsigned int i=0; i<fec; i++) codeword[k+i] = parity[i];
+                            if (trial % 2) codeword[rand() % n] ^= 1 + (rand() % 255);
+                            schifra::galois::field_polynomial received( field, n-1 );
+                            for (unsigned int i=0; i<n; i++) received[n-1-i] = codeword[i];
+                            unsigned int flag = GaloisKernels::syndromes( syndromes, &codeword[0], n, &syndrome[0], paths[p] );
+                            unsigned int ref_flag = 0;
+                            for (unsigned int r=0; r<fec; r++) {
+                                schifra::galois::field_symbol s = received( field.alpha( root + r ) ).poly();
+                                ref_flag |= s;
+                                if (syndrome[r] != (byte) s) { path_failures++; break; }
+                            }
+                            if ((flag == 0) != (ref_flag == 0) || (trial % 2 == 0 && flag != 0)) path_failures++;
+                        }
+                    }
+                    std::cout << "Galois kernel path " << paths[p] << ": " << path_failures << " mismatches." << std::endl;
+                    failures += path_failures;
+                }
+                return failures;
+            }
+            
+            //! Testing function checking LanczosResize against CImg's Lanczos resize.
+            /**
+                Smooth and random images of several shapes (downscaled, upscaled, one axis each way, already the right size) are formatted with each supported path. The result must exactly match CImg resizing the first channel alone, and it is compared with what formatting through CImg gave (which differs by at most one level - see LanczosResize). Returns the number of mismatched pixels.
+            */
+            unsigned int testLanczosResize()
+            {
+                const unsigned int shapes[6][3] = { {4000,3000,3}, {1023,767,3}, {720,720,3}, {500,400,1}, {3,1000,3}, {721,719,1} };
+                unsigned int failures = 0;
+                srand( time(NULL) );
+                
+                LanczosResize::Path paths[2] = { LanczosResize::SCALAR, LanczosResize::SSE2 };
+                for (unsigned int s=0; s<6; s++) {
+                    cimg_library::CImg<byte> src( shapes[s][0], shapes[s][1], 1, shapes[s][2] );
+                    cimg_forXYC( src, x, y, c )
+                        src( x, y, 0, c ) = (s % 2) ? (byte) rand() :
+                            (byte) (128 + 100*std::sin( x*0.05 + c )*std::cos( y*0.031 ) + (rand() % 20));
+                    cimg_library::CImg<byte> exact = src.get_channel( 0 ).resize( 720, 720, 1, 1, 6 );
+                    cimg_library::CImg<byte> cimg = src.get_resize( 720, 720, 1, -1, 6 ).channel( 0 );
+                    
+                    for (unsigned int p=0; p<2; p++) {
+                        if (!LanczosResize::supported( paths[p] )) continue;
+                        cimg_library::CImg<byte> img( src );
+                        LanczosResize::formatImage( img, 720, 720, paths[p] );
+                        unsigned int mismatches = 0, differ = 0, max_diff = 0;
+                        cimg_forXY( img, x, y ) {
+                            if (img( x, y ) != exact( x, y )) mismatches++;
+                            unsigned int diff = std::abs( (int) img( x, y ) - (int) cimg( x, y ) );
+                            if (diff > 0) differ++;
+                            max_diff = std::max( max_diff, diff );
+                        }
+                        std::cout << shapes[s][0] << "x" << shapes[s][1] << "x" << shapes[s][2]
+                                  << ", Lanczos path " << paths[p] << ": " << mismatches << " mismatches, "
+                                  << differ << " pixels differ from CImg formatting by at most " << max_diff << "." << std::endl;
+                        failures += mismatches;
+                    }
+                }
+                return failures;
+            }
+            
+            //! Testing function checking UpsampledConduitImage reliability scores against the symbols pixels decode to.
+            /**
+                For every order and pixel value, an image with every pixel at that value is extracted, and again with every pixel at the nearest value which decodes to a different symbol, on the side of the nearer decision boundary. Exactly the bytes which change between the two must be scored as unreliable. Values within one of a level's centre are skipped, as are the bytes of a pixel beyond an outermost level, which has no neighbour on that side. Returns the number of mismatched bytes.
+            */
+            unsigned int testUpsampledReliability()
+            {
+                unsigned int failures = 0;
+                failures += testUpsampledReliability<1>();
+                failures += testUpsampledReliability<2>();
+                failures += testUpsampledReliability<3>();
+                failures += testUpsampledReliability<4>();
+                failures += testUpsampledReliability<5>();
+                failures += testUpsampledReliability<6>();
+                return failures;
+            }
+            
+            //! Test reliability scores for one order, as testUpsampledReliability.
+            template <unsigned int Order>
+            unsigned int testUpsampledReliability()
+            {
+                typedef UpsampledConduitImage<Order, 8, 8> Image;
+                std::vector<byte> decoded[256];
+                for (unsigned int v=0; v<256; v++) {
+                    Image img;
+                    img.assign( 8, 8, 1, 1, (byte) v );
+                    img.extractData( decoded[v] );
+                }
+                
+                unsigned int failures = 0;
+                for (int v=0; v<256; v++) {
+                    // Find the nearest values either side which decode differently, and the centre of the level between them (an outermost level is FACTOR wide, its centre at or beyond the end of the range)
+                    int up = v, down = v;
+                    while (up < 256 && decoded[up] == decoded[v]) up++;
+                    while (down >= 0 && decoded[down] == decoded[v]) down--;
+                    float centre =
+                        (down < 0) ? up - 0.5f - Image::FACTOR/2.0f :
+                        (up > 255) ? down + 0.5f + Image::FACTOR/2.0f : (up + down)/2.0f;
+                    if (std::fabs( v - centre ) <= 1.0f) continue;
+                    int w = (v > centre) ? up : down;
+                    
+                    Image img;
+                    img.assign( 8, 8, 1, 1, (byte) v );
+                    std::vector<byte> data, reliability;
+                    img.extractDataWithReliability( data, reliability );
+                    if (data != decoded[v]) failures++;
+                    for (unsigned int b=0; b<Order; b++) {
+                        bool flips = (w >= 0 && w < 256) && decoded[w][b] != data[b];
+                        if (flips != (reliability[b] < 255)) failures++;
+                    }
+                }
+                std::cout << "Upsampled order " << Order << " reliability: " << failures << " mismatches." << std::endl;
+                return failures;
+            }
+            
             //! Testing function for UTF-8 encoding
             unsigned int testUTF8Decode(std::vector<byte> data)
             {
@@ -10,6 +10,7 @@
 // eFB Library sub-component includes
 #include "crypto/ICrypto.h"
 #include "fec/IFec.h"
+#include "interleaver/IInterleaver.h"
 #include "conduit_image/IConduitImage.h"
 #include "string_codec/IStringCodec.h"
 
@@ -28,6 +29,8 @@ namespace efb {
             virtual ICrypto& create_ICrypto() const = 0;
             //! Forward error correction library object creater.
             virtual IFec& create_IFec() const = 0;
+            //! Interleaver object creater, used between the forward error correction and the conduit image.
+            virtual IInterleaver& create_IInterleaver() const = 0;
             //! String codec object creater.
             virtual IStringCodec& create_IStringCodec() const = 0;
     };
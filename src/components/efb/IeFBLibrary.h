@@ -47,6 +47,60 @@ class IeFBLibrary
             const char*  img_in_filename,
             const char*  data_filename
         ) = 0;
+        //! Encrypt a buffer into an image for the supplied array of recipients, without touching the file system.
+        /**
+            The template image is supplied as JPEG or BMP bytes. The encoded image is returned as BMP bytes in a newly allocated buffer, ownership of which passes to the caller - it must be released with freeBuffer. The input buffers are only read.
+        */
+        virtual unsigned int encryptBufferInImage
+        (
+            const char* ids,
+            const unsigned char* data_in,
+            unsigned int data_size,
+            const unsigned char* img_in,
+            unsigned int img_in_size,
+            unsigned char** img_out,
+            unsigned int* img_out_size
+        ) = 0;
+        //! Attempt to extract and decrypt data from an image supplied as JPEG or BMP bytes. The data is returned in a newly allocated buffer, ownership of which passes to the caller - it must be released with freeBuffer.
+        virtual unsigned int decryptBufferFromImage
+        (
+            const unsigned char* img_in,
+            unsigned int img_in_size,
+            unsigned char** data_out,
+            unsigned int* data_out_size
+        ) = 0;
+        //! Release a buffer returned by the library (image or data bytes, or a timer snapshot string).
+        virtual void freeBuffer
+        (
+            void* buffer
+        ) const = 0;
+        //! Attempt to extract and decrypt files from a batch of images in parallel. A status code for each image is written to results, and the number of failures is returned.
+        virtual unsigned int decryptFilesFromImages
+        (
+            unsigned int count,
+            const char** img_in_filenames,
+            const char** data_filenames,
+            unsigned int* results
+        ) = 0;
+        //! Encrypt a file across a set of images, for files too big for a single image.
+        /**
+            The encrypted message is split evenly across the images, each of which carries a header giving its place in the set. If parity is non-zero the last image holds the XOR of the others, so that any one image of the set may be lost. A status code for the first image which failed is returned.
+        */
+        virtual unsigned int encryptFileInImageSet
+        (
+            const char* ids,
+            const char* data_filename,
+            unsigned int count,
+            const char** img_out_filenames,
+            unsigned int parity
+        ) = 0;
+        //! Attempt to reassemble and decrypt a file from a set of images, which may be supplied in any order.
+        virtual unsigned int decryptFileFromImageSet
+        (
+            unsigned int count,
+            const char** img_in_filenames,
+            const char* data_filename
+        ) = 0;
         
         //! Take a message string and encrypt into a Facebook-ready string. Both will be null terminated.
         virtual const char* encryptString
@@ -58,6 +112,12 @@ class IeFBLibrary
         virtual const char* decryptString(
             const char*  input
         ) const = 0;
+        //! Get the number of decryptions which were, and were not, answered from the cache of decrypted messages.
+        virtual void getCacheStatistics
+        (
+            unsigned int* hits,
+            unsigned int* misses
+        ) const = 0;
         
         //! Debug function for calculating BER
         virtual unsigned int calculateBitErrorRate
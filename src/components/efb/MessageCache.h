@@ -0,0 +1,123 @@
+#ifndef EFB_MESSAGECACHE_H
+#define EFB_MESSAGECACHE_H
+
+// Standard libary includes
+#include <list>
+#include <map>
+#include <vector>
+#include <utility>
+
+// eFB Library sub-component includes
+#include "Common.h"
+#include "Threading.h"
+
+namespace efb {
+
+    //! Bounded least-recently-used cache of decrypted messages, keyed by a digest of their ciphertext.
+    /**
+        Decrypting a message means running the whole extraction pipeline and a private key operation, so a page which is re-rendered would otherwise pay that again for everything it has already shown. The cache is bounded both by the number of entries and by the total plaintext size; when either limit is exceeded the least recently used entries are evicted. Plaintext is sensitive, so it is wiped from memory whenever an entry is evicted or the cache is cleared. All methods are safe to call from several threads.
+    */
+    class MessageCache
+    {
+        typedef std::vector<byte> Key;
+        typedef std::pair<Key, std::vector<byte> > Entry; // (digest, plaintext)
+        typedef std::list<Entry> EntryList; // most recently used at the front
+
+        //! Overwrite a buffer with zeros in a way the compiler may not optimise away.
+        static void wipe( std::vector<byte>& buffer )
+        {
+            volatile byte* p = buffer.empty() ? NULL : &buffer[0];
+            for (unsigned int i=0; i<buffer.size(); i++) p[i] = 0;
+            buffer.clear();
+        }
+
+        //! Remove the least recently used entry. Call with mutex_ held.
+        void evictOldest()
+        {
+            Entry& oldest = entries_.back();
+            bytes_ -= oldest.second.size();
+            index_.erase( oldest.first );
+            wipe( oldest.second );
+            entries_.pop_back();
+        }
+
+        const unsigned int max_entries_;
+        const unsigned int max_bytes_;
+        EntryList entries_;
+        std::map<Key, EntryList::iterator> index_;
+        unsigned int bytes_;
+        unsigned int hits_, misses_;
+        Mutex mutex_;
+
+        public :
+            //! Constructor, taking the maximum number of entries and the maximum total plaintext size in bytes.
+            MessageCache( unsigned int max_entries, unsigned int max_bytes ) :
+                max_entries_( max_entries ),
+                max_bytes_( max_bytes ),
+                bytes_( 0 ),
+                hits_( 0 ),
+                misses_( 0 )
+            {}
+
+            ~MessageCache() { clear(); }
+
+            //! Look up the plaintext stored under a digest, counting a hit or a miss. Returns false if there is none.
+            bool find( const Key& digest, std::vector<byte>& plaintext )
+            {
+                ScopedLock lock( mutex_ );
+                std::map<Key, EntryList::iterator>::iterator it = index_.find( digest );
+                if (it == index_.end()) {
+                    misses_++;
+                    return false;
+                }
+                hits_++;
+                // Move the entry to the front of the list
+                entries_.splice( entries_.begin(), entries_, it->second );
+                plaintext = it->second->second;
+                return true;
+            }
+
+            //! Store plaintext under a digest, evicting old entries as required. Plaintext larger than the whole cache is not stored.
+            /**
+                The plaintext is copied straight into the new entry, so no copy is left behind unwiped.
+            */
+            void insert( const Key& digest, const byte* plaintext, unsigned int size )
+            {
+                if (size > max_bytes_ || max_entries_ == 0) return;
+                ScopedLock lock( mutex_ );
+                if (index_.find( digest ) != index_.end()) return; // another thread got here first
+                while ( !entries_.empty() &&
+                    (entries_.size() >= max_entries_ || bytes_ + size > max_bytes_) )
+                {
+                    evictOldest();
+                }
+                entries_.push_front( Entry( digest, std::vector<byte>() ) );
+                entries_.front().second.assign( plaintext, plaintext + size );
+                index_[digest] = entries_.begin();
+                bytes_ += size;
+            }
+
+            //! Store plaintext under a digest, as above.
+            void insert( const Key& digest, const std::vector<byte>& plaintext )
+            {
+                insert( digest, plaintext.empty() ? NULL : &plaintext[0], plaintext.size() );
+            }
+
+            //! Wipe and remove every entry. The hit/miss counters are kept.
+            void clear()
+            {
+                ScopedLock lock( mutex_ );
+                while ( !entries_.empty() ) evictOldest();
+            }
+
+            //! Get the number of lookups which did and did not find an entry.
+            void getStatistics( unsigned int& hits, unsigned int& misses )
+            {
+                ScopedLock lock( mutex_ );
+                hits = hits_;
+                misses = misses_;
+            }
+    };
+}
+
+#endif //EFB_MESSAGECACHE_H
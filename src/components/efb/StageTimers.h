@@ -0,0 +1,240 @@
+#ifndef EFB_STAGETIMERS_H
+#define EFB_STAGETIMERS_H
+
+/**
+################################################################################
+    This file contains the stage timers used to profile the library in place.
+################################################################################
+*/
+
+// Standard library includes
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+// eFB Library sub-component includes
+#include "Threading.h"
+
+namespace efb {
+
+    //! Process-wide registry of named stage timers, with per-thread counters and fixed-bucket latency histograms.
+    /**
+        Timers are off by default, when timing a stage costs one test of a flag. When on, each thread records into its own block of counters, so threads only ever contend for their own (uncontended) lock, and the blocks are only summed when a snapshot is taken. Worker threads come and go with each pool run, so a thread's counters are folded into a retired total when it exits.
+
+        Latencies are measured with the monotonic clock, in microseconds, and counted in buckets with fixed upper bounds running 0.1, 0.2, 0.5, 1, 2, 5 ... 10000 ms, the last bucket taking anything longer.
+    */
+    class StageTimers
+    {
+        public :
+            enum { MAX_STAGES = 64, NUM_BUCKETS = 17 };
+            //! Whole microseconds and counts, held exactly (to 2^53) in a double, as C++98 has no 64-bit integer type.
+            typedef double Micros;
+
+        private :
+            //! Counters for every stage, as recorded by one thread (or by all the threads which have exited).
+            struct Counters
+            {
+                Mutex mutex;
+                Micros count[MAX_STAGES];
+                Micros total[MAX_STAGES];
+                Micros max[MAX_STAGES];
+                Micros buckets[MAX_STAGES][NUM_BUCKETS];
+
+                Counters() { clear(); }
+                void clear()
+                {
+                    std::memset( count, 0, sizeof(count) );
+                    std::memset( total, 0, sizeof(total) );
+                    std::memset( max, 0, sizeof(max) );
+                    std::memset( buckets, 0, sizeof(buckets) );
+                }
+                //! Add another block of counters to this one. Both must be locked.
+                void add( const Counters& other )
+                {
+                    for (unsigned int s=0; s<MAX_STAGES; s++) {
+                        count[s] += other.count[s];
+                        total[s] += other.total[s];
+                        if (other.max[s] > max[s]) max[s] = other.max[s];
+                        for (unsigned int b=0; b<NUM_BUCKETS; b++)
+                            buckets[s][b] += other.buckets[s][b];
+                    }
+                }
+            };
+
+            //! Upper bound of each histogram bucket (bar the last) in microseconds.
+            static Micros bucketBound( unsigned int b )
+            {
+                static const Micros steps[3] = { 1, 2, 5 };
+                Micros bound = steps[b % 3] * 100;
+                for (unsigned int i=0; i<b/3; i++) bound *= 10;
+                return bound;
+            }
+
+            //! Called by pthreads when a thread with counters exits.
+            static void retireThread( void* counters )
+            {
+                instance().retire( static_cast<Counters*>( counters ) );
+            }
+
+            void retire( Counters* counters )
+            {
+                ScopedLock lock( mutex_ );
+                {
+                    ScopedLock counters_lock( counters->mutex );
+                    retired_.add( *counters );
+                }
+                for (unsigned int i=0; i<threads_.size(); i++)
+                    if (threads_[i] == counters) {
+                        threads_.erase( threads_.begin() + i );
+                        break;
+                    }
+                delete counters;
+            }
+
+            //! Get the calling thread's counters, creating them on first use.
+            Counters& threadCounters()
+            {
+                Counters* counters = static_cast<Counters*>( pthread_getspecific( key_ ) );
+                if (counters == NULL) {
+                    counters = new Counters();
+                    pthread_setspecific( key_, counters );
+                    ScopedLock lock( mutex_ );
+                    threads_.push_back( counters );
+                }
+                return *counters;
+            }
+
+            volatile bool enabled_;
+            pthread_key_t key_;
+            Mutex mutex_; // guards names_, threads_ and retired_
+            std::vector<std::string> names_;
+            std::vector<Counters*> threads_;
+            Counters retired_;
+
+            StageTimers() : enabled_( false )
+            {
+                pthread_key_create( &key_, &StageTimers::retireThread );
+            }
+
+        public :
+            //! Get the single, process-wide, set of timers.
+            static StageTimers& instance()
+            {
+                static StageTimers timers;
+                return timers;
+            }
+
+            //! Current monotonic time in microseconds.
+            static Micros now()
+            {
+                timespec t;
+                clock_gettime( CLOCK_MONOTONIC, &t );
+                return ((Micros) t.tv_sec) * 1000000 + t.tv_nsec / 1000;
+            }
+
+            //! Check whether timing is switched on.
+            bool enabled() const { return enabled_; }
+
+            //! Switch timing on or off.
+            void setEnabled( bool enabled ) { enabled_ = enabled; }
+
+            //! Get the index of a named stage, registering it if it is new. Look this up once for each call site, since it takes a lock.
+            unsigned int stage( const char* name )
+            {
+                ScopedLock lock( mutex_ );
+                for (unsigned int s=0; s<names_.size(); s++)
+                    if (names_[s] == name) return s;
+                if (names_.size() == MAX_STAGES) return MAX_STAGES - 1; // shouldn't happen - share the last slot
+                names_.push_back( name );
+                return names_.size() - 1;
+            }
+
+            //! Record one run of a stage on the calling thread.
+            void record( unsigned int stage, Micros elapsed )
+            {
+                Counters& counters = threadCounters();
+                unsigned int b = 0;
+                while (b < NUM_BUCKETS-1 && elapsed > bucketBound( b )) b++;
+                ScopedLock lock( counters.mutex );
+                counters.count[stage]++;
+                counters.total[stage] += elapsed;
+                if (elapsed > counters.max[stage]) counters.max[stage] = elapsed;
+                counters.buckets[stage][b]++;
+            }
+
+            //! Sum the counters across all threads and write them out as JSON, optionally resetting them.
+            std::string snapshot( bool reset )
+            {
+                ScopedLock lock( mutex_ );
+                Counters sum;
+                sum.add( retired_ );
+                if (reset) retired_.clear();
+                for (unsigned int i=0; i<threads_.size(); i++) {
+                    ScopedLock counters_lock( threads_[i]->mutex );
+                    sum.add( *threads_[i] );
+                    if (reset) threads_[i]->clear();
+                }
+
+                std::string json;
+                char buffer[64];
+                json += enabled_ ? "{\"enabled\":true,\"bucket_upper_ms\":[" : "{\"enabled\":false,\"bucket_upper_ms\":[";
+                for (unsigned int b=0; b<NUM_BUCKETS-1; b++) {
+                    std::sprintf( buffer, "%s%g", b ? "," : "", bucketBound( b ) / 1000.0 );
+                    json += buffer;
+                }
+                json += "],\"stages\":[";
+                for (unsigned int s=0; s<names_.size(); s++) {
+                    json += s ? ",{\"name\":\"" : "{\"name\":\"";
+                    json += names_[s];
+                    std::sprintf( buffer, "\",\"count\":%.0f", sum.count[s] );
+                    json += buffer;
+                    std::sprintf( buffer, ",\"total_ms\":%.3f", sum.total[s] / 1000.0 );
+                    json += buffer;
+                    std::sprintf( buffer, ",\"max_ms\":%.3f", sum.max[s] / 1000.0 );
+                    json += buffer;
+                    json += ",\"histogram\":[";
+                    for (unsigned int b=0; b<NUM_BUCKETS; b++) {
+                        std::sprintf( buffer, "%s%.0f", b ? "," : "", sum.buckets[s][b] );
+                        json += buffer;
+                    }
+                    json += "]}";
+                }
+                json += "]}";
+                return json;
+            }
+    };
+
+    //! Time the enclosing scope as one run of a stage, if timing is switched on.
+    /**
+        Usage, looking the stage up only once:
+
+            static const unsigned int stage = StageTimers::instance().stage( "extract" );
+            ScopedStageTimer timer( stage );
+    */
+    class ScopedStageTimer
+    {
+        const unsigned int stage_;
+        const StageTimers::Micros start_;
+
+        // Not copyable
+        ScopedStageTimer( const ScopedStageTimer& );
+        ScopedStageTimer& operator=( const ScopedStageTimer& );
+
+        public :
+            ScopedStageTimer( unsigned int stage ) :
+                stage_( stage ),
+                start_( StageTimers::instance().enabled() ? StageTimers::now() : 0 )
+            {}
+            ~ScopedStageTimer()
+            {
+                // Timing may have been switched on part way through, in which case this run is skipped
+                if (start_ != 0)
+                    StageTimers::instance().record( stage_, StageTimers::now() - start_ );
+            }
+    };
+}
+
+#endif //EFB_STAGETIMERS_H
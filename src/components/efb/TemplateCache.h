@@ -0,0 +1,217 @@
+#ifndef EFB_TEMPLATECACHE_H
+#define EFB_TEMPLATECACHE_H
+
+// Standard libary includes
+#include <map>
+#include <utility>
+#include <string>
+#include <cstdio>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// eFB Library sub-component includes
+#include "Common.h"
+#include "Threading.h"
+#include "conduit_image/IConduitImage.h"
+#include "conduit_image/LanczosResize.h"
+
+namespace efb {
+
+    //! Cache of template images, already formatted for implantation.
+    /**
+        Every image encryption starts from the same template, which has to be decoded and then resampled down to the conduit image's format (Lanczos, single channel) - by far the most expensive part of encoding, and the template rarely changes. Formatted templates are kept in memory, keyed by the source filename and format size, and are re-made whenever the source file's modification time, size or inode changes.
+
+        If a directory is given, each formatted template is also written there in a raw form (a small header then the pixels), and on a miss that file is memory mapped in place of loading the source, so only the first process to use a template pays for formatting it. The mapping is kept for as long as the template is cached and the cached image shares its pixels, so processes share one copy of the template in the page cache and each load copies it just once, into the conduit image. The raw form is written to a temporary file and renamed into place, so another process never maps a partial file. All methods are safe to call from several threads.
+    */
+    class TemplateCache
+    {
+        //! Identity of one version of a source file.
+        struct Version
+        {
+            time_t mtime;
+            off_t size;
+            ino_t inode;
+            bool operator==( const Version& other ) const
+            {
+                return mtime == other.mtime && size == other.size && inode == other.inode;
+            }
+        };
+
+        //! A cached template, either formatted in memory or shared with a mapped file.
+        struct Entry
+        {
+            Version version;
+            cimg_library::CImg<byte> image;
+            void* map;
+            size_t map_size;
+
+            Entry() :
+                map( NULL ),
+                map_size( 0 )
+            {}
+
+            // A shared image doesn't free its pixels, so the mapping can go first
+            ~Entry() { if (map != NULL) munmap( map, map_size ); }
+
+            private :
+                // Not copyable
+                Entry( const Entry& );
+                Entry& operator=( const Entry& );
+        };
+
+        //! Header of a formatted template on disk, followed by width*height pixels.
+        struct PreparedHeader
+        {
+            unsigned int magic, width, height;
+            Version version;
+        };
+        enum { MAGIC = 0x54424645, MAX_ENTRIES = 8 }; // "EFBT"
+
+        //! Get the version of a file, returning false if it can't be read.
+        static bool fileVersion( const char* filename, Version& version )
+        {
+            struct stat s;
+            if (stat( filename, &s ) != 0) return false;
+            version.mtime = s.st_mtime;
+            version.size = s.st_size;
+            version.inode = s.st_ino;
+            return true;
+        }
+
+        //! Name of the formatted form of a template, from a hash (FNV-1a) of the source filename and the format size.
+        std::string preparedFilename( const char* filename, unsigned int width, unsigned int height ) const
+        {
+            unsigned int hash = 2166136261u;
+            for (const char* c = filename; *c; c++) hash = (hash ^ (byte) *c) * 16777619u;
+            char name[64];
+            std::sprintf( name, "template-%08x-%ux%u.efbt", hash, width, height );
+            return directory_ + name;
+        }
+
+        //! Map a formatted template from disk, if there is one for this version of the source. The entry's image shares the mapping, which it keeps.
+        static bool loadPrepared( const std::string& prepared, const Version& version, unsigned int width, unsigned int height, Entry& entry )
+        {
+            int fd = open( prepared.c_str(), O_RDONLY );
+            if (fd < 0) return false;
+            struct stat s;
+            bool ok = fstat( fd, &s ) == 0 && s.st_size == (off_t) (sizeof(PreparedHeader) + width*height);
+            if (ok) {
+                void* map = mmap( NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+                if (map == MAP_FAILED) ok = false;
+                else {
+                    const PreparedHeader* header = static_cast<const PreparedHeader*>( map );
+                    ok = header->magic == MAGIC && header->width == width && header->height == height && header->version == version;
+                    if (ok) {
+                        entry.map = map;
+                        entry.map_size = s.st_size;
+                        entry.image.assign( reinterpret_cast<const byte*>( header + 1 ), width, height, 1, 1, true );
+                    }
+                    else munmap( map, s.st_size );
+                }
+            }
+            ::close( fd );
+            return ok;
+        }
+
+        //! Write a formatted template to disk. Failure (a read-only directory, say) just means it will be formatted again next time.
+        static void savePrepared( const std::string& prepared, const Version& version, const cimg_library::CImg<byte>& image )
+        {
+            PreparedHeader header;
+            header.magic = MAGIC;
+            header.width = image.width();
+            header.height = image.height();
+            header.version = version;
+            char suffix[32];
+            std::sprintf( suffix, ".%d.tmp", (int) getpid() );
+            std::string temporary = prepared + suffix;
+            std::ofstream file( temporary.c_str(), std::ios::binary );
+            file.write( (const char*) &header, sizeof(header) );
+            file.write( (const char*) image.data(), image.size() );
+            file.close();
+            if (file.fail() || std::rename( temporary.c_str(), prepared.c_str() ) != 0)
+                std::remove( temporary.c_str() );
+        }
+
+        //! Drop every entry. The mutex must be held.
+        void clearEntries()
+        {
+            for (std::map<std::string, Entry*>::iterator it = entries_.begin(); it != entries_.end(); ++it)
+                delete it->second;
+            entries_.clear();
+        }
+
+        const std::string directory_;
+        std::map<std::string, Entry*> entries_;
+        Mutex mutex_;
+
+        // Not copyable
+        TemplateCache( const TemplateCache& );
+        TemplateCache& operator=( const TemplateCache& );
+
+        public :
+            //! Constructor, taking the directory to keep formatted templates in (ending in a separator), or an empty string to keep them in memory only.
+            TemplateCache( const std::string& directory ) :
+                directory_( directory )
+            {}
+
+            ~TemplateCache() { clearEntries(); }
+
+            //! Load a template image, formatted to the conduit image's format. Throws a CImgException if it can't be loaded.
+            void load( IConduitImage& img, const char* filename )
+            {
+                unsigned int width = img.getFormatWidth(), height = img.getFormatHeight();
+                Version version;
+                if (!fileVersion( filename, version ))
+                    throw cimg_library::CImgIOException( "TemplateCache::load() : Failed to open file '%s'.", filename );
+
+                char size[32];
+                std::sprintf( size, "@%ux%u", width, height );
+                std::string key = std::string( filename ) + size;
+
+                // Held throughout, so threads wanting the same new template wait for one to format it rather than all doing so
+                ScopedLock lock( mutex_ );
+                std::map<std::string, Entry*>::iterator it = entries_.find( key );
+                if (it == entries_.end() || !(it->second->version == version))
+                {
+                    if (it != entries_.end()) {
+                        delete it->second;
+                        entries_.erase( it );
+                    }
+                    else if (entries_.size() >= MAX_ENTRIES) clearEntries();
+                    Entry* entry = new Entry();
+                    entry->version = version;
+                    std::string prepared = directory_.empty() ? std::string() : preparedFilename( filename, width, height );
+                    if (prepared.empty() || !loadPrepared( prepared, version, width, height, *entry ))
+                    {
+                        // Format as BufferedConduitImage::formatForImplantation does
+                        try {
+                            entry->image.load( filename );
+                            LanczosResize::formatImage( entry->image, width, height );
+                        }
+                        catch (...) {
+                            delete entry;
+                            throw;
+                        }
+                        if (!prepared.empty()) savePrepared( prepared, version, entry->image );
+                    }
+                    it = entries_.insert( std::make_pair( key, entry ) ).first;
+                }
+                // The only copy of the pixels made on a hit, straight from the mapping if there is one
+                img.assign( it->second->image );
+            }
+
+            //! Drop every template held in memory. Formatted templates on disk are kept.
+            void clear()
+            {
+                ScopedLock lock( mutex_ );
+                clearEntries();
+            }
+    };
+
+}
+
+#endif //EFB_TEMPLATECACHE_H
@@ -0,0 +1,177 @@
+#ifndef EFB_THREADING_H
+#define EFB_THREADING_H
+
+/**
+################################################################################
+    This file contains the threading primitives shared by library components.
+################################################################################
+*/
+
+// Standard library includes
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+
+namespace efb {
+
+    //! Get the number of processor cores currently online (at least 1).
+    inline unsigned int numberOfCores()
+    {
+        long n = sysconf( _SC_NPROCESSORS_ONLN );
+        return (n < 1) ? 1 : (unsigned int) n;
+    }
+
+    //! Thin wrapper around a POSIX mutex.
+    class Mutex
+    {
+        pthread_mutex_t mutex_;
+
+        // Not copyable
+        Mutex( const Mutex& );
+        Mutex& operator=( const Mutex& );
+
+        public :
+            Mutex() { pthread_mutex_init( &mutex_, NULL ); }
+            ~Mutex() { pthread_mutex_destroy( &mutex_ ); }
+            void lock() { pthread_mutex_lock( &mutex_ ); }
+            void unlock() { pthread_mutex_unlock( &mutex_ ); }
+    };
+
+    //! Lock a mutex for the lifetime of this object.
+    class ScopedLock
+    {
+        Mutex& mutex_;
+
+        // Not copyable
+        ScopedLock( const ScopedLock& );
+        ScopedLock& operator=( const ScopedLock& );
+
+        public :
+            ScopedLock( Mutex& mutex ) : mutex_( mutex ) { mutex_.lock(); }
+            ~ScopedLock() { mutex_.unlock(); }
+    };
+
+    //! Interface for work which can be split into independent items and run by a worker pool.
+    class IParallelTask
+    {
+        public :
+            virtual ~IParallelTask() {}
+            //! Process a single item. The worker index (0 to pool size - 1) may be used to select per-worker state, since no two threads ever share a worker index.
+            virtual void run( unsigned int item, unsigned int worker ) = 0;
+    };
+
+    //! Fixed size pool of worker threads.
+    /**
+        Each call to run() hands the items of a task out to the workers one at a time, so a slow item does not hold up the others. The call returns once every item has been processed. Tasks must not let exceptions escape from IParallelTask::run - any that do are swallowed, leaving the item unprocessed.
+
+        A call to run() from a thread which is itself running an item of some pool's task (a per-worker FEC object decoding inside a batch, say) processes the items serially on that thread as worker zero, so nested pools never multiply the number of threads.
+    */
+    class WorkerPool
+    {
+        //! Shared state for a single call to run().
+        struct Job
+        {
+            IParallelTask* task;
+            unsigned int num_items;
+            unsigned int next_item;
+            Mutex mutex;
+        };
+
+        //! Per-thread arguments.
+        struct Worker
+        {
+            Job* job;
+            unsigned int index;
+        };
+
+        //! Number of workers in the pool.
+        const unsigned int size_;
+
+        //! Storage for the thread-specific key flagging pool workers.
+        static pthread_key_t& workerKeyStorage()
+        {
+            static pthread_key_t key;
+            return key;
+        }
+
+        static void createWorkerKey() { pthread_key_create( &workerKeyStorage(), NULL ); }
+
+        //! Key whose value is set on threads while they run the items of a task.
+        static pthread_key_t workerKey()
+        {
+            static pthread_once_t once = PTHREAD_ONCE_INIT;
+            pthread_once( &once, &createWorkerKey );
+            return workerKeyStorage();
+        }
+
+        //! Thread entry point - keep taking items until none are left.
+        static void* work( void* arg )
+        {
+            Worker* worker = static_cast<Worker*>( arg );
+            Job& job = *worker->job;
+            pthread_key_t key = workerKey();
+            void* was_worker = pthread_getspecific( key );
+            pthread_setspecific( key, worker );
+            while ( true )
+            {
+                unsigned int item;
+                {
+                    ScopedLock lock( job.mutex );
+                    if ( job.next_item >= job.num_items ) break;
+                    item = job.next_item++;
+                }
+                try { job.task->run( item, worker->index ); }
+                catch (...) {}
+            }
+            pthread_setspecific( key, was_worker );
+            return NULL;
+        }
+
+        public :
+
+            //! Constructor. A size of zero creates one worker per processor core.
+            WorkerPool( unsigned int size = 0 ) :
+                size_( size == 0 ? numberOfCores() : size )
+            {}
+
+            //! Get the number of workers in the pool.
+            unsigned int size() const { return size_; }
+
+            //! Check whether the calling thread is running an item of a pool's task.
+            static bool onWorker() { return pthread_getspecific( workerKey() ) != NULL; }
+
+            //! Get the number of workers a call to run() from this thread would use at most - just one if it is already a pool worker.
+            unsigned int available() const { return onWorker() ? 1 : size_; }
+
+            //! Run the task over items 0 to num_items - 1, blocking until all are done.
+            void run( IParallelTask& task, unsigned int num_items ) const
+            {
+                Job job;
+                job.task = &task;
+                job.num_items = num_items;
+                job.next_item = 0;
+
+                // Never start more threads than there are items, nor any from inside another pool's task
+                unsigned int limit = available();
+                unsigned int num_workers = (num_items < limit) ? num_items : limit;
+                std::vector<Worker> workers( num_workers );
+                std::vector<pthread_t> threads( num_workers );
+                for (unsigned int i=0; i<num_workers; i++) {
+                    workers[i].job = &job;
+                    workers[i].index = i;
+                }
+
+                // The calling thread acts as worker zero, or does everything if threads can't be started
+                unsigned int started = 1;
+                while ( started < num_workers
+                    && pthread_create( &threads[started], NULL, &work, &workers[started] ) == 0 )
+                    started++;
+                if ( num_workers > 0 ) work( &workers[0] );
+                for (unsigned int i=1; i<started; i++)
+                    pthread_join( threads[i], NULL );
+            }
+    };
+
+}
+
+#endif //EFB_THREADING_H
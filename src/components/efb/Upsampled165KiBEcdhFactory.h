@@ -0,0 +1,40 @@
+#ifndef EFB_UPSAMPLED165KIBECDHFACTORY_H
+#define EFB_UPSAMPLED165KIBECDHFACTORY_H
+
+// eFB Library sub-component includes
+#include "ILibFactory.h"
+#include "crypto/BotanECDHCrypto.h"
+#include "fec/ReedSolomon255Fec.h"
+#include "interleaver/BlockInterleaver.h"
+#include "conduit_image/Upsampled3ConduitImage.h"
+#include "string_codec/ShiftB0StringCodec.h"
+
+namespace efb {
+    
+    //! Abstract factory which uses upsampling to store data in images, with elliptic curve cryptography. Approx. capacity 165KiB.
+    /**
+        This implementation is the same as Upsampled165KiBFactory except for the cryptographic functions, which use AES-256 with message keys wrapped for each recipient by elliptic curve Diffie-Hellman key agreement over the NIST P-256 curve (comparable in strength to RSA-3072). Each recipient adds 40 bytes to the header rather than 264, which matters most for short text posts, and decryption needs no RSA private key operation. Keys are not interchangeable with those of the RSA factories.
+    */
+    class Upsampled165KiBEcdhFactory : public ILibFactory
+    {
+        public :
+            ICrypto& create_ICrypto() const {
+                return *(new BotanECDHCrypto<32>());
+            }
+            IFec& create_IFec() const {
+                return *(new ReedSolomon255Fec());
+            }
+            IInterleaver& create_IInterleaver() const {
+                return *(new BlockInterleaver(223)); // one row per FEC data block
+            }
+            IConduitImage& create_IConduitImage() const {
+                return *(new Upsampled3ConduitImage());
+            }
+            IStringCodec& create_IStringCodec() const {
+                return *(new ShiftB0StringCodec());
+            }
+    };
+    
+}
+
+#endif //EFB_UPSAMPLED165KIBECDHFACTORY_H
@@ -5,6 +5,7 @@
 #include "ILibFactory.h"
 #include "crypto/BotanRSACrypto.h"
 #include "fec/ReedSolomon255Fec.h"
+#include "interleaver/BlockInterleaver.h"
 #include "conduit_image/Upsampled3ConduitImage.h"
 #include "string_codec/ShiftB0StringCodec.h"
 
@@ -12,7 +13,7 @@ namespace efb {
     
     //! Abstract factory which uses upsampling to store data in images. Approx. capacity 165KiB.
     /**
-        This implementation stores 3 bits in each 8-bit pixel using upsampling to achieve an error rate of <0.02% (TODO - CHECK THIS). This rate is then reduced using Reed Solomon error correction (based on the Shifra library) with a code rate of (255,223). The final maximum capacity is approximately 165 KiB (or 169,926 bytes exactly). The Botan library is used for cryptographic functions. The standards implemented are AES-256 and RSA-2048 as reccomended by NIST "Recommendations for Key Management - Part 1: General (Revised) - page 63". A slightly shifted UTF8 codec is used to avoid problem characters with low UTF8 code point values and surrogate pairs.  
+        This implementation stores 3 bits in each 8-bit pixel using upsampling to achieve an error rate of <0.02% (TODO - CHECK THIS). This rate is then reduced using Reed Solomon error correction (based on the Shifra library) with a code rate of (255,223). The coded data is block interleaved so that damage to one area of the image is spread over many codewords. The final maximum capacity is approximately 165 KiB (or 169,926 bytes exactly). The Botan library is used for cryptographic functions. The standards implemented are AES-256 and RSA-2048 as reccomended by NIST "Recommendations for Key Management - Part 1: General (Revised) - page 63". A slightly shifted UTF8 codec is used to avoid problem characters with low UTF8 code point values and surrogate pairs.  
     */
     class Upsampled165KiBFactory : public ILibFactory
     {
@@ -23,6 +24,9 @@ namespace efb {
             IFec& create_IFec() const {
                 return *(new ReedSolomon255Fec());
             }
+            IInterleaver& create_IInterleaver() const {
+                return *(new BlockInterleaver(223)); // one row per FEC data block
+            }
             IConduitImage& create_IConduitImage() const {
                 return *(new Upsampled3ConduitImage());
             }
@@ -6,6 +6,7 @@
 
 // Library sub-component includes
 #include "IConduitImage.h"
+#include "LanczosResize.h"
 
 namespace efb {
     
@@ -18,17 +19,6 @@ namespace efb {
         //! Counters indicating the read and write heads.
         unsigned int rhead_, whead_;
                 
-        //! Format the image in preparation for implantation.
-        /**
-            This operation will resize the image to 2048x2048x1 and truncate the colour channels, as only data storage in single-channel (greyscale) image is supported. JPEG compression requires a (lossy) colour space transform from RGB to YCrCb which complicates using colour images for data storage. Even worse - Facebook's JPEG compression process uses chrominance subsampling. However, this does mean that discarding the additional two chrominance channels only results in a %50 reduction in maximum potential data storage capacity.        
-         */
-        void formatForImplantation()
-        {
-            // Format the image to 2048x2048 greyscale, single slice (resample using Lanczos)
-            resize(720,720,1,-1,6);
-            channel(0);
-        }
-        
         //! Write a single byte to the image.
         /**
             Bytes are queued into a buffer which is flushed automatically whenever its size reaches that of the block size. The write head indicates the number of bytes already stored in the image - it *DOES NOT* include bytes stored in the buffer.
@@ -93,6 +83,16 @@ namespace efb {
         
         protected :
             
+            //! Format the image in preparation for implantation.
+            /**
+                This operation will resize the image to 2048x2048x1 and truncate the colour channels, as only data storage in single-channel (greyscale) image is supported. JPEG compression requires a (lossy) colour space transform from RGB to YCrCb which complicates using colour images for data storage. Even worse - Facebook's JPEG compression process uses chrominance subsampling. However, this does mean that discarding the additional two chrominance channels only results in a %50 reduction in maximum potential data storage capacity.        
+             */
+            void formatForImplantation( unsigned int width = 720, unsigned int height = 720 )
+            {
+                // Format the image to 2048x2048 greyscale, single slice (resample using Lanczos). Nothing is done to a template which is already formatted.
+                LanczosResize::formatImage( *this, width, height );
+            }
+        
             //! Variable to determine how many bytes are stored per block
             const unsigned int block_size_;
         
@@ -3,10 +3,20 @@
 
 // Library sub-component includes
 #include "BufferedConduitImage.h"
+#include "HaarKernels.h"
+
+// Standard library includes
+#include <cmath>
+#include <algorithm>
 
 namespace efb {
-    
+
     //! Conduit image class which uses the Haar wavelet tranform to store data in low frequency image components.
+    /**
+        The image is split into 90x90 blocks of 8x8 pixels, each storing 3 bytes. Whole images are implanted and extracted a row of blocks at a time straight from the contiguous pixel buffer, using the vectorised HaarKernels where the CPU supports them. The buffered per-block interface remains available and produces identical output.
+
+        Each of a block's four approximation coefficients is quantised to one of 64 levels at 4m+2, bit j of m being coefficient bit j+2, and hard extraction just masks off the low two bits. A coefficient is the mean of a 4x4 quadrant of the tile, floored at each step of the transform, so it only ever says whether it lies on a level or beside one. Soft extraction goes back to the quadrant's pixel sum, 16 times finer, and takes the noise as Gaussian about each level: the mean and variance of every quadrant sum's offset from its hard-read level, over the whole image, give the level centres (the flooring leaves sums sitting above the coefficient) and the noise. A bit's log-likelihood ratio is then the difference of the squared distances to the nearest level with the bit flipped and to the level read, over twice the variance.
+    */
     class HaarConduitImage : public BufferedConduitImage
     {
         //! Get the block coordinates based on the index of the byte we are writing.
@@ -15,210 +25,169 @@ namespace efb {
             i = ((idx/block_size_) / 90)*8 ;
             j = ((idx/block_size_) % 90)*8 ;
         }
-        
+
         //! Encode block_size_ bytes in a block of pixels. (i,j) indicates the pixel at the start of the block.
         void encodeInBlock( std::deque<byte> data, unsigned int i, unsigned int j )
         {
-            // Temp workspace variable
-            short int temp[8][8];
-            // Apply the Haar transform to the block (two iterations)
-            haar2dDwt (i, j, temp);
-            
-            // Write 3 bytes of data to the temp block
-            byte a, b, c;
-            a = data[0]; b=data[1]; c=data[2];
-            temp[0][0] 	= (a & 0xfc) | 0x02;
-            temp[1][0] 	= (b & 0xfc) | 0x02;
-            temp[0][1] 	= (c & 0xfc) | 0x02;
-            temp[1][1]	= ((a & 0x03) <<6) | ((b & 0x03) <<4) | ((c & 0x03) <<2) | 0x02;
-            
-            // Apply the inverse transform and write back to the image
-            haar2dDwti(temp, i, j);
-        }
-        
-
-        //! Perform the Haar Discrete Wavelet transform on an 8x8 temp block.
-        /**
-            Perform the Haar Discrete Wavelet Transform (with lifting scheme so the inverse can be performed losslessly). The result is written to the supplied 8x8 array, since we cannot do this in place (we would need (at least) an extra sign bit for 3/4 of the 64 coefficients).
-        */
-        void haar2dDwt
-        (
-            unsigned int x0,
-            unsigned int y0,
-            short int temp[8][8]
-        ) const
-        {
-            short int temp2[8][8];
-            // First iteration works on the entire 8x8 block
-            // For each row...
-            for (unsigned int j=0; j<8; j++) {
-                // Perform 1D Haar transfrom with integer lifting
-                for (unsigned int i=0; i<4; i++) {
-                    // average
-                    temp2[i][j] = divFloor( operator()(x0+(2*i), y0+j) +
-                                            operator()(x0+((2*i)+1), y0+j),
-                                            2);
-                    // difference
-                    temp2[4+i][j] = operator()(x0+(2*i), y0+j) -
-                                    operator()(x0+((2*i)+1), y0+j);
-                }
-            }
-            // For each column...
-            for (unsigned int i=0; i<8; i++) {
-                // Perform 1D Haar transfrom with integer lifting
-                for (unsigned int j=0; j<4; j++) {
-                    // average
-                    temp[i][j] = divFloor( temp2[i][2*j] + temp2[i][(2*j)+1], 2);
-                    // difference
-                    temp[i][4+j] = temp2[i][2*j] - temp2[i][(2*j)+1];
-                }
-            }
-            // Then the next iteration on the top left 4x4 corner block
-            // For each row...
-            for (unsigned int j=0; j<4; j++) {
-                // Perform 1D Haar transfrom with integer lifting
-                for (unsigned int i=0; i<2; i++) {
-                    // average
-                    temp2[i][j] = divFloor(temp[2*i][j] + temp[2*i+1][j], 2);
-                    // difference
-                    temp2[2+i][j] = temp[2*i][j] - temp[2*i+1][j];
-                }
-            }
-            // For each column...
-            for (unsigned int i=0; i<4; i++) {
-                // Perform 1D Haar transfrom with integer lifting
-                for (unsigned int j=0; j<2; j++) {
-                    // average
-                    temp[i][j] = divFloor(temp2[i][2*j] + temp2[i][2*j+1], 2);
-                    // difference
-                    temp[i][2+j] = temp2[i][2*j] - temp2[i][2*j+1];
-                }
-            }
-        }
-        
-        //! Helper function for lifting scheme
-        int divFloor(int a, int b) const {
-          if (a>=0) return a/b;
-          else return (a-1)/b; 
-        }
-        
-        //! Truncate Haar coefficients (preserving stored data).
-        void truncateCoefficients( short int& p1, short int& p2, short int& m)
-        {
-            // If p1 or p2 lie outside the range 0-255 we must rectify this, however we *MUST* also preserve their mean value (m) as this contains data.
-            /*
-            if (p1<0) {p1 = 0; p2 = 2*m;}
-            if (p1>255) {p1 = 255; p2 = 2*m-255;}
-            if (p2<0) {p2 = 0; p1 = 2*m;}
-            if (p2>255) {p2 = 255; p1 = 2*m-255;}
-            */
-            if ((p1<0) || (p1>255) || (p2<0) || (p2>255)) {p1=p2=m;}
-            
-        }
-        
-        //! Perform the inverse Haar Discrete Wavelet transform on an 8x8 block.
-        /**
-            Perform the inverse Haar Discrete Wavelet Transform using a lifting scheme. We start at pixel (x0,y0) in the image and work on the subsequent 8x8 block. We read in from the supplied temp block containing the wavelet coefficients.
-        */
-        void haar2dDwti(
-            short int temp[8][8],
-            unsigned int x0,
-            unsigned int y0
-        )
-        {
-            short int temp2[8][8], p1, p2;
-            // First iteration just on the 4x4 top left corner block
-            // For each column...
-            for (unsigned int i=0; i<4; i++) {
-                // Perform 1D inverse Haar transfrom with integer lifting
-                for (unsigned int j=0; j<2; j++) {
-                    p1 	= temp[i][j] + divFloor(temp[i][2+j]+1,2) ;
-                    p2 	= p1 - temp[i][2+j];
-                    // Check we don't overflow the pixel
-                    if (i<2) truncateCoefficients(p1,p2,temp[i][j]);
-                    temp2[i][2*j] = p1;
-                    temp2[i][2*j+1] = p2;
-                }
-            }
-            // For each row (do the same again)...
-            for (unsigned int j=0; j<4; j++) {
-                // Perform 1D inverse Haar transfrom with integer lifting
-                for (unsigned int i=0; i<2; i++) {
-                    // Check we don't overflow the pixel
-                    p1 	= temp2[i][j] + divFloor(temp2[2+i][j]+1,2) ;
-                    p2 	= p1 - temp2[2+i][j];
-                    truncateCoefficients(p1,p2,temp2[i][j]);
-                    temp[2*i][j] =  p1;
-                    temp[2*i+1][j] = p2;                    
-                }
-            }
-            // Then the next iteration on the entire 8x8 block
-            // For each column...
-            for (unsigned int i=0; i<8; i++) {
-                // Perform 1D inverse Haar transfrom with integer lifting
-                for (unsigned int j=0; j<4; j++) {
-                    // Check we don't overflow the pixel
-                    p1 	= temp[i][j] + divFloor(temp[i][4+j]+1,2) ;
-                    p2 	= p1 - temp[i][4+j];
-                    if (i<4) truncateCoefficients(p1,p2,temp[i][j]);
-                    temp2[i][2*j] = p1;
-                    temp2[i][2*j+1] = p2; 
-                }
-            }
-            // For each row (do the same again)...
-            for (unsigned int j=0; j<8; j++) {
-                // Perform 1D inverse Haar transfrom with integer lifting
-                for (unsigned int i=0; i<4; i++) {
-                    // Check we don't overflow the pixel
-                    p1 	= temp2[i][j] + divFloor(temp2[4+i][j]+1,2) ;
-                    p2 	= p1 - temp2[4+i][j];
-                    truncateCoefficients(p1,p2,temp2[i][j]);
-                    operator()(x0+2*i, y0+j) = temp[2*i][j] = p1;
-                    operator()(x0+2*i+1, y0+j) = temp[2*i+1][j] = p2;                    
-                }
-            }
+            byte bytes[3] = { data[0], data[1], data[2] };
+            HaarTile::implant( bytes, &operator()(i,j), width() );
         }
-        
+
         //! Decode block_size_ bytes from a block of pixels. (i,j) indicates the first pixel in the block.
         void decodeFromBlock( std::deque<byte> & data, unsigned int i, unsigned int j )
         {
-            // Temp workspace variable
-            short int temp[8][8];
-            // Apply the transform (two iterations) to the block
-            haar2dDwt (i, j, temp);
-            
-            // Extract the four approximation coefficients
-            byte p1,p2,p3,p4;
-            p1 = temp[0][0];
-            p2 = temp[1][0];
-            p3 = temp[0][1];
-            p4 = temp[1][1];
-            // Retrive the three data bytes
-            byte a,b,c;
-            a = (p1 & 0xfc) | ((p4 & 0xc0) >> 6);
-            b = (p2 & 0xfc) | ((p4 & 0x30) >> 4);
-            c = (p3 & 0xfc) | ((p4 & 0x0c) >> 2);
+            byte bytes[3];
+            HaarTile::extract( &operator()(i,j), width(), bytes );
             // Append them to the read buffer
-            data.push_back( a );
-            data.push_back( b );
-            data.push_back( c );
+            data.push_back( bytes[0] );
+            data.push_back( bytes[1] );
+            data.push_back( bytes[2] );
         }
-        
+
+        //! Quantiser levels of the approximation coefficients, in steps of a quadrant sum (16 pixels). Bytes whose least likely bit has at least RELIABLE_LLR are scored as certain.
+        enum { LEVELS = 64, LEVEL_BITS = 6, LEVEL_STEP = 64, RELIABLE_LLR = 16 };
+
+        //! Squared distance from a quadrant sum to the centre of a level, or a large value if there is no such level.
+        static float levelDistance( float sum, int m )
+        {
+            if (m < 0 || m >= LEVELS) return 1e12f;
+            float d = sum - LEVEL_STEP*m;
+            return d*d;
+        }
+
         public :
-            
+
             //! Constructor.
             HaarConduitImage() :
                 BufferedConduitImage(3)
             {}
-            
+
             //! Get the maximum ammount of data (in bytes) that can be stored in this implementation.
             virtual unsigned int getMaxData()
             {
                 return (90*90*3);
             }
+
+            //! Implant data, processing blocks in memory order.
+            /**
+                Block n holds bytes 3n to 3n+2 and starts at pixel ((n/90)*8, (n%90)*8), so blocks are visited a row of 90 at a time. This way each row of pixels is only brought into cache once.
+            */
+            virtual void implantData( std::vector<byte>& data )
+            {
+                // Format the image for implantation
+                formatForImplantation();
+
+                // Check the data isn't too large
+                if (data.size() > getMaxData())
+                    throw ConduitImageImplantException("Too much data");
+
+                // Pad out with random bytes till we reach capacity
+                std::srand ( time(NULL) );
+                std::vector<byte> padded( data );
+                while ( padded.size() < getMaxData() ) padded.push_back( (byte) std::rand() );
+
+                unsigned int stride = width();
+                for (unsigned int by=0; by<90; by++)
+                    HaarKernels::implantRow(
+                        &padded[3*by], 3*90, this->data() + (by*8)*stride, stride, 90 );
+            }
+
+            //! Extract data, processing blocks in memory order.
+            virtual void extractData( std::vector<byte>& data )
+            {
+                data.resize( getMaxData() );
+
+                unsigned int stride = width();
+                for (unsigned int by=0; by<90; by++)
+                    HaarKernels::extractRow(
+                        this->data() + (by*8)*stride, stride, &data[3*by], 3*90, 90 );
+            }
+
+            //! Extract data as extractData, along with the log-likelihood ratio of every bit.
+            /**
+                Each bit's ratio has the sign of the bit extractData reads, and is zero if the quadrant sum lies nearer a level with that bit flipped than the level read (which the flooring can do close to the boundary).
+            */
+            virtual void extractDataWithLikelihoods( std::vector<byte>& data, std::vector<float>& llr )
+            {
+                data.resize( getMaxData() );
+                llr.resize( 8*getMaxData() );
+
+                // Read the approximation coefficients and quadrant sums of every block, in the same order as extractData
+                std::vector<byte> coefficients( 4*90*90 );
+                std::vector<short int> sums( 4*90*90 );
+                unsigned int stride = width();
+                double total = 0, total_squares = 0;
+                for (unsigned int by=0; by<90; by++)
+                    for (unsigned int bx=0; bx<90; bx++) {
+                        short int pix[8][8], temp[8][8];
+                        HaarTile::load( this->data() + (by*8)*stride + bx*8, stride, pix );
+                        HaarTile::forward( pix, temp );
+                        byte* c = &coefficients[4*(by + 90*bx)];
+                        short int* s = &sums[4*(by + 90*bx)];
+                        c[0] = temp[0][0]; c[1] = temp[1][0]; c[2] = temp[0][1]; c[3] = temp[1][1];
+                        for (unsigned int k=0; k<4; k++) {
+                            // Quadrant k covers pixels x in 4(k&1) to 4(k&1)+3, y in 4(k>>1) to 4(k>>1)+3
+                            unsigned int x0 = (k & 0x01)*4, y0 = (k >> 1)*4;
+                            int sum = 0;
+                            for (unsigned int y=y0; y<y0+4; y++)
+                                for (unsigned int x=x0; x<x0+4; x++) sum += pix[x][y];
+                            s[k] = sum;
+                            int offset = sum - LEVEL_STEP*(c[k] >> 2);
+                            total += offset;
+                            total_squares += offset*offset;
+                        }
+                    }
+
+                // Estimate the level centres and noise variance, never assuming less noise than the flooring alone leaves
+                double mean = total / sums.size();
+                float variance = (float) (total_squares / sums.size() - mean*mean);
+                if (variance < LEVEL_STEP/4) variance = LEVEL_STEP/4;
+                const float scale = 1.0f / (2.0f * variance);
+
+                for (unsigned int b=0; b<90*90; b++) {
+                    const byte* c = &coefficients[4*b];
+                    HaarTile::fromCoefficients( c[0], c[1], c[2], c[3], &data[3*b] );
+
+                    // Ratios for the level bits of each coefficient
+                    float level_llr[4][LEVEL_BITS];
+                    for (unsigned int k=0; k<4; k++) {
+                        int m = c[k] >> 2;
+                        float sum = sums[4*b + k] - (float) mean;
+                        float read = levelDistance( sum, m );
+                        for (int j=0; j<LEVEL_BITS; j++) {
+                            // The nearest levels with bit j flipped start the next run of 2^j levels above, and end the one below
+                            float flipped = std::min(
+                                levelDistance( sum, ((m >> j) + 1) << j ),
+                                levelDistance( sum, ((m >> j) << j) - 1 ) );
+                            float l = std::max( 0.0f, flipped - read ) * scale;
+                            level_llr[k][j] = ((m >> j) & 0x01) ? -l : l;
+                        }
+                    }
+
+                    for (unsigned int k=0; k<3; k++) {
+                        float* l = &llr[8*(3*b + k)];
+                        // High 6 bits from the byte's own coefficient, low 2 from its share of the fourth
+                        for (unsigned int j=0; j<LEVEL_BITS; j++) l[j+2] = level_llr[k][j];
+                        l[0] = level_llr[3][2*(2-k)];
+                        l[1] = level_llr[3][2*(2-k)+1];
+                    }
+                }
+            }
+
+            //! Extract data, scoring each byte by the likelihood ratio of its least certain bit.
+            virtual void extractDataWithReliability( std::vector<byte>& data, std::vector<byte>& reliability )
+            {
+                std::vector<float> llr;
+                extractDataWithLikelihoods( data, llr );
+                reliability.resize( data.size() );
+                for (unsigned int i=0; i<data.size(); i++) {
+                    float least = RELIABLE_LLR;
+                    for (unsigned int k=0; k<8; k++) least = std::min( least, std::fabs( llr[8*i + k] ) );
+                    reliability[i] = (byte) (255 * least / RELIABLE_LLR);
+                }
+            }
     };
-    
+
 }
-    
+
 #endif //EFB_HAARCONDUITIMAGE_H
-    
\ No newline at end of file
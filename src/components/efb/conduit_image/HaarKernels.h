@@ -0,0 +1,282 @@
+#ifndef EFB_HAARKERNELS_H
+#define EFB_HAARKERNELS_H
+
+// Library sub-component includes
+#include "HaarTile.h"
+
+// Vectorised kernels are available for x86 with GCC-compatible compilers. SSE2 is part of the x86-64 baseline, AVX2 is compiled in alongside it and chosen at runtime.
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+    #define EFB_HAAR_SSE2 1
+    #include <emmintrin.h>
+    #if (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__)
+        #define EFB_HAAR_AVX2 1
+        #include <immintrin.h>
+    #endif
+#endif
+
+namespace efb {
+
+#ifdef EFB_HAAR_SSE2
+    //! SSE2 Haar kernel, transforming 8 tiles at once.
+    namespace haar_sse2 {
+
+        typedef __m128i Vec;
+        enum { LANES = 8 };
+
+        static inline Vec add( Vec a, Vec b ) { return _mm_add_epi16( a, b ); }
+        static inline Vec sub( Vec a, Vec b ) { return _mm_sub_epi16( a, b ); }
+        static inline Vec half( Vec a ) { return _mm_srai_epi16( a, 1 ); }
+        static inline Vec inc( Vec a ) { return _mm_add_epi16( a, _mm_set1_epi16( 1 ) ); }
+        static inline Vec fromArray( const short int* a ) { return _mm_loadu_si128( (const __m128i*) a ); }
+        static inline void toArray( Vec v, short int* a ) { _mm_storeu_si128( (__m128i*) a, v ); }
+
+        //! Set p1 and p2 to m in every lane where either lies outside 0-255.
+        static inline void truncate( Vec& p1, Vec& p2, Vec m )
+        {
+            const Vec lo = _mm_set1_epi16( -1 ), hi = _mm_set1_epi16( 256 );
+            Vec ok = _mm_and_si128(
+                _mm_and_si128( _mm_cmpgt_epi16( p1, lo ), _mm_cmplt_epi16( p1, hi ) ),
+                _mm_and_si128( _mm_cmpgt_epi16( p2, lo ), _mm_cmplt_epi16( p2, hi ) ) );
+            p1 = _mm_or_si128( _mm_and_si128( ok, p1 ), _mm_andnot_si128( ok, m ) );
+            p2 = _mm_or_si128( _mm_and_si128( ok, p2 ), _mm_andnot_si128( ok, m ) );
+        }
+
+        //! Transpose an 8x8 byte matrix held as four pairs of rows (row 2k in the low half of x[k], row 2k+1 in the high half).
+        static inline void transpose( __m128i x[4] )
+        {
+            __m128i a0 = _mm_unpacklo_epi8( x[0], _mm_srli_si128( x[0], 8 ) );
+            __m128i a1 = _mm_unpacklo_epi8( x[1], _mm_srli_si128( x[1], 8 ) );
+            __m128i a2 = _mm_unpacklo_epi8( x[2], _mm_srli_si128( x[2], 8 ) );
+            __m128i a3 = _mm_unpacklo_epi8( x[3], _mm_srli_si128( x[3], 8 ) );
+            __m128i b0 = _mm_unpacklo_epi16( a0, a1 );
+            __m128i b1 = _mm_unpackhi_epi16( a0, a1 );
+            __m128i b2 = _mm_unpacklo_epi16( a2, a3 );
+            __m128i b3 = _mm_unpackhi_epi16( a2, a3 );
+            x[0] = _mm_unpacklo_epi32( b0, b2 );
+            x[1] = _mm_unpackhi_epi32( b0, b2 );
+            x[2] = _mm_unpacklo_epi32( b1, b3 );
+            x[3] = _mm_unpackhi_epi32( b1, b3 );
+        }
+
+        //! Load row j of 8 adjacent tiles, as four pairs of pixel columns with one tile per byte.
+        static inline void loadRow( const byte* p, __m128i x[4] )
+        {
+            for (unsigned int k=0; k<4; k++)
+                x[k] = _mm_loadu_si128( (const __m128i*) (p + 16*k) );
+            transpose( x );
+        }
+
+        //! Store row j of 8 adjacent tiles, from four pairs of pixel columns with one tile per byte.
+        static inline void storeRow( __m128i x[4], byte* p )
+        {
+            transpose( x );
+            for (unsigned int k=0; k<4; k++)
+                _mm_storeu_si128( (__m128i*) (p + 16*k), x[k] );
+        }
+
+        static inline void loadTiles( const byte* p, unsigned int stride, Vec pix[8][8] )
+        {
+            const __m128i zero = _mm_setzero_si128();
+            for (unsigned int j=0; j<8; j++, p+=stride) {
+                __m128i x[4];
+                loadRow( p, x );
+                for (unsigned int k=0; k<4; k++) {
+                    pix[2*k][j] = _mm_unpacklo_epi8( x[k], zero );
+                    pix[2*k+1][j] = _mm_unpackhi_epi8( x[k], zero );
+                }
+            }
+        }
+
+        static inline void storeTiles( Vec pix[8][8], byte* p, unsigned int stride )
+        {
+            // Keep the low byte of each value, as the scalar (byte) cast does
+            const __m128i mask = _mm_set1_epi16( 0xff );
+            for (unsigned int j=0; j<8; j++, p+=stride) {
+                __m128i x[4];
+                for (unsigned int k=0; k<4; k++)
+                    x[k] = _mm_packus_epi16(
+                        _mm_and_si128( pix[2*k][j], mask ), _mm_and_si128( pix[2*k+1][j], mask ) );
+                storeRow( x, p );
+            }
+        }
+
+        #include "HaarLanes.h"
+    }
+#endif
+
+#ifdef EFB_HAAR_AVX2
+    #pragma GCC push_options
+    #pragma GCC target("avx2")
+    //! AVX2 Haar kernel, transforming 16 tiles at once. Only called when the CPU supports AVX2.
+    namespace haar_avx2 {
+
+        typedef __m256i Vec;
+        enum { LANES = 16 };
+
+        static inline Vec add( Vec a, Vec b ) { return _mm256_add_epi16( a, b ); }
+        static inline Vec sub( Vec a, Vec b ) { return _mm256_sub_epi16( a, b ); }
+        static inline Vec half( Vec a ) { return _mm256_srai_epi16( a, 1 ); }
+        static inline Vec inc( Vec a ) { return _mm256_add_epi16( a, _mm256_set1_epi16( 1 ) ); }
+        static inline Vec fromArray( const short int* a ) { return _mm256_loadu_si256( (const __m256i*) a ); }
+        static inline void toArray( Vec v, short int* a ) { _mm256_storeu_si256( (__m256i*) a, v ); }
+
+        //! Set p1 and p2 to m in every lane where either lies outside 0-255.
+        static inline void truncate( Vec& p1, Vec& p2, Vec m )
+        {
+            const Vec lo = _mm256_set1_epi16( -1 ), hi = _mm256_set1_epi16( 256 );
+            Vec ok = _mm256_and_si256(
+                _mm256_and_si256( _mm256_cmpgt_epi16( p1, lo ), _mm256_cmpgt_epi16( hi, p1 ) ),
+                _mm256_and_si256( _mm256_cmpgt_epi16( p2, lo ), _mm256_cmpgt_epi16( hi, p2 ) ) );
+            p1 = _mm256_blendv_epi8( m, p1, ok );
+            p2 = _mm256_blendv_epi8( m, p2, ok );
+        }
+
+        //! Tiles 0-7 and 8-15 are transposed separately with the SSE2 helpers, then widened into 16 lanes.
+        static inline void loadTiles( const byte* p, unsigned int stride, Vec pix[8][8] )
+        {
+            for (unsigned int j=0; j<8; j++, p+=stride) {
+                __m128i x[4], y[4];
+                haar_sse2::loadRow( p, x );
+                haar_sse2::loadRow( p + 64, y );
+                for (unsigned int k=0; k<4; k++) {
+                    pix[2*k][j] = _mm256_cvtepu8_epi16( _mm_unpacklo_epi64( x[k], y[k] ) );
+                    pix[2*k+1][j] = _mm256_cvtepu8_epi16( _mm_unpackhi_epi64( x[k], y[k] ) );
+                }
+            }
+        }
+
+        static inline void storeTiles( Vec pix[8][8], byte* p, unsigned int stride )
+        {
+            // Keep the low byte of each value, as the scalar (byte) cast does
+            const __m256i mask = _mm256_set1_epi16( 0xff );
+            for (unsigned int j=0; j<8; j++, p+=stride) {
+                __m128i x[4], y[4];
+                for (unsigned int k=0; k<4; k++) {
+                    __m256i c0 = _mm256_and_si256( pix[2*k][j], mask );
+                    __m256i c1 = _mm256_and_si256( pix[2*k+1][j], mask );
+                    __m128i col0 = _mm_packus_epi16( _mm256_castsi256_si128( c0 ), _mm256_extracti128_si256( c0, 1 ) );
+                    __m128i col1 = _mm_packus_epi16( _mm256_castsi256_si128( c1 ), _mm256_extracti128_si256( c1, 1 ) );
+                    x[k] = _mm_unpacklo_epi64( col0, col1 );
+                    y[k] = _mm_unpackhi_epi64( col0, col1 );
+                }
+                haar_sse2::storeRow( x, p );
+                haar_sse2::storeRow( y, p + 64 );
+            }
+        }
+
+        #include "HaarLanes.h"
+    }
+    #pragma GCC pop_options
+#endif
+
+    //! Haar tile kernels with the best implementation chosen at runtime.
+    /**
+        Rows of tiles are handed to the widest kernel the CPU supports, with narrower kernels and finally the scalar HaarTile code picking up whatever is left over at the end of the row. All paths produce identical output.
+    */
+    struct HaarKernels
+    {
+        //! Available kernel implementations.
+        enum Path { SCALAR, SSE2, AVX2 };
+
+        //! Check whether a kernel can be used on this machine.
+        static bool supported( Path path )
+        {
+            switch (path) {
+                case SCALAR : return true;
+#ifdef EFB_HAAR_SSE2
+                case SSE2 : return true;
+#endif
+#ifdef EFB_HAAR_AVX2
+                case AVX2 : {
+                    static const bool avx2 = __builtin_cpu_supports("avx2");
+                    return avx2;
+                }
+#endif
+                default : return false;
+            }
+        }
+
+        //! Get the widest kernel supported on this machine.
+        static Path best()
+        {
+            if (supported( AVX2 )) return AVX2;
+            if (supported( SSE2 )) return SSE2;
+            return SCALAR;
+        }
+
+        //! Store 3 bytes in each of count horizontally adjacent tiles starting at p. Data for tile t starts at data[t*data_stride].
+        static void implantRow( const byte* data, unsigned int data_stride, byte* p, unsigned int stride, unsigned int count, Path path = best() )
+        {
+            unsigned int t = 0;
+#ifdef EFB_HAAR_AVX2
+            if (path == AVX2)
+                t += haar_avx2::implantRow( data, data_stride, p, stride, count );
+#endif
+#ifdef EFB_HAAR_SSE2
+            if (path != SCALAR)
+                t += haar_sse2::implantRow( data + t*data_stride, data_stride, p + 8*t, stride, count - t );
+#endif
+            for (; t<count; t++)
+                HaarTile::implant( data + t*data_stride, p + 8*t, stride );
+        }
+
+        //! Retrieve 3 bytes from each of count horizontally adjacent tiles starting at p. Data for tile t is written to data[t*data_stride].
+        static void extractRow( const byte* p, unsigned int stride, byte* data, unsigned int data_stride, unsigned int count, Path path = best() )
+        {
+            unsigned int t = 0;
+#ifdef EFB_HAAR_AVX2
+            if (path == AVX2)
+                t += haar_avx2::extractRow( p, stride, data, data_stride, count );
+#endif
+#ifdef EFB_HAAR_SSE2
+            if (path != SCALAR)
+                t += haar_sse2::extractRow( p + 8*t, stride, data + t*data_stride, data_stride, count - t );
+#endif
+            for (; t<count; t++)
+                HaarTile::extract( p + 8*t, stride, data + t*data_stride );
+        }
+
+        //! Forward transform an array of tiles (64 shorts each, laid out as [x][y]).
+        static void forwardTiles( const short int* in, short int* out, unsigned int count, Path path = best() )
+        {
+            unsigned int t = 0;
+#ifdef EFB_HAAR_AVX2
+            if (path == AVX2)
+                t += haar_avx2::forwardTiles( in, out, count );
+#endif
+#ifdef EFB_HAAR_SSE2
+            if (path != SCALAR)
+                t += haar_sse2::forwardTiles( in + 64*t, out + 64*t, count - t );
+#endif
+            for (; t<count; t++) {
+                short int pix[8][8], temp[8][8];
+                for (unsigned int k=0; k<64; k++) pix[k/8][k%8] = in[64*t + k];
+                HaarTile::forward( pix, temp );
+                for (unsigned int k=0; k<64; k++) out[64*t + k] = temp[k/8][k%8];
+            }
+        }
+
+        //! Inverse transform an array of tiles (64 shorts each, laid out as [x][y]).
+        static void inverseTiles( const short int* in, short int* out, unsigned int count, Path path = best() )
+        {
+            unsigned int t = 0;
+#ifdef EFB_HAAR_AVX2
+            if (path == AVX2)
+                t += haar_avx2::inverseTiles( in, out, count );
+#endif
+#ifdef EFB_HAAR_SSE2
+            if (path != SCALAR)
+                t += haar_sse2::inverseTiles( in + 64*t, out + 64*t, count - t );
+#endif
+            for (; t<count; t++) {
+                short int temp[8][8], pix[8][8];
+                for (unsigned int k=0; k<64; k++) temp[k/8][k%8] = in[64*t + k];
+                HaarTile::inverse( temp, pix );
+                for (unsigned int k=0; k<64; k++) out[64*t + k] = pix[k/8][k%8];
+            }
+        }
+    };
+
+}
+
+#endif //EFB_HAARKERNELS_H
@@ -0,0 +1,179 @@
+/**
+################################################################################
+    Two level integer Haar transform over LANES tiles at once.
+
+    There is deliberately no include guard. HaarKernels.h includes this file
+    once per instruction set, inside a namespace which provides:
+      - Vec, a vector of LANES signed 16-bit values (one per tile),
+      - add, sub, half (arithmetic shift right by one) and inc (add one),
+      - truncate, the lane-wise equivalent of HaarTile::truncateCoefficients,
+      - fromArray / toArray to move LANES shorts in and out of a Vec,
+      - loadTiles / storeTiles to move LANES horizontally adjacent 8x8 tiles
+        of pixels in and out of a Vec[8][8], transposing so that each lane
+        holds one tile.
+    Every step mirrors HaarTile exactly, so results are bit-identical. Note
+    that half() gives the same result as HaarTile::divFloor(a,2) for all a.
+################################################################################
+*/
+
+//! Forward transform, see HaarTile::forward.
+static inline void forward( Vec pix[8][8], Vec temp[8][8] )
+{
+    Vec temp2[8][8];
+    for (unsigned int j=0; j<8; j++) {
+        for (unsigned int i=0; i<4; i++) {
+            temp2[i][j] = half( add( pix[2*i][j], pix[2*i+1][j] ) );
+            temp2[4+i][j] = sub( pix[2*i][j], pix[2*i+1][j] );
+        }
+    }
+    for (unsigned int i=0; i<8; i++) {
+        for (unsigned int j=0; j<4; j++) {
+            temp[i][j] = half( add( temp2[i][2*j], temp2[i][2*j+1] ) );
+            temp[i][4+j] = sub( temp2[i][2*j], temp2[i][2*j+1] );
+        }
+    }
+    for (unsigned int j=0; j<4; j++) {
+        for (unsigned int i=0; i<2; i++) {
+            temp2[i][j] = half( add( temp[2*i][j], temp[2*i+1][j] ) );
+            temp2[2+i][j] = sub( temp[2*i][j], temp[2*i+1][j] );
+        }
+    }
+    for (unsigned int i=0; i<4; i++) {
+        for (unsigned int j=0; j<2; j++) {
+            temp[i][j] = half( add( temp2[i][2*j], temp2[i][2*j+1] ) );
+            temp[i][2+j] = sub( temp2[i][2*j], temp2[i][2*j+1] );
+        }
+    }
+}
+
+//! Inverse transform, see HaarTile::inverse.
+static inline void inverse( Vec temp[8][8], Vec pix[8][8] )
+{
+    Vec temp2[8][8], p1, p2;
+    for (unsigned int i=0; i<4; i++) {
+        for (unsigned int j=0; j<2; j++) {
+            p1 = add( temp[i][j], half( inc( temp[i][2+j] ) ) );
+            p2 = sub( p1, temp[i][2+j] );
+            if (i<2) truncate( p1, p2, temp[i][j] );
+            temp2[i][2*j] = p1;
+            temp2[i][2*j+1] = p2;
+        }
+    }
+    for (unsigned int j=0; j<4; j++) {
+        for (unsigned int i=0; i<2; i++) {
+            p1 = add( temp2[i][j], half( inc( temp2[2+i][j] ) ) );
+            p2 = sub( p1, temp2[2+i][j] );
+            truncate( p1, p2, temp2[i][j] );
+            temp[2*i][j] = p1;
+            temp[2*i+1][j] = p2;
+        }
+    }
+    for (unsigned int i=0; i<8; i++) {
+        for (unsigned int j=0; j<4; j++) {
+            p1 = add( temp[i][j], half( inc( temp[i][4+j] ) ) );
+            p2 = sub( p1, temp[i][4+j] );
+            if (i<4) truncate( p1, p2, temp[i][j] );
+            temp2[i][2*j] = p1;
+            temp2[i][2*j+1] = p2;
+        }
+    }
+    for (unsigned int j=0; j<8; j++) {
+        for (unsigned int i=0; i<4; i++) {
+            p1 = add( temp2[i][j], half( inc( temp2[4+i][j] ) ) );
+            p2 = sub( p1, temp2[4+i][j] );
+            truncate( p1, p2, temp2[i][j] );
+            pix[2*i][j] = p1;
+            pix[2*i+1][j] = p2;
+        }
+    }
+}
+
+//! Store 3 bytes in each of LANES adjacent tiles. Data for tile t starts at data[t*data_stride].
+static inline void implant( const byte* data, unsigned int data_stride, byte* p, unsigned int stride )
+{
+    Vec pix[8][8], temp[8][8];
+    short int c00[LANES], c10[LANES], c01[LANES], c11[LANES];
+    loadTiles( p, stride, pix );
+    forward( pix, temp );
+    for (unsigned int t=0; t<LANES; t++)
+        HaarTile::toCoefficients( data + t*data_stride, c00[t], c10[t], c01[t], c11[t] );
+    temp[0][0] = fromArray( c00 );
+    temp[1][0] = fromArray( c10 );
+    temp[0][1] = fromArray( c01 );
+    temp[1][1] = fromArray( c11 );
+    inverse( temp, pix );
+    storeTiles( pix, p, stride );
+}
+
+//! Retrieve 3 bytes from each of LANES adjacent tiles. Data for tile t is written to data[t*data_stride].
+static inline void extract( const byte* p, unsigned int stride, byte* data, unsigned int data_stride )
+{
+    Vec pix[8][8], temp[8][8];
+    short int c00[LANES], c10[LANES], c01[LANES], c11[LANES];
+    loadTiles( p, stride, pix );
+    forward( pix, temp );
+    toArray( temp[0][0], c00 );
+    toArray( temp[1][0], c10 );
+    toArray( temp[0][1], c01 );
+    toArray( temp[1][1], c11 );
+    for (unsigned int t=0; t<LANES; t++)
+        HaarTile::fromCoefficients( c00[t], c10[t], c01[t], c11[t], data + t*data_stride );
+}
+
+//! Implant into as many whole groups of LANES tiles as fit in a row of count tiles. Returns the number of tiles processed.
+static unsigned int implantRow( const byte* data, unsigned int data_stride, byte* p, unsigned int stride, unsigned int count )
+{
+    unsigned int t = 0;
+    for (; t+LANES <= count; t+=LANES)
+        implant( data + t*data_stride, data_stride, p + 8*t, stride );
+    return t;
+}
+
+//! Extract from as many whole groups of LANES tiles as fit in a row of count tiles. Returns the number of tiles processed.
+static unsigned int extractRow( const byte* p, unsigned int stride, byte* data, unsigned int data_stride, unsigned int count )
+{
+    unsigned int t = 0;
+    for (; t+LANES <= count; t+=LANES)
+        extract( p + 8*t, stride, data + t*data_stride, data_stride );
+    return t;
+}
+
+//! Forward transform an array of tiles (64 shorts each, laid out as [x][y]). Returns the number of tiles processed.
+static unsigned int forwardTiles( const short int* in, short int* out, unsigned int count )
+{
+    unsigned int t = 0;
+    for (; t+LANES <= count; t+=LANES) {
+        Vec a[8][8], b[8][8];
+        short int lanes[LANES];
+        for (unsigned int k=0; k<64; k++) {
+            for (unsigned int l=0; l<LANES; l++) lanes[l] = in[(t+l)*64 + k];
+            a[k/8][k%8] = fromArray( lanes );
+        }
+        forward( a, b );
+        for (unsigned int k=0; k<64; k++) {
+            toArray( b[k/8][k%8], lanes );
+            for (unsigned int l=0; l<LANES; l++) out[(t+l)*64 + k] = lanes[l];
+        }
+    }
+    return t;
+}
+
+//! Inverse transform an array of tiles (64 shorts each, laid out as [x][y]). Returns the number of tiles processed.
+static unsigned int inverseTiles( const short int* in, short int* out, unsigned int count )
+{
+    unsigned int t = 0;
+    for (; t+LANES <= count; t+=LANES) {
+        Vec a[8][8], b[8][8];
+        short int lanes[LANES];
+        for (unsigned int k=0; k<64; k++) {
+            for (unsigned int l=0; l<LANES; l++) lanes[l] = in[(t+l)*64 + k];
+            a[k/8][k%8] = fromArray( lanes );
+        }
+        inverse( a, b );
+        for (unsigned int k=0; k<64; k++) {
+            toArray( b[k/8][k%8], lanes );
+            for (unsigned int l=0; l<LANES; l++) out[(t+l)*64 + k] = lanes[l];
+        }
+    }
+    return t;
+}
@@ -0,0 +1,209 @@
+#ifndef EFB_HAARTILE_H
+#define EFB_HAARTILE_H
+
+// Library sub-component includes
+#include "../Common.h"
+
+namespace efb {
+
+    //! Two level integer Haar wavelet transform over a single 8x8 tile of pixels, plus the 3-byte data layout used by the Haar conduit image.
+    /**
+        Tiles are addressed as temp[x][y]. Pixels are read from and written to a row-major buffer (pixel (x,y) is at p[x + y*stride]) so a whole image can be processed straight from its contiguous CImg data, with each tile loaded once and all intermediate values kept on the stack.
+    */
+    struct HaarTile
+    {
+        //! Helper function for lifting scheme
+        static int divFloor(int a, int b) {
+          if (a>=0) return a/b;
+          else return (a-1)/b;
+        }
+
+        //! Truncate Haar coefficients (preserving stored data).
+        static void truncateCoefficients( short int& p1, short int& p2, short int& m)
+        {
+            // If p1 or p2 lie outside the range 0-255 we must rectify this, however we *MUST* also preserve their mean value (m) as this contains data.
+            if ((p1<0) || (p1>255) || (p2<0) || (p2>255)) {p1=p2=m;}
+        }
+
+        //! Load an 8x8 tile of pixels.
+        static void load( const byte* p, unsigned int stride, short int pix[8][8] )
+        {
+            for (unsigned int j=0; j<8; j++, p+=stride)
+                for (unsigned int i=0; i<8; i++)
+                    pix[i][j] = p[i];
+        }
+
+        //! Store an 8x8 tile of pixels.
+        static void store( short int pix[8][8], byte* p, unsigned int stride )
+        {
+            for (unsigned int j=0; j<8; j++, p+=stride)
+                for (unsigned int i=0; i<8; i++)
+                    p[i] = (byte) pix[i][j];
+        }
+
+        //! Perform the Haar Discrete Wavelet transform on an 8x8 tile of pixels.
+        /**
+            Perform the Haar Discrete Wavelet Transform (with lifting scheme so the inverse can be performed losslessly). The result is written to the supplied 8x8 array, since we cannot do this in place (we would need (at least) an extra sign bit for 3/4 of the 64 coefficients).
+        */
+        static void forward( short int pix[8][8], short int temp[8][8] )
+        {
+            short int temp2[8][8];
+            // First iteration works on the entire 8x8 block
+            // For each row...
+            for (unsigned int j=0; j<8; j++) {
+                // Perform 1D Haar transfrom with integer lifting
+                for (unsigned int i=0; i<4; i++) {
+                    // average
+                    temp2[i][j] = divFloor( pix[2*i][j] + pix[(2*i)+1][j], 2);
+                    // difference
+                    temp2[4+i][j] = pix[2*i][j] - pix[(2*i)+1][j];
+                }
+            }
+            // For each column...
+            for (unsigned int i=0; i<8; i++) {
+                // Perform 1D Haar transfrom with integer lifting
+                for (unsigned int j=0; j<4; j++) {
+                    // average
+                    temp[i][j] = divFloor( temp2[i][2*j] + temp2[i][(2*j)+1], 2);
+                    // difference
+                    temp[i][4+j] = temp2[i][2*j] - temp2[i][(2*j)+1];
+                }
+            }
+            // Then the next iteration on the top left 4x4 corner block
+            // For each row...
+            for (unsigned int j=0; j<4; j++) {
+                // Perform 1D Haar transfrom with integer lifting
+                for (unsigned int i=0; i<2; i++) {
+                    // average
+                    temp2[i][j] = divFloor(temp[2*i][j] + temp[2*i+1][j], 2);
+                    // difference
+                    temp2[2+i][j] = temp[2*i][j] - temp[2*i+1][j];
+                }
+            }
+            // For each column...
+            for (unsigned int i=0; i<4; i++) {
+                // Perform 1D Haar transfrom with integer lifting
+                for (unsigned int j=0; j<2; j++) {
+                    // average
+                    temp[i][j] = divFloor(temp2[i][2*j] + temp2[i][2*j+1], 2);
+                    // difference
+                    temp[i][2+j] = temp2[i][2*j] - temp2[i][2*j+1];
+                }
+            }
+        }
+
+        //! Perform the inverse Haar Discrete Wavelet transform on an 8x8 tile.
+        /**
+            Perform the inverse Haar Discrete Wavelet Transform using a lifting scheme, reading the wavelet coefficients from temp and writing pixel values to pix.
+        */
+        static void inverse( short int temp[8][8], short int pix[8][8] )
+        {
+            short int temp2[8][8], p1, p2;
+            // First iteration just on the 4x4 top left corner block
+            // For each column...
+            for (unsigned int i=0; i<4; i++) {
+                // Perform 1D inverse Haar transfrom with integer lifting
+                for (unsigned int j=0; j<2; j++) {
+                    p1 	= temp[i][j] + divFloor(temp[i][2+j]+1,2) ;
+                    p2 	= p1 - temp[i][2+j];
+                    // Check we don't overflow the pixel
+                    if (i<2) truncateCoefficients(p1,p2,temp[i][j]);
+                    temp2[i][2*j] = p1;
+                    temp2[i][2*j+1] = p2;
+                }
+            }
+            // For each row (do the same again)...
+            for (unsigned int j=0; j<4; j++) {
+                // Perform 1D inverse Haar transfrom with integer lifting
+                for (unsigned int i=0; i<2; i++) {
+                    // Check we don't overflow the pixel
+                    p1 	= temp2[i][j] + divFloor(temp2[2+i][j]+1,2) ;
+                    p2 	= p1 - temp2[2+i][j];
+                    truncateCoefficients(p1,p2,temp2[i][j]);
+                    temp[2*i][j] =  p1;
+                    temp[2*i+1][j] = p2;
+                }
+            }
+            // Then the next iteration on the entire 8x8 block
+            // For each column...
+            for (unsigned int i=0; i<8; i++) {
+                // Perform 1D inverse Haar transfrom with integer lifting
+                for (unsigned int j=0; j<4; j++) {
+                    // Check we don't overflow the pixel
+                    p1 	= temp[i][j] + divFloor(temp[i][4+j]+1,2) ;
+                    p2 	= p1 - temp[i][4+j];
+                    if (i<4) truncateCoefficients(p1,p2,temp[i][j]);
+                    temp2[i][2*j] = p1;
+                    temp2[i][2*j+1] = p2;
+                }
+            }
+            // For each row (do the same again)...
+            for (unsigned int j=0; j<8; j++) {
+                // Perform 1D inverse Haar transfrom with integer lifting
+                for (unsigned int i=0; i<4; i++) {
+                    // Check we don't overflow the pixel
+                    p1 	= temp2[i][j] + divFloor(temp2[4+i][j]+1,2) ;
+                    p2 	= p1 - temp2[4+i][j];
+                    truncateCoefficients(p1,p2,temp2[i][j]);
+                    pix[2*i][j] = p1;
+                    pix[2*i+1][j] = p2;
+                }
+            }
+        }
+
+        //! Map 3 bytes of data to the four approximation coefficients of a tile.
+        static void toCoefficients( const byte* data, short int& c00, short int& c10, short int& c01, short int& c11 )
+        {
+            byte a, b, c;
+            a = data[0]; b=data[1]; c=data[2];
+            c00 	= (a & 0xfc) | 0x02;
+            c10 	= (b & 0xfc) | 0x02;
+            c01 	= (c & 0xfc) | 0x02;
+            c11	= ((a & 0x03) <<6) | ((b & 0x03) <<4) | ((c & 0x03) <<2) | 0x02;
+        }
+
+        //! Map the four approximation coefficients of a tile back to 3 bytes of data.
+        static void fromCoefficients( byte p1, byte p2, byte p3, byte p4, byte* data )
+        {
+            // Retrive the three data bytes
+            data[0] = (p1 & 0xfc) | ((p4 & 0xc0) >> 6);
+            data[1] = (p2 & 0xfc) | ((p4 & 0x30) >> 4);
+            data[2] = (p3 & 0xfc) | ((p4 & 0x0c) >> 2);
+        }
+
+        //! Write 3 bytes of data into the approximation coefficients of a transformed tile.
+        static void embed( const byte* data, short int temp[8][8] )
+        {
+            toCoefficients( data, temp[0][0], temp[1][0], temp[0][1], temp[1][1] );
+        }
+
+        //! Recover 3 bytes of data from the approximation coefficients of a transformed tile.
+        static void recover( short int temp[8][8], byte* data )
+        {
+            fromCoefficients( temp[0][0], temp[1][0], temp[0][1], temp[1][1], data );
+        }
+
+        //! Store 3 bytes of data in the 8x8 tile of pixels starting at p.
+        static void implant( const byte* data, byte* p, unsigned int stride )
+        {
+            short int pix[8][8], temp[8][8];
+            load( p, stride, pix );
+            forward( pix, temp );
+            embed( data, temp );
+            inverse( temp, pix );
+            store( pix, p, stride );
+        }
+
+        //! Retrieve 3 bytes of data from the 8x8 tile of pixels starting at p.
+        static void extract( const byte* p, unsigned int stride, byte* data )
+        {
+            short int pix[8][8], temp[8][8];
+            load( p, stride, pix );
+            forward( pix, temp );
+            recover( temp, data );
+        }
+    };
+
+}
+
+#endif //EFB_HAARTILE_H
@@ -10,8 +10,12 @@
 #define cimg_use_jpeg 1
 #include "CImg.h"
 
+// Standard library includes
+#include <cstdio>
+
 // Library sub-component includes
 #include "../Common.h"
+#include "JpegLuma.h"
 
 namespace efb {
     
@@ -25,12 +29,59 @@ namespace efb {
     class IConduitImage : public cimg_library::CImg<byte>
     {
         public :
+            virtual ~IConduitImage() {}
             //! Get the maximum ammount of data that can be stored in this implementation.
             virtual unsigned int getMaxData() = 0;
             //! Implant data.
             virtual void implantData( std::vector<byte>& data ) = 0;
             //! Extract data.
             virtual void extractData( std::vector<byte>& data ) = 0;
+            //! Extract data along with a reliability score for each byte, from 0 (a guess) to 255 (certain). By default every byte is reported as certain.
+            virtual void extractDataWithReliability( std::vector<byte>& data, std::vector<byte>& reliability )
+            {
+                extractData( data );
+                reliability.assign( data.size(), 255 );
+            }
+            //! Extract data along with the log-likelihood ratio, ln(P(0)/P(1)), of every bit - bit k of byte i is at llr[8*i + k]. The sign gives the bit read and the size how sure that read is. By default every bit is reported as certain.
+            virtual void extractDataWithLikelihoods( std::vector<byte>& data, std::vector<float>& llr )
+            {
+                const float certain = 64.0f;
+                extractData( data );
+                llr.resize( 8*data.size() );
+                for (unsigned int i=0; i<llr.size(); i++)
+                    llr[i] = ((data[i/8] >> (i%8)) & 0x01) ? -certain : certain;
+            }
+            //! Get the width of the image data is stored in.
+            virtual unsigned int getFormatWidth() { return 720; }
+            //! Get the height of the image data is stored in.
+            virtual unsigned int getFormatHeight() { return 720; }
+
+            //! Load a JPEG to extract data from. Where possible only its luma is decoded, straight to the size data is stored at, otherwise it is loaded in full.
+            void loadJpegForExtraction( std::FILE* file )
+            {
+                if (!loadJpegLuma( *this, file, getFormatWidth(), getFormatHeight() )) {
+                    std::rewind( file );
+                    load_jpeg( file );
+                }
+            }
+
+            //! Load an image file to extract data from. JPEGs are loaded with loadJpegForExtraction, anything else as usual.
+            void loadForExtraction( const char* filename )
+            {
+                std::FILE* file = std::fopen( filename, "rb" );
+                if (file != NULL && std::fgetc( file ) == 0xff && std::fgetc( file ) == 0xd8) {
+                    std::rewind( file );
+                    try {loadJpegForExtraction( file );}
+                    catch (...) {
+                        std::fclose( file );
+                        throw;
+                    }
+                    std::fclose( file );
+                    return;
+                }
+                if (file != NULL) std::fclose( file );
+                load( filename ); // let CImg detect the format, and report any error opening the file
+            }
     };
     
 }
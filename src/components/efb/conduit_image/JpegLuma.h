@@ -0,0 +1,87 @@
+#ifndef EFB_JPEGLUMA_H
+#define EFB_JPEGLUMA_H
+
+// Standard library includes
+#include <cstdio>
+#include <csetjmp>
+
+// CImg (which brings in libjpeg) must already have been included with JPEG support - see IConduitImage.h
+
+// Library sub-component includes
+#include "../Common.h"
+
+namespace efb {
+
+    //! libjpeg error manager which returns control to the decoder so the error can be thrown as an exception.
+    struct JpegLumaErrorManager
+    {
+        jpeg_error_mgr original;
+        std::jmp_buf setjmp_buffer;
+        char message[JMSG_LENGTH_MAX];
+    };
+
+    //! libjpeg error handler, called in place of exit().
+    inline void jpegLumaErrorExit( j_common_ptr cinfo )
+    {
+        JpegLumaErrorManager* err = (JpegLumaErrorManager*) cinfo->err;
+        (*cinfo->err->format_message)( cinfo, err->message );
+        jpeg_destroy( cinfo );
+        std::longjmp( err->setjmp_buffer, 1 );
+    }
+
+    //! Decode a JPEG stream straight to its luma component, as a single-channel image of exactly width x height pixels.
+    /**
+        Data is only ever stored in one channel, so decoding the chrominance components and converting to RGB (as CImg does) is wasted work, and two thirds of the result is thrown away. Asking libjpeg for greyscale output from a YCbCr image makes it skip the inverse DCT and upsampling of the chrominance components entirely, and output the Y component, which is what the greyscale image was implanted as before it was compressed. A source which is 2, 4 or 8 times the size is scaled down by the inverse DCT itself rather than decoded at full size and resampled. Rows are decoded straight into the image's pixel buffer.
+
+        Returns false, leaving the image untouched, if the stream isn't a greyscale or YCbCr JPEG of one of those sizes; the stream has then been read past its header, so the caller must rewind it before loading it by other means. Throws a CImgIOException if libjpeg reports an error.
+    */
+    inline bool loadJpegLuma( cimg_library::CImg<byte>& img, std::FILE* file, unsigned int width, unsigned int height )
+    {
+        jpeg_decompress_struct cinfo;
+        JpegLumaErrorManager jerr;
+        cinfo.err = jpeg_std_error( &jerr.original );
+        jerr.original.error_exit = jpegLumaErrorExit;
+        if (setjmp( jerr.setjmp_buffer ))
+            throw cimg_library::CImgIOException( "loadJpegLuma() : Error message returned by libjpeg : %s.", jerr.message );
+
+        jpeg_create_decompress( &cinfo );
+        jpeg_stdio_src( &cinfo, file );
+        jpeg_read_header( &cinfo, TRUE );
+
+        // Find the power of two (supported by every libjpeg version) which scales the image down to size, if there is one
+        unsigned int scale = 1;
+        while (scale < 8 && cinfo.image_width > width*scale) scale *= 2;
+        if ((cinfo.jpeg_color_space != JCS_GRAYSCALE && cinfo.jpeg_color_space != JCS_YCbCr) ||
+            cinfo.image_width != width*scale || cinfo.image_height != height*scale)
+        {
+            jpeg_destroy_decompress( &cinfo );
+            return false;
+        }
+        cinfo.out_color_space = JCS_GRAYSCALE;
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = scale;
+        jpeg_start_decompress( &cinfo );
+        if (cinfo.output_width != width || cinfo.output_height != height || cinfo.output_components != 1)
+        {
+            jpeg_destroy_decompress( &cinfo );
+            return false;
+        }
+
+        try {img.assign( width, height, 1, 1 );}
+        catch (...) {
+            jpeg_destroy_decompress( &cinfo );
+            throw;
+        }
+        while (cinfo.output_scanline < cinfo.output_height)
+        {
+            JSAMPROW row = img.data() + cinfo.output_scanline * width;
+            if (jpeg_read_scanlines( &cinfo, &row, 1 ) != 1) break; // truncated - keep what we have, as CImg does
+        }
+        if (cinfo.output_scanline == cinfo.output_height) jpeg_finish_decompress( &cinfo );
+        jpeg_destroy_decompress( &cinfo );
+        return true;
+    }
+
+}
+
+#endif //EFB_JPEGLUMA_H
@@ -4,70 +4,303 @@
 // Library sub-component includes
 #include "BufferedConduitImage.h"
 
+#ifdef __BMI2__
+    #include <immintrin.h>
+#endif
+
 namespace efb {
-    
-    //! Buffered conduit image abstract subclass which stores order_ bits for each 8-bit pixel value, scaled up and offset to span the 0-255 range.
+
+    //! Buffered conduit image class which stores Order bits for each 8-bit pixel value, scaled up and offset to span the 0-255 range.
+    /**
+        Data is stored in groups of Order bytes. Each group occupies 8 vertically adjacent pixels, pixel k holding bit k of each byte of the group (Gray coded and scaled up). Group g starts at pixel (g / (Height/8), (g % (Height/8))*8), so an image holds (Width*Height/8)*Order bytes.
+
+        The scale factor, offset and geometry are compile time constants of each instantiation, and the pixel tables are built once per instantiation. Whole images are implanted and extracted a band of 8 pixel rows at a time, so the pixel buffer is walked in memory order; the bits of each group are transposed with shifts and masks (PDEP/PEXT where BMI2 is enabled) and mapped through the pixel tables. The buffered per-block interface remains available and produces identical output.
+
+        Extraction can also score each byte by how close the pixels it was read from lie to a decision boundary between levels, so that an erasure-aware IFec can treat unreliable bytes as erasures.
+    */
+    template <unsigned int Order, unsigned int Width = 720, unsigned int Height = 720>
     class UpsampledConduitImage : public BufferedConduitImage
     {
-        //! Attribute which determines how many bits are stored in each pixel.
-        const unsigned int order_;
-                
-        //! Convert binary to 8-bit gray codes.
-        byte binaryToGray( byte num )
-        {
-            return (num>>1) ^ num;
-        }
-        
-        //! Convert 8-bit gray codes to binary.
-        byte grayToBinary( byte num )
-        {
-            unsigned short temp = num ^ (num>>8);
-            temp ^= temp>>4;
-            temp ^= temp>>2;
-            temp ^= temp>>1;
-            return temp;
-        }
-        
-        protected :
-            
-            //! Encode bits into a single pixel, using Gray codes.
-            void encodeInPixel( byte data, unsigned int i, unsigned int j )
-            {
-                // Choose a scale factor and an offset that minimise errors.
-                unsigned int factor = (255 / ((0x01 << order_)-1)) + 1;            
-                unsigned int offset =  ((factor * ((0x01 << order_)-1)) - 255) / 2;
-                int x = (binaryToGray(data) * factor) - offset;
+        public :
+
+            enum {
+                //! Largest symbol value.
+                MAX_SYMBOL  = (0x01 << Order) - 1,
+                // Choose a scale factor and an offset that minimise errors. Rounding the factor up overshoots 255 at the top, which is
+                // harmless while clamping only affects the largest symbol - beyond that (5 or more bits) we must round it down instead.
+                WIDE_FACTOR = (255 / MAX_SYMBOL) + 1,
+                WIDE_FITS   = ((MAX_SYMBOL-1) * WIDE_FACTOR) - (((WIDE_FACTOR * MAX_SYMBOL) - 255) / 2) < 255,
+                FACTOR      = WIDE_FITS ? WIDE_FACTOR : (255 / MAX_SYMBOL),
+                OFFSET      = ((FACTOR * MAX_SYMBOL) - 255) / 2,
+                //! Number of bands of 8 pixel rows.
+                BANDS       = Height / 8,
+                //! Number of data bytes which can be stored.
+                CAPACITY    = Width * BANDS * Order
+            };
+
+        private :
+
+            // Compile time check of the template parameters (array size is negative if they are invalid).
+            typedef char CheckParameters[ (Order >= 1 && Order <= 6 && Height % 8 == 0) ? 1 : -1 ];
+
+            //! Pixel lookup tables, shared by all images of this instantiation.
+            struct Tables
+            {
+                //! Pixel value for each symbol (entries above MAX_SYMBOL are unused).
+                byte encode[256];
+                //! Symbol for each pixel value.
+                byte decode[256];
+                //! Reliability of the symbol read from each pixel value...
+                byte reliability[256];
+                //! ...and the symbol bits which would flip were it read as the neighbouring level. Levels are Gray codes of their symbols, so adjacent levels can differ in several symbol bits.
+                byte weak_bits[256];
+
+                Tables()
+                {
+                    for (unsigned int k=0; k<256; k++) {
+                        encode[k] = (k <= MAX_SYMBOL) ? symbolToPixel( k ) : 0;
+                        decode[k] = pixelToSymbol( k );
+                        pixelReliability( k, reliability[k], weak_bits[k] );
+                    }
+                }
+            };
+
+            //! Get the pixel tables, building them on first use.
+            static const Tables& tables()
+            {
+                static const Tables t;
+                return t;
+            }
+
+            //! Convert binary to 8-bit gray codes.
+            static byte binaryToGray( byte num )
+            {
+                return (num>>1) ^ num;
+            }
+
+            //! Convert 8-bit gray codes to binary.
+            static byte grayToBinary( byte num )
+            {
+                unsigned short temp = num ^ (num>>8);
+                temp ^= temp>>4;
+                temp ^= temp>>2;
+                temp ^= temp>>1;
+                return temp;
+            }
+
+            //! Scale a symbol up to a pixel value, using Gray codes.
+            static byte symbolToPixel( byte data )
+            {
+                int x = (binaryToGray(data) * FACTOR) - OFFSET;
                 // Output in range 0-255 inclusive
-                operator()(i,j) =  (x>255? 255 : (x<0? 0 : x));
+                return (x>255? 255 : (x<0? 0 : x));
             }
-            
-            // Decode order_ bits from a single pixel.
-            byte decodeFromPixel( unsigned int i, unsigned int j )
+
+            //! Recover the symbol nearest to a pixel value.
+            static byte pixelToSymbol( byte pixel )
             {
-                // Choose a scale factor and an offset that minimise errors.
-                unsigned int factor = (255 / ((0x01 << order_)-1)) + 1;            
-                unsigned int offset =  ((factor * ((0x01 << order_)-1)) - 255) / 2;
-                int x = operator()(i,j) + offset;
-                int y = factor;
+                int x = pixel + OFFSET;
+                int y = FACTOR;
+                if (x < 0) x = 0;
                 // Round to nearest value
                 int r = (( x%y <<1) >= y) ? (x/y) + 1 : (x/y);
                 // Cap to max value
-                byte max = (0x01 << order_)-1;
-                r = (r > max) ? max : r;
+                r = (r > MAX_SYMBOL) ? MAX_SYMBOL : r;
                 // Convert to binary from gray code
                 return grayToBinary( r );
             }
-        
+
+            //! Score how far a pixel value lies from the decision boundary with the next nearest level, from 0 (on the boundary) to 255 (on its nearest level), and find the symbol bits which differ between the two levels. Values beyond the outermost levels are certain.
+            static void pixelReliability( byte pixel, byte& score, byte& bits )
+            {
+                int x = pixel + OFFSET;
+                int level = (x < 0) ? 0 : (x + FACTOR/2) / FACTOR;
+                if (level >= MAX_SYMBOL) level = MAX_SYMBOL;
+                int distance = x - level*FACTOR;
+                int neighbour = (distance >= 0) ? level + 1 : level - 1;
+                score = 255;
+                bits = 0;
+                if (neighbour < 0 || neighbour > MAX_SYMBOL) return;
+                if (distance < 0) distance = -distance;
+                int s = 255 - (510*distance) / FACTOR;
+                score = (s < 0) ? 0 : s;
+                // Decoding takes a level back to its symbol with grayToBinary, as pixelToSymbol does
+                bits = grayToBinary( level ) ^ grayToBinary( neighbour );
+            }
+
+            //! Spread the low nibble of b out so that bit k moves to bit 8k.
+            static unsigned int spread( unsigned int b )
+            {
+#ifdef __BMI2__
+                return _pdep_u32( b, 0x01010101 );
+#else
+                unsigned int x = b & 0x0f;
+                x = (x | (x << 14)) & 0x00030003;
+                x = (x | (x << 7)) & 0x01010101;
+                return x;
+#endif
+            }
+
+            //! Inverse of spread - collect bit 8k of w into bit k of a nibble.
+            static unsigned int gather( unsigned int w )
+            {
+#ifdef __BMI2__
+                return _pext_u32( w, 0x01010101 );
+#else
+                unsigned int x = w & 0x01010101;
+                x = (x | (x >> 7)) & 0x00030003;
+                x = (x | (x >> 14)) & 0x0000000f;
+                return x;
+#endif
+            }
+
+            //! Write a group of Order bytes to the 8 pixels at p, p+Width, ..., p+7*Width.
+            static void encodeGroup( const byte* data, byte* p, const byte* encode )
+            {
+                // Transpose so that byte k of lo/hi holds the symbol for pixel k/k+4
+                unsigned int lo = 0, hi = 0;
+                for (unsigned int b=0; b<Order; b++) {
+                    lo |= spread( data[b] ) << b;
+                    hi |= spread( data[b] >> 4 ) << b;
+                }
+                for (unsigned int k=0; k<4; k++) {
+                    p[k*Width]      = encode[ (lo >> (8*k)) & 0xff ];
+                    p[(k+4)*Width]  = encode[ (hi >> (8*k)) & 0xff ];
+                }
+            }
+
+            //! Read a group of Order bytes from the 8 pixels at p, p+Width, ..., p+7*Width.
+            static void decodeGroup( const byte* p, byte* data, const byte* decode )
+            {
+                unsigned int lo = 0, hi = 0;
+                for (unsigned int k=0; k<4; k++) {
+                    lo |= (unsigned int) decode[ p[k*Width] ] << (8*k);
+                    hi |= (unsigned int) decode[ p[(k+4)*Width] ] << (8*k);
+                }
+                for (unsigned int b=0; b<Order; b++)
+                    data[b] = gather( lo >> b ) | (gather( hi >> b ) << 4);
+            }
+
+            //! Score a group of Order bytes read from the 8 pixels at p, p+Width, ..., p+7*Width. Each byte gets the score of the least reliable pixel with a weak bit belonging to it (symbol bit b belongs to byte b).
+            static void groupReliability( const byte* p, byte* scores, const Tables& t )
+            {
+                for (unsigned int b=0; b<Order; b++) scores[b] = 255;
+                for (unsigned int k=0; k<8; k++) {
+                    byte pixel = p[k*Width];
+                    for (unsigned int b=0; b<Order; b++)
+                        if (((t.weak_bits[pixel] >> b) & 0x01) && t.reliability[pixel] < scores[b])
+                            scores[b] = t.reliability[pixel];
+                }
+            }
+
+            //! Get the block coordinates based on the index of the byte we are writing.
+            void getBlockCoords( unsigned int &i, unsigned int &j, unsigned int idx)
+            {
+                i = (idx/Order) / BANDS;
+                j = ((idx/Order) % BANDS)*8;
+            }
+
+            //! Encode Order bytes in a block of pixels. (i,j) indicates the pixel at the start of the block.
+            void encodeInBlock( std::deque<byte> data, unsigned int i, unsigned int j )
+            {
+                byte bytes[Order];
+                for (unsigned int b=0; b<Order; b++) bytes[b] = data[b];
+                encodeGroup( bytes, &operator()(i,j), tables().encode );
+            }
+
+            //! Decode Order bytes from a block of pixels. (i,j) indicates the first pixel in the block.
+            void decodeFromBlock( std::deque<byte> & data, unsigned int i, unsigned int j )
+            {
+                byte bytes[Order];
+                decodeGroup( &operator()(i,j), bytes, tables().decode );
+                // Append the bytes to the data
+                data.insert( data.end(), bytes, bytes+Order );
+            }
+
         public :
-            
+
             //! Constructor.
-            UpsampledConduitImage(unsigned int block_size, unsigned int order) :
-                BufferedConduitImage(block_size),
-                order_(order)
+            UpsampledConduitImage() :
+                BufferedConduitImage(Order) // block size is Order bytes
             {}
+
+            //! Get the maximum ammount of data (in bytes) that can be stored in this implementation.
+            virtual unsigned int getMaxData()
+            {
+                return CAPACITY;
+            }
+
+            //! Get the width of the image data is stored in.
+            virtual unsigned int getFormatWidth() { return Width; }
+            //! Get the height of the image data is stored in.
+            virtual unsigned int getFormatHeight() { return Height; }
+
+            //! Implant data, a band of 8 pixel rows at a time.
+            virtual void implantData( std::vector<byte>& data )
+            {
+                // Format the image for implantation
+                formatForImplantation( Width, Height );
+
+                // Check the data isn't too large
+                if (data.size() > getMaxData())
+                    throw ConduitImageImplantException("Too much data");
+
+                // Pad out with random bytes till we reach capacity - in place, rather than copying the whole payload
+                std::srand ( time(NULL) );
+                data.reserve( getMaxData() );
+                while ( data.size() < getMaxData() ) data.push_back( (byte) std::rand() );
+
+                const byte* encode = tables().encode;
+                for (unsigned int band=0; band<BANDS; band++)
+                {
+                    byte* row = this->data() + (band*8)*Width;
+                    // Group (x*BANDS + band) lives in column x of this band
+                    const byte* d = &data[Order*band];
+                    for (unsigned int x=0; x<Width; x++, d+=Order*BANDS)
+                        encodeGroup( d, row + x, encode );
+                }
+            }
+
+            //! Extract data, a band of 8 pixel rows at a time.
+            virtual void extractData( std::vector<byte>& data )
+            {
+                if (width() != (int) Width || height() != (int) Height)
+                    throw ConduitImageExtractException("Incorrect image dimensions");
+                data.resize( getMaxData() );
+
+                const byte* decode = tables().decode;
+                for (unsigned int band=0; band<BANDS; band++)
+                {
+                    const byte* row = this->data() + (band*8)*Width;
+                    byte* d = &data[Order*band];
+                    for (unsigned int x=0; x<Width; x++, d+=Order*BANDS)
+                        decodeGroup( row + x, d, decode );
+                }
+            }
+
+            //! Extract data as extractData, scoring each byte by the reliability of the pixels it was read from.
+            virtual void extractDataWithReliability( std::vector<byte>& data, std::vector<byte>& reliability )
+            {
+                if (width() != (int) Width || height() != (int) Height)
+                    throw ConduitImageExtractException("Incorrect image dimensions");
+                data.resize( getMaxData() );
+                reliability.resize( getMaxData() );
+
+                const Tables& t = tables();
+                for (unsigned int band=0; band<BANDS; band++)
+                {
+                    const byte* row = this->data() + (band*8)*Width;
+                    byte* d = &data[Order*band];
+                    byte* r = &reliability[Order*band];
+                    for (unsigned int x=0; x<Width; x++, d+=Order*BANDS, r+=Order*BANDS) {
+                        decodeGroup( row + x, d, t.decode );
+                        groupReliability( row + x, r, t );
+                    }
+                }
+            }
     };
-    
+
 }
-    
+
 #endif //EFB_UPSAMPLEDCONDUITIMAGE_H
-    
\ No newline at end of file
+
@@ -0,0 +1,82 @@
+#ifndef EFB_BOTANCIPHERSTREAM_H
+#define EFB_BOTANCIPHERSTREAM_H
+
+// Standard library includes
+#include <algorithm>
+#include <vector>
+
+// Botan crypto library includes
+#include <botan/botan.h>
+
+// eFB Library sub-component includes
+#include "../Common.h"
+
+namespace efb {
+
+    //! Run a Botan cipher filter over a buffer in place, one chunk at a time.
+    /**
+        Writing a whole message into a Botan::Pipe and then reading it back leaves a second full copy of the data queued inside the pipe. A stream mode such as CFB produces its output as soon as the input is written, so here the output of each chunk is read back into place before the next chunk is written, and the pipe never holds more than one chunk. The output can never overtake the input, so nothing is overwritten before it has been read. The pipe takes ownership of the filter.
+    */
+    inline void cipherInPlace( Botan::Filter* cipher, byte* data, size_t size )
+    {
+        enum { CHUNK_SIZE = 16*1024 };
+        Botan::Pipe pipe( cipher );
+        pipe.start_msg();
+        size_t written = 0, read = 0;
+        while (written < size) {
+            size_t len = std::min( (size_t) CHUNK_SIZE, size - written );
+            pipe.write( data + written, len );
+            written += len;
+            read += pipe.read( data + read, std::min( pipe.remaining(), written - read ) );
+        }
+        pipe.end_msg();
+        pipe.read( data + read, std::min( pipe.remaining(), size - read ) );
+    }
+
+    //! A Botan cipher filter run over a message which is supplied a piece at a time.
+    /**
+        Used to encrypt and decrypt messages too large to hold in memory whole: each piece's output is read back out of the pipe as soon as it is written, as cipherInPlace does, so the pipe never holds more than one piece. A stream mode may hold back part of its output until more input (or the end of the message) arrives, so output is appended to a buffer rather than written in place. The pipe takes ownership of the filter.
+    */
+    class CipherStream
+    {
+        Botan::Pipe pipe_;
+
+        //! Append whatever output the pipe has ready.
+        void readOutput( std::vector<byte>& out )
+        {
+            size_t ready = pipe_.remaining();
+            if (ready == 0) return;
+            size_t old_size = out.size();
+            out.resize( old_size + ready );
+            out.resize( old_size + pipe_.read( &out[old_size], ready ) );
+        }
+
+        // Not copyable
+        CipherStream( const CipherStream& );
+        CipherStream& operator=( const CipherStream& );
+
+        public :
+            CipherStream( Botan::Filter* cipher ) :
+                pipe_( cipher )
+            {
+                pipe_.start_msg();
+            }
+
+            //! Run the next piece of the message through the cipher, appending the output to out.
+            void write( const byte* data, size_t size, std::vector<byte>& out )
+            {
+                if (size == 0) return;
+                pipe_.write( data, size );
+                readOutput( out );
+            }
+
+            //! End the message, appending any output still held back to out.
+            void finish( std::vector<byte>& out )
+            {
+                pipe_.end_msg();
+                readOutput( out );
+            }
+    };
+}
+
+#endif //EFB_BOTANCIPHERSTREAM_H
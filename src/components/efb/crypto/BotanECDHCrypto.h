@@ -0,0 +1,487 @@
+#ifndef EFB_BOTANECDHCRYPTO_H
+#define EFB_BOTANECDHCRYPTO_H
+
+/**
+################################################################################
+    This file contains the class definition for a Botan library based elliptic
+    curve crytography module.
+################################################################################
+*/
+
+// Standard library includes
+#include <fstream>
+#include <map>
+#include <algorithm>
+
+// Botan crypto library includes
+#include <botan/botan.h>
+#include <botan/ecdh.h>
+#include <botan/pubkey.h>
+
+// eFB Library sub-component includes
+#include "ICrypto.h"
+#include "BotanCipherStream.h"
+#include "PayloadCompression.h"
+#include "../Threading.h"
+
+namespace efb {
+
+    //! Botan cryptography class using N-byte AES and elliptic curve Diffie-Hellman key agreement over the NIST P-256 curve.
+    /**
+        This class uses the Botan cryptography library to perform encryption and decryption in place, in the manner of ECIES. A fresh (ephemeral) key pair is generated for each message. For each recipient, key agreement between the ephemeral private key and the recipient's public key gives a shared secret, from which KDF2(SHA-256) derives a key-encrypting key, salted with the IV and the recipient's ID. The message key is XORed with this to wrap it. The recipient repeats the key agreement with their own private key and the ephemeral public key, so decryption needs only one elliptic curve multiplication and no RSA private key operation.
+
+        The header consists of two length bytes specifying the number of recipients (with the top bit set, as the IDs are sorted), the message IV and the ephemeral public key in plaintext, and a sequence of (Facebook ID, wrapped message-key) pairs sorted by ID. Each pair is 8+N bytes, compared with 8+256 for BotanRSACrypto<32,256>.
+
+        As with BotanRSACrypto, messages are compressed before encryption when that makes them smaller, which is flagged in the length bytes.
+    */
+    template <int N>
+    class BotanECDHCrypto : public ICrypto
+    {
+        //! Sizes of the IV and of an uncompressed P-256 public key, the header length tag flags set if the IDs are sorted (always, for this class) or the message is compressed, and the largest number of IDs which can be stored.
+        enum { IV_LEN = 16, POINT_LEN = 65, SORTED_IDS = 0x8000, COMPRESSED = 0x4000, MAX_IDS = 0x3fff };
+
+        //! Name of the curve used for all keys.
+        static const char* curveName() { return "secp256r1"; }
+        //! Name of the key derivation function used to derive key-encrypting keys from shared secrets.
+        static const char* kdfName() { return "KDF2(SHA-256)"; }
+
+        // Generate or set a random IV and random message key
+        void generateNewIv()
+            {iv_ = Botan::InitializationVector(rng_, IV_LEN);} // a random 16-byte iv
+        void generateNewMessageKey()
+            {key_ = Botan::SymmetricKey(rng_, N);} // a random N-byte key
+
+        //! Write the length tag at the start of the data
+        void writeNumIds( byte data[], unsigned short len ) const
+        {
+            data[0] = (unsigned char) (len >> 8) ;
+            data[1] = (unsigned char) len;
+        }
+        //! Read the raw length tag at the start of the data, including flags
+        unsigned short readLengthTag( const std::vector<byte>& data ) const
+        {
+            if (data.size() < 2) throw DecryptionException("Header is too short.");
+            return (((unsigned short) data[0]) << 8) | data[1];
+        }
+        //! Read the number of IDs from the length tag at the start of the data
+        unsigned short readNumIds( const std::vector<byte>& data ) const
+        {
+            return readLengthTag( data ) & MAX_IDS;
+        }
+        //! Read a Facebook ID from the header
+        static unsigned long long int readId( const byte data[] )
+        {
+            unsigned long long int id_int = 0;
+            for (unsigned int j=0; j<8; j++)
+                id_int = id_int | (((unsigned long long int)data[j]) << (j*8));
+            return id_int;
+        }
+
+        //! Derive the key-encrypting key for a recipient from a key agreement with the other party's public key, and XOR it into N bytes of data.
+        void wrapKey
+        (
+            const Botan::PK_Key_Agreement& agreement,
+            const byte public_value[],
+            unsigned long long int id_int,
+            byte data[]
+        ) const
+        {
+            // Salt with the IV and recipient ID, so every key-encrypting key is distinct
+            byte salt[IV_LEN+8];
+            for (unsigned int i=0; i<IV_LEN; i++) salt[i] = iv_.begin()[i];
+            for (unsigned int j=0; j<8; j++) salt[IV_LEN+j] = (unsigned char) (id_int >> (j*8));
+            Botan::SymmetricKey kek = agreement.derive_key( N, public_value, POINT_LEN, salt, sizeof(salt) );
+            for (unsigned int i=0; i<N; i++) data[i] ^= kek.begin()[i];
+        }
+
+        //! Get the public value (encoded point) of the ID provided.
+        const byte* getPublicValue( const FacebookId & id ) const
+        {
+            typename std::map<FacebookId,Botan::MemoryVector<byte> >::const_iterator it = idkeymap_.find( id );
+            if (it == idkeymap_.end())
+                throw EncryptionException("No public key loaded for a recipient ID.");
+            return it->second.begin();
+        }
+
+        //! Store a public key's encoded point against an ID, checking it is on the right curve.
+        void setRecipientKey( const FacebookId & id, const Botan::ECDH_PublicKey & key )
+        {
+            Botan::MemoryVector<byte> public_value = key.public_value();
+            if (public_value.size() != POINT_LEN)
+                throw IdException("Public key is not an uncompressed P-256 key.");
+            idkeymap_[id] = public_value;
+        }
+
+        //! Task which wraps the message key for each recipient, writing it straight to its place in the header. Each worker has its own key agreement object.
+        class WrapKeyTask : public IParallelTask
+        {
+            const BotanECDHCrypto& crypto_;
+            const std::vector<Botan::PK_Key_Agreement*>& agreements_;
+            const std::vector<const byte*>& public_values_;
+            const std::vector<unsigned long long int>& ids_;
+            const std::vector<byte*>& outputs_;
+            std::vector<byte>& failed_;
+
+            public :
+                WrapKeyTask
+                (
+                    const BotanECDHCrypto& crypto,
+                    const std::vector<Botan::PK_Key_Agreement*>& agreements,
+                    const std::vector<const byte*>& public_values,
+                    const std::vector<unsigned long long int>& ids,
+                    const std::vector<byte*>& outputs,
+                    std::vector<byte>& failed
+                ) :
+                    crypto_( crypto ),
+                    agreements_( agreements ),
+                    public_values_( public_values ),
+                    ids_( ids ),
+                    outputs_( outputs ),
+                    failed_( failed )
+                {}
+
+                void run( unsigned int item, unsigned int worker )
+                {
+                    try {
+                        for (unsigned int i=0; i<N; i++) outputs_[item][i] = crypto_.key_.begin()[i];
+                        crypto_.wrapKey( *agreements_[worker], public_values_[item], ids_[item], outputs_[item] );
+                    }
+                    catch (...) { failed_[item] = 1; }
+                }
+        };
+
+        //! Create the crypto header using a new IV, message key and ephemeral key pair.
+        void createCryptoHeader
+        (
+            std::vector<FacebookId> & ids,
+            std::vector<byte> & data,
+            bool compressed
+        )
+        {
+            if (ids.size() > MAX_IDS) throw EncryptionException("Too many recipients.");
+
+            // Randomise key, initialisation vector and ephemeral key pair
+            generateNewIv();
+            generateNewMessageKey();
+            Botan::ECDH_PrivateKey ephemeral_key( rng_, group_ );
+            Botan::MemoryVector<byte> ephemeral_value = ephemeral_key.public_value();
+            if (ephemeral_value.size() != POINT_LEN)
+                throw EncryptionException("Unexpected ephemeral public key size.");
+
+            // Offset into the header
+            unsigned int offset = 0;
+
+            // Write tag with the number of IDs to the start of the header, flagging that they are sorted and whether the message is compressed.
+            writeNumIds( &data[offset], (unsigned short) (ids.size() | SORTED_IDS | (compressed ? COMPRESSED : 0)) );
+            offset+=2;
+
+            // Write IV and ephemeral public key to the header, in plaintext
+            for (unsigned int i=0; i<IV_LEN; i++)
+                data[offset+i] = iv_.begin()[i];
+            offset+=IV_LEN;
+            for (unsigned int i=0; i<POINT_LEN; i++)
+                data[offset+i] = ephemeral_value[i];
+            offset+=POINT_LEN;
+
+            // For each ID (in order), insert the ID and note where its wrapped key goes
+            std::vector<FacebookId> sorted_ids( ids );
+            std::sort( sorted_ids.begin(), sorted_ids.end() );
+            std::vector<const byte*> public_values( sorted_ids.size() );
+            std::vector<unsigned long long int> id_ints( sorted_ids.size() );
+            std::vector<byte*> outputs( sorted_ids.size() );
+            for (unsigned int i=0; i<sorted_ids.size(); i++) {
+                id_ints[i] = sorted_ids[i].val;
+                for (unsigned int j=0; j<8; j++)
+                    data[offset+j] = (unsigned char) (id_ints[i] >> (j*8));
+                offset+=8;
+                public_values[i] = getPublicValue( sorted_ids[i] );
+                outputs[i] = &data[offset];
+                offset+=N;
+            }
+
+            // Wrap the message key for every recipient in parallel
+            unsigned int num_workers = (sorted_ids.size() < pool_.available()) ? sorted_ids.size() : pool_.available();
+            std::vector<Botan::PK_Key_Agreement*> agreements( num_workers );
+            for (unsigned int w=0; w<num_workers; w++)
+                agreements[w] = new Botan::PK_Key_Agreement( ephemeral_key, kdfName() );
+            std::vector<byte> failed( sorted_ids.size(), 0 );
+            WrapKeyTask task( *this, agreements, public_values, id_ints, outputs, failed );
+            pool_.run( task, sorted_ids.size() );
+            for (unsigned int w=0; w<num_workers; w++)
+                delete agreements[w];
+            for (unsigned int i=0; i<failed.size(); i++)
+                if (failed[i]) throw EncryptionException("Failed to wrap the message key for a recipient.");
+        }
+
+        //! Attempt to parse a crypto header - this will retrieve and set the message key and IV.
+        void parseCryptoHeader
+        (
+            std::vector<byte> & data
+        )
+        {
+            // Retrieve the number of recipients, and check they are all there
+            unsigned short tag = readLengthTag(data);
+            unsigned int len = tag & MAX_IDS;
+            if (!(tag & SORTED_IDS) || data.size() < calculateHeaderSize(len))
+                throw DecryptionException("Header is invalid or truncated.");
+            unsigned int offset = 2;
+
+            // Retrieve the IV and ephemeral public key
+            iv_ = Botan::InitializationVector( &data[offset], IV_LEN );
+            offset+=IV_LEN;
+            const byte* ephemeral_value = &data[offset];
+            offset+=POINT_LEN;
+
+            // Binary search for the user's (ID, key) pair
+            const unsigned int pair_len = 8 + N;
+            const byte* pairs = &data[offset];
+            unsigned int lo = 0, hi = len;
+            while (lo < hi) {
+                unsigned int mid = lo + (hi - lo) / 2;
+                if (readId( pairs + mid*pair_len ) < id_.val) lo = mid + 1;
+                else hi = mid;
+            }
+            if (lo >= len || readId( pairs + lo*pair_len ) != id_.val)
+                throw DecryptionException("ID not found - cannot decrypt this message.");
+            if (agreement_ == NULL)
+                throw DecryptionException("No private key loaded - cannot decrypt this message.");
+
+            // We can decrypt, so unwrap the message key
+            byte mkey[N];
+            for (unsigned int i=0; i<N; i++) mkey[i] = pairs[lo*pair_len + 8 + i];
+            try {wrapKey( *agreement_, ephemeral_value, id_.val, mkey );}
+            catch (std::exception&) {
+                throw DecryptionException("Invalid ephemeral public key.");
+            }
+            key_ = Botan::SymmetricKey( mkey, N );
+            for (unsigned int i=0; i<N; i++) mkey[i] = 0;
+        }
+
+        //! Botan library attribute members. Agreements run on the pool threads, which needs the library's locking switched on.
+        Botan::LibraryInitializer init_;
+        Botan::AutoSeeded_RNG rng_;
+        Botan::EC_Group group_;
+        Botan::InitializationVector iv_;
+        // user keys
+        Botan::SymmetricKey key_;
+        Botan::ECDH_PrivateKey* private_key_;
+        // recipient public key dictionary (encoded points)
+        std::map<FacebookId,Botan::MemoryVector<byte> > idkeymap_;
+        // user's Facebook ID
+        FacebookId id_;
+        // key agreement object using the user's private key, for decryption
+        Botan::PK_Key_Agreement* agreement_;
+        // Thread pool for wrapping message keys
+        const WorkerPool pool_;
+        // cipher for the message being encrypted or decrypted a piece at a time, if any
+        CipherStream* stream_;
+
+        // Not copyable
+        BotanECDHCrypto( const BotanECDHCrypto& );
+        BotanECDHCrypto& operator=( const BotanECDHCrypto& );
+
+        public :
+
+            BotanECDHCrypto() :
+                init_( "thread_safe=true" ),
+                group_( curveName() ),
+                private_key_( NULL ),
+                agreement_( NULL ),
+                stream_( NULL )
+            {
+                // so we can work out their sizes properly...
+                generateNewIv();
+                generateNewMessageKey();
+            }
+
+            ~BotanECDHCrypto()
+            {
+                delete agreement_;
+                delete private_key_;
+                delete stream_;
+            }
+
+            unsigned int calculateHeaderSize( unsigned int numOfIds ) const
+                // Length tag + IV length + ephemeral public key + number of IDs x (ID length + wrapped key length)
+                {return sizeof(short) + IV_LEN + POINT_LEN + numOfIds*(sizeof(long long int) + N);}
+
+            unsigned int retrieveHeaderSize(std::vector<byte>& data) const
+            {
+                unsigned int numOfIds = readNumIds(data);
+                return calculateHeaderSize(numOfIds);
+            }
+
+            void encryptMessage
+            (
+                std::vector<FacebookId>& ids,
+                std::vector<byte>& data // with header-size offset before data bytes begin
+            )
+            {
+                // compress the message first, unless that wouldn't make it any smaller
+                unsigned int hs = calculateHeaderSize( ids.size() );
+                bool compressed = compressPayload( data, hs );
+
+                // note - this will change (randomise) the IV and message key
+                createCryptoHeader( ids, data, compressed );
+
+                // perform the encryption, skipping the first <header size> bytes
+                unsigned int ds = data.size(), ms = ds - hs;
+                std::stringstream ss; ss << "AES-" << N*8 << "/CFB";
+                cipherInPlace(
+                    get_cipher(ss.str(), key_, iv_, Botan::ENCRYPTION), &data[hs], ms );
+            }
+
+            void beginMessage
+            (
+                std::vector<FacebookId>& ids,
+                std::vector<byte>& header,
+                bool compressed
+            )
+            {
+                // note - this will change (randomise) the IV and message key
+                header.resize( calculateHeaderSize( ids.size() ) );
+                createCryptoHeader( ids, header, compressed );
+                delete stream_;
+                stream_ = NULL;
+                std::stringstream ss; ss << "AES-" << N*8 << "/CFB";
+                stream_ = new CipherStream( get_cipher(ss.str(), key_, iv_, Botan::ENCRYPTION) );
+            }
+
+            void encryptMessagePart( const byte* data, unsigned int size, std::vector<byte>& out )
+            {
+                if (stream_ == NULL) throw EncryptionException("No message has been started.");
+                stream_->write( data, size, out );
+            }
+
+            bool beginDecryption( std::vector<byte>& header )
+            {
+                // note - as decryptMessage, this sets the IV and message key from the header, throwing if we can't decrypt it
+                parseCryptoHeader( header );
+                delete stream_;
+                stream_ = NULL;
+                std::stringstream ss; ss << "AES-" << N*8 << "/CFB";
+                stream_ = new CipherStream( get_cipher(ss.str(), key_, iv_, Botan::DECRYPTION) );
+                return (readLengthTag(header) & COMPRESSED) != 0;
+            }
+
+            void decryptMessagePart( const byte* data, unsigned int size, std::vector<byte>& out )
+            {
+                if (stream_ == NULL) throw DecryptionException("No message has been started.");
+                stream_->write( data, size, out );
+            }
+
+            void endMessage( std::vector<byte>& out )
+            {
+                if (stream_ == NULL) return;
+                stream_->finish( out );
+                delete stream_;
+                stream_ = NULL;
+            }
+
+            void decryptMessage( std::vector<byte>& data )
+            {
+                // note - this will try make a valid header from the start of the data and use it to set the IV and message key. If the image is not valid or we are not on the intended recipients list this may well throw an exception.
+                parseCryptoHeader(data);
+
+                // perform the decryption, skipping the first <header size> bytes
+                unsigned int hs = retrieveHeaderSize(data), ds = data.size(), ms = ds - hs;
+                std::stringstream ss; ss << "AES-" << N*8 << "/CFB";
+                cipherInPlace(
+                    get_cipher(ss.str(), key_, iv_, Botan::DECRYPTION), &data[hs], ms );
+
+                // undo any compression
+                if (readLengthTag(data) & COMPRESSED)
+                    decompressPayload( data, hs );
+            }
+
+            //! Generate a private/public key pair and save to disk.
+            void generateKeys
+            (
+                std::ofstream& private_key_file,
+                std::ofstream& public_key_file,
+                std::string& passphrase
+            )
+            {
+                // Create keys.
+                Botan::ECDH_PrivateKey ecdh_key(rng_, group_);
+
+                // PEM encode as strings.
+                std::string ecdh_private_pem = Botan::PKCS8::PEM_encode(ecdh_key, rng_, passphrase);
+                std::string ecdh_public_pem = Botan::X509::PEM_encode(ecdh_key);
+
+                // Write to disk
+                private_key_file << ecdh_private_pem;
+                public_key_file << ecdh_public_pem;
+            }
+
+            //! Load a private/public key pair from disk.
+            void loadKeys
+            (
+                std::string& private_key_filename,
+                std::string& public_key_filename,
+                std::string& passphrase
+            )
+            {
+                // Load into pointers
+                Botan::PKCS8_PrivateKey* private_key_ptr(
+                    Botan::PKCS8::load_key(private_key_filename, rng_, passphrase) );
+                Botan::X509_PublicKey* public_key_ptr(
+                    Botan::X509::load_key(public_key_filename) );
+
+                Botan::ECDH_PrivateKey* private_key = dynamic_cast<Botan::ECDH_PrivateKey*>(private_key_ptr);
+                Botan::ECDH_PublicKey* public_key = dynamic_cast<Botan::ECDH_PublicKey*>(public_key_ptr);
+                if (private_key == NULL || public_key == NULL) {
+                    delete private_key_ptr;
+                    delete public_key_ptr;
+                    throw IdException("Keys are not ECDH keys.");
+                }
+
+                // Add public key to key map so it can be used for encryption
+                setRecipientKey( id_, *public_key );
+                delete public_key_ptr;
+
+                // Keep the private key, and create the key agreement object used to decrypt
+                delete agreement_;
+                delete private_key_;
+                private_key_ = private_key;
+                agreement_ = new Botan::PK_Key_Agreement(*private_key_, kdfName());
+            }
+
+            //! Load potential recipients' public keys into memory.
+            void loadIdKeyPair
+            (
+                FacebookId& id,
+                std::string& key_filename
+            )
+            {
+                // Read the public key from the file.
+                Botan::X509_PublicKey* key_ptr(
+                    Botan::X509::load_key(key_filename) );
+                Botan::ECDH_PublicKey* key = dynamic_cast<Botan::ECDH_PublicKey*>(key_ptr);
+                if (key == NULL) {
+                    delete key_ptr;
+                    throw IdException("Key is not an ECDH key.");
+                }
+
+                // Save the pair in the id/key map.
+                setRecipientKey( id, *key );
+                delete key_ptr;
+            }
+
+            //! Set the Facebook ID for decryption
+            void setUserId(const FacebookId& id) {
+                id_.val = id.val;
+            }
+            
+            //! SHA-256 digest of a byte array, using a hash object of its own so workers can call it at the same time.
+            std::vector<byte> messageDigest( const byte* data, unsigned int size ) const
+            {
+                Botan::HashFunction* hash = Botan::get_hash("SHA-256");
+                Botan::SecureVector<byte> digest = hash->process( data, size );
+                delete hash;
+                return std::vector<byte>( digest.begin(), digest.end() );
+            }
+    };
+}
+
+#endif //EFB_BOTANECDHCRYPTO_H
@@ -9,6 +9,9 @@
 
 // Standard library includes
 #include <fstream>
+#include <map>
+#include <deque>
+#include <algorithm>
 
 // Botan crypto library includes
 #include <botan/botan.h>
@@ -18,11 +21,20 @@
 
 // eFB Library sub-component includes
 #include "ICrypto.h"
+#include "BotanCipherStream.h"
+#include "PayloadCompression.h"
+#include "../Threading.h"
 
 namespace efb {
         //! Botan cryptography class using N-byte AES and M-byte RSA.
     /**
-        This class uses the Botan cryptography library to perform encryption and decryption in place. AES and RSA are the symmetric and asymmetric (respectively) schemes employed. The template variables <N,M> determine the key lengths. The header consists of two length bytes specifying the number of recipients, the message IV in plaintext, and a sequence of (Facebook ID, message-key) pairs. Each message-key is encrypted under the public key of the Facebook ID it is paired with.
+        This class uses the Botan cryptography library to perform encryption and decryption in place. The message key is encrypted for each recipient in parallel, each worker thread having its own random number generator. AES and RSA are the symmetric and asymmetric (respectively) schemes employed. The template variables <N,M> determine the key lengths. The header consists of two length bytes specifying the number of recipients, the message IV in plaintext, and a sequence of (Facebook ID, message-key) pairs. Each message-key is encrypted under the public key of the Facebook ID it is paired with.
+        
+        Headers are written with the pairs sorted by ID, which is flagged by setting the top bit of the length bytes, so a reader can find its own ID with a binary search. Headers with unsorted pairs (as written by earlier versions) are still read, with a linear search.
+        
+        Messages are compressed with zlib before encryption, unless that would not make them any smaller, in which case they are stored as they are. The second bit of the length bytes flags a compressed message.
+        
+        Reposts and comment threads often carry the same header many times over, so unwrapped message keys are cached against the (IV, wrapped message-key) pair they came from, and the RSA private key operation is only done the first time a header is seen. The keys are held in Botan's secure memory (locked where the platform allows, and zeroised when released), and the oldest are dropped once the cache is full.
     */
     template <int N, int M>
     class BotanRSACrypto : public ICrypto
@@ -32,18 +44,81 @@ namespace efb {
             {iv_ = Botan::InitializationVector(rng_, 16);} // a random 16-byte iv
         void generateNewMessageKey()
             {key_ = Botan::SymmetricKey(rng_, N);} // a random N-byte key
-        //! Write out an encypted message key using the public key of the ID provided.
-        void getCipheredMessageKey
+        //! Get the encryptor for the public key of the ID provided.
+        Botan::PK_Encryptor* getEncryptor( const FacebookId & id ) const
+        {
+            typename std::map<FacebookId,Botan::PK_Encryptor*>::const_iterator it = encryptors_.find( id );
+            if (it == encryptors_.end())
+                throw EncryptionException("No public key loaded for a recipient ID.");
+            return it->second;
+        }
+        //! Task which encrypts the message key for each recipient, writing it straight to its place in the header.
+        class WrapKeyTask : public IParallelTask
+        {
+            BotanRSACrypto& crypto_;
+            const std::vector<Botan::PK_Encryptor*>& encryptors_;
+            const std::vector<byte*>& outputs_;
+            std::vector<byte>& failed_;
+            
+            public :
+                WrapKeyTask
+                (
+                    BotanRSACrypto& crypto,
+                    const std::vector<Botan::PK_Encryptor*>& encryptors,
+                    const std::vector<byte*>& outputs,
+                    std::vector<byte>& failed
+                ) :
+                    crypto_( crypto ),
+                    encryptors_( encryptors ),
+                    outputs_( outputs ),
+                    failed_( failed )
+                {}
+                
+                void run( unsigned int item, unsigned int worker )
+                {
+                    try {
+                        // Each worker has its own random number generator
+                        Botan::SecureVector<byte> mkey_encrypted = encryptors_[item]->encrypt(
+                            crypto_.key_.begin(), crypto_.key_.length(), *crypto_.worker_rngs_[worker] );
+                        if (mkey_encrypted.size() != M) {
+                            failed_[item] = 1;
+                            return;
+                        }
+                        for (unsigned int i=0; i<M; i++)
+                            outputs_[item][i] = mkey_encrypted[i];
+                    }
+                    catch (...) { failed_[item] = 1; }
+                }
+        };
+        //! Store a recipient's public key, replacing any previous key and (re)building its encryptor.
+        void setRecipientKey
         (
-            FacebookId & id,
-            byte data[]
+            const FacebookId & id,
+            const Botan::RSA_PublicKey & key
         )
         {
-            Botan::RSA_PublicKey pubkey = idkeymap_[ id ];
-            Botan::PK_Encryptor* encryptor = Botan::get_pk_encryptor(pubkey, "EME1(SHA-512)");
-            Botan::SecureVector<byte> mkey_encrypted = encryptor->encrypt(key_.begin(),key_.length(),rng_);
-            for (unsigned int i=0; i<mkey_encrypted.size();i++)
-                data[i] = mkey_encrypted[i];
+            // The encryptor refers to the key in the map, so it must go before the key is replaced
+            typename std::map<FacebookId,Botan::PK_Encryptor*>::iterator it = encryptors_.find( id );
+            if (it != encryptors_.end()) {
+                delete it->second;
+                encryptors_.erase( it );
+            }
+            idkeymap_[id] = key;
+            encryptors_[id] = new Botan::PK_Encryptor_EME(idkeymap_[id], "EME1(SHA-512)");
+        }
+        //! Header length tag flags, set if the IDs are sorted or the message is compressed, and the largest number of IDs which can be stored.
+        enum { SORTED_IDS = 0x8000, COMPRESSED = 0x4000, MAX_IDS = 0x3fff };
+        //! Maximum number of unwrapped message keys to keep.
+        enum { KEY_CACHE_SIZE = 1024 };
+        //! Remember an unwrapped message key, dropping the oldest if the cache is full.
+        void cacheMessageKey( const std::vector<byte>& wrapped, const Botan::SymmetricKey& key )
+        {
+            if (key_cache_.size() >= KEY_CACHE_SIZE) {
+                key_cache_.erase( key_cache_order_.front() );
+                key_cache_order_.pop_front();
+            }
+            key_cache_.insert( std::make_pair( wrapped, key ) );
+            key_cache_order_.push_back( wrapped );
         }
         //! Write the length tag at the start of the data
         void writeNumIds( byte data[], unsigned short len ) const
@@ -51,9 +126,10 @@ namespace efb {
             data[0] = (unsigned char) (len >> 8) ;
             data[1] = (unsigned char) len;
         }
-        //! Read the length tag at the start of the data
-        unsigned short readNumIds( std::vector<byte> data ) const
+        //! Read the raw length tag at the start of the data, including flags
+        unsigned short readLengthTag( const std::vector<byte>& data ) const
         {
+            if (data.size() < 2) throw DecryptionException("Header is too short.");
             unsigned short len;
             unsigned char len_hi, len_lo;
             len_hi = data[0];
@@ -61,14 +137,30 @@ namespace efb {
             len = (((unsigned short) len_hi) << 8) | len_lo;
             return len;
         }
+        //! Read the number of IDs from the length tag at the start of the data
+        unsigned short readNumIds( const std::vector<byte>& data ) const
+        {
+            return readLengthTag( data ) & MAX_IDS;
+        }
+        //! Read a Facebook ID from the header
+        static unsigned long long int readId( const byte data[] )
+        {
+            unsigned long long int id_int = 0;
+            for (unsigned int j=0; j<8; j++)
+                id_int = id_int | (((unsigned long long int)data[j]) << (j*8));
+            return id_int;
+        }
         
         //! Create the crypto header using a new IV and message key.
         void createCryptoHeader
         (
             std::vector<FacebookId> & ids,
-            std::vector<byte> & data
+            std::vector<byte> & data,
+            bool compressed
         )
         {
+            if (ids.size() > MAX_IDS) throw EncryptionException("Too many recipients.");
+            
             // Randomise key and initialisation vector.
             generateNewIv();
             generateNewMessageKey();
@@ -79,8 +171,8 @@ namespace efb {
             // Offset into the header
             unsigned int offset = 0;
 
-            // Write tag with the number of IDs to the start of the header.
-            writeNumIds( &data[offset], (unsigned short) ids.size() );
+            // Write tag with the number of IDs to the start of the header, flagging that they are sorted and whether the message is compressed.
+            writeNumIds( &data[offset], (unsigned short) (ids.size() | SORTED_IDS | (compressed ? COMPRESSED : 0)) );
             offset+=2;
             
             // Write IV to the header, in plaintext
@@ -88,19 +180,43 @@ namespace efb {
                 data[offset+i] = iv_.begin()[i];
             offset+=iv_.length();
 
-            // For each ID, lookup the public key and encrypt the message key
-            for (unsigned int i=0; i<ids.size();i++) {
+            // For each ID, insert the ID and lookup the encryptor for its public key. An ID listed more than once only has its key encrypted once (encryptors can't be shared between threads), and is copied afterwards.
+            std::vector<Botan::PK_Encryptor*> encryptors;
+            std::vector<byte*> outputs;
+            std::vector<unsigned int> copy_to, copy_from;
+            std::map<FacebookId,unsigned int> first_slot;
+            std::vector<FacebookId> sorted_ids( ids );
+            std::sort( sorted_ids.begin(), sorted_ids.end() );
+            for (unsigned int i=0; i<sorted_ids.size();i++) {
 
                 // Insert the ID
-                FacebookId id = ids[i];
+                FacebookId id = sorted_ids[i];
                 for (unsigned int j=0; j<8; j++)
                     data[offset+j] = (unsigned char) (id.val >> (j*8));
-                offset+=8;                
-                // Insert the encrypted message key
-                getCipheredMessageKey(id, &data[offset]);
+                offset+=8;
+                // Note where the encrypted message key goes
+                std::map<FacebookId,unsigned int>::iterator it = first_slot.find( id );
+                if (it == first_slot.end()) {
+                    first_slot[id] = offset;
+                    encryptors.push_back( getEncryptor( id ) );
+                    outputs.push_back( &data[offset] );
+                }
+                else {
+                    copy_to.push_back( offset );
+                    copy_from.push_back( it->second );
+                }
                 offset+= key_len;
             }
             
+            // Encrypt the message key for every recipient in parallel
+            std::vector<byte> failed( encryptors.size(), 0 );
+            WrapKeyTask task( *this, encryptors, outputs, failed );
+            pool_.run( task, encryptors.size() );
+            for (unsigned int i=0; i<failed.size(); i++)
+                if (failed[i]) throw EncryptionException("Failed to encrypt the message key for a recipient.");
+            for (unsigned int i=0; i<copy_to.size(); i++)
+                for (unsigned int j=0; j<key_len; j++)
+                    data[copy_to[i]+j] = data[copy_from[i]+j];
         }
         
         //! Attempty to parse a crypto header - this will retrieve and set the message key and IV.
@@ -115,36 +231,52 @@ namespace efb {
             // Set length of output key (same as public key for RSA)
             unsigned int key_len = M;  
             
-            // Retrieve the number of recipients
-            unsigned int len = retrieveHeaderSize(data);
+            // Retrieve the number of recipients, and check they are all there
+            unsigned short tag = readLengthTag(data);
+            unsigned int len = tag & MAX_IDS;
+            if (data.size() < calculateHeaderSize(len))
+                throw DecryptionException("Header is truncated.");
             offset+=2;
             
             // Retrieve the IV
             iv_ =  Botan::InitializationVector( &data[offset], iv_.length() );
             offset+=iv_.length();
             
-            // Loop through till we find user's ID (if it exists)
-            for (unsigned int i=0; i<len; i++)
-            {
-                // Extract an ID
-                unsigned long long int id_int = 0;
-                for (unsigned int j=0; j<8; j++)
-                    id_int = id_int | (((unsigned long long int)data[offset+j]) << (j*8));
-                offset+=8;
-                // If we have our ID, extract messsage key
-                if (id_int == id_.val) {
-                    // We can decrypt, so do so
-                    std::string key_str((char*)&data[offset], key_len );
-                    key_ = Botan::SymmetricKey( decryptor_->decrypt( &data[offset], key_len ) );
-                    return;
+            // Find the user's (ID, key) pair if it exists - by binary search if the IDs are sorted, otherwise in turn
+            const unsigned int pair_len = 8 + key_len;
+            const byte* pairs = &data[offset];
+            const byte* found = NULL;
+            if (tag & SORTED_IDS) {
+                unsigned int lo = 0, hi = len;
+                while (lo < hi) {
+                    unsigned int mid = lo + (hi - lo) / 2;
+                    if (readId( pairs + mid*pair_len ) < id_.val) lo = mid + 1;
+                    else hi = mid;
                 }
-                offset+=key_len;
+                if (lo < len && readId( pairs + lo*pair_len ) == id_.val) found = pairs + lo*pair_len;
+            }
+            else {
+                for (unsigned int i=0; i<len && found == NULL; i++)
+                    if (readId( pairs + i*pair_len ) == id_.val) found = pairs + i*pair_len;
             }
+            if (found == NULL)
+                throw DecryptionException("ID not found - cannot decrypt this message.");
             
-            throw DecryptionException("ID not found - cannot decrypt this message.");
+            // We can decrypt, so extract the message key - unless this header has been seen before
+            if (decryptor_ == NULL)
+                throw DecryptionException("No private key loaded - cannot decrypt this message.");
+            std::vector<byte> wrapped( iv_.begin(), iv_.begin() + iv_.length() );
+            wrapped.insert( wrapped.end(), found + 8, found + 8 + key_len );
+            typename std::map<std::vector<byte>,Botan::SymmetricKey>::const_iterator it = key_cache_.find( wrapped );
+            if (it != key_cache_.end()) {
+                key_ = it->second;
+                return;
+            }
+            key_ = Botan::SymmetricKey( decryptor_->decrypt( found + 8, key_len ) );
+            cacheMessageKey( wrapped, key_ );
         }
         
-        //! Botan library attribute members
+        //! Botan library attribute members. Message keys are wrapped on worker threads, so Botan is initialised with locking.
         Botan::LibraryInitializer init_;
         Botan::AutoSeeded_RNG rng_;
         Botan::InitializationVector iv_;
@@ -152,22 +284,49 @@ namespace efb {
         Botan::SymmetricKey key_;
         Botan::RSA_PrivateKey private_key_;
         Botan::RSA_PublicKey public_key_;
-        // recipient public key dictionary
+        // recipient public key dictionary, with a ready-made encryptor for each key
         std::map<FacebookId,Botan::RSA_PublicKey> idkeymap_;
+        std::map<FacebookId,Botan::PK_Encryptor*> encryptors_;
         // user's Facebook ID
         FacebookId id_;
         // PK encryptor object
         Botan::PK_Decryptor* decryptor_;
+        // unwrapped message keys, indexed by IV and wrapped key, with the order they were added in
+        std::map<std::vector<byte>,Botan::SymmetricKey> key_cache_;
+        std::deque<std::vector<byte> > key_cache_order_;
+        // Thread pool for encrypting message keys, with a random number generator for each worker
+        const WorkerPool pool_;
+        std::vector<Botan::AutoSeeded_RNG*> worker_rngs_;
+        // cipher for the message being encrypted or decrypted a piece at a time, if any
+        CipherStream* stream_;
         
         public :
         
-            BotanRSACrypto()
+            BotanRSACrypto() :
+                init_( "thread_safe=true" ),
+                decryptor_( NULL ),
+                worker_rngs_( pool_.size() ),
+                stream_( NULL )
             {
+                for (unsigned int i=0; i<worker_rngs_.size(); i++)
+                    worker_rngs_[i] = new Botan::AutoSeeded_RNG();
+
                 // so we can work out their sizes properly...
                 generateNewIv();
                 generateNewMessageKey();
             }
             
+            ~BotanRSACrypto()
+            {
+                typename std::map<FacebookId,Botan::PK_Encryptor*>::iterator it;
+                for (it = encryptors_.begin(); it != encryptors_.end(); ++it)
+                    delete it->second;
+                delete decryptor_;
+                for (unsigned int i=0; i<worker_rngs_.size(); i++)
+                    delete worker_rngs_[i];
+                delete stream_;
+            }
+            
             unsigned int calculateHeaderSize( unsigned int numOfIds ) const
                 // Length tag + IV length + number of IDs x (ID length + key length)
                 {return sizeof(short) + iv_.length() + numOfIds*(sizeof(long long int) + M);}
@@ -184,18 +343,65 @@ namespace efb {
                 std::vector<byte>& data // with header-size offset before data bytes begin
             )
             {
+                // compress the message first, unless that wouldn't make it any smaller
+                unsigned int hs = calculateHeaderSize( ids.size() );
+                bool compressed = compressPayload( data, hs );
+
                 // note - this will change (randomise) the IV and message key
-                createCryptoHeader( ids, data );
+                createCryptoHeader( ids, data, compressed );
                 
                 // perform the encryption, skipping the first <header size> bytes
-                unsigned int hs = calculateHeaderSize( ids.size() ), ds = data.size(), ms = ds - hs;
+                unsigned int ds = data.size(), ms = ds - hs;
+                std::stringstream ss; ss << "AES-" << N*8 << "/CFB";
+                cipherInPlace(
+                    get_cipher(ss.str(), key_, iv_, Botan::ENCRYPTION), &data[hs], ms );
+            }
+
+            void beginMessage
+            (
+                std::vector<FacebookId>& ids,
+                std::vector<byte>& header,
+                bool compressed
+            )
+            {
+                // note - this will change (randomise) the IV and message key
+                header.resize( calculateHeaderSize( ids.size() ) );
+                createCryptoHeader( ids, header, compressed );
+                delete stream_;
+                stream_ = NULL;
+                std::stringstream ss; ss << "AES-" << N*8 << "/CFB";
+                stream_ = new CipherStream( get_cipher(ss.str(), key_, iv_, Botan::ENCRYPTION) );
+            }
+
+            void encryptMessagePart( const byte* data, unsigned int size, std::vector<byte>& out )
+            {
+                if (stream_ == NULL) throw EncryptionException("No message has been started.");
+                stream_->write( data, size, out );
+            }
+
+            bool beginDecryption( std::vector<byte>& header )
+            {
+                // note - as decryptMessage, this sets the IV and message key from the header, throwing if we can't decrypt it
+                parseCryptoHeader( header );
+                delete stream_;
+                stream_ = NULL;
                 std::stringstream ss; ss << "AES-" << N*8 << "/CFB";
-                Botan::Pipe encrypter(
-                    get_cipher(ss.str(), key_, iv_, Botan::ENCRYPTION));
-                encrypter.start_msg();
-                encrypter.write((Botan::byte*) &data[hs], ms ); 
-                encrypter.end_msg();
-                encrypter.read((Botan::byte*) &data[hs], ms );
+                stream_ = new CipherStream( get_cipher(ss.str(), key_, iv_, Botan::DECRYPTION) );
+                return (readLengthTag(header) & COMPRESSED) != 0;
+            }
+
+            void decryptMessagePart( const byte* data, unsigned int size, std::vector<byte>& out )
+            {
+                if (stream_ == NULL) throw DecryptionException("No message has been started.");
+                stream_->write( data, size, out );
+            }
+
+            void endMessage( std::vector<byte>& out )
+            {
+                if (stream_ == NULL) return;
+                stream_->finish( out );
+                delete stream_;
+                stream_ = NULL;
             }
             
             void decryptMessage( std::vector<byte>& data )
@@ -206,12 +412,12 @@ namespace efb {
                 // perform the decryption, skipping the first <header size> bytes
                 unsigned int hs = retrieveHeaderSize(data), ds = data.size(), ms = ds - hs;
                 std::stringstream ss; ss << "AES-" << N*8 << "/CFB";
-                Botan::Pipe decrypter(
-                    get_cipher(ss.str(), key_, iv_, Botan::DECRYPTION));
-                decrypter.start_msg();
-                decrypter.write((Botan::byte*) &data[hs], ms );  
-                decrypter.end_msg();
-                decrypter.read((Botan::byte*) &data[hs], ms );
+                cipherInPlace(
+                    get_cipher(ss.str(), key_, iv_, Botan::DECRYPTION), &data[hs], ms );
+
+                // undo any compression
+                if (readLengthTag(data) & COMPRESSED)
+                    decompressPayload( data, hs );
             }
             
             //! Generate a private/public key pair and save to disk.
@@ -252,11 +458,18 @@ namespace efb {
                 private_key_ = *dynamic_cast<Botan::RSA_PrivateKey*>(private_key_ptr);
                 public_key_ = *dynamic_cast<Botan::RSA_PublicKey*>(public_key_ptr);
                 
+                delete private_key_ptr;
+                delete public_key_ptr;
+                
                 // Add public key to key map so it can be used for encryption
-                idkeymap_[id_] = public_key_;
+                setRecipientKey( id_, public_key_ );
 
                 // Create the decryption object using our private key
-                decryptor_ = Botan::get_pk_decryptor(private_key_, "EME1(SHA-512)");                
+                delete decryptor_;
+                decryptor_ = new Botan::PK_Decryptor_EME(private_key_, "EME1(SHA-512)");
+                
+                // Keys unwrapped with any previous private key no longer apply
+                wipeCachedKeys();
             }
             
             //! Load potential recipients' public keys into memory.
@@ -270,15 +483,32 @@ namespace efb {
                 Botan::X509_PublicKey* key_ptr(
                     Botan::X509::load_key(key_filename) );
                 Botan::RSA_PublicKey key = *dynamic_cast<Botan::RSA_PublicKey*>(key_ptr);
+                delete key_ptr;
                 
-                // Save the pair in the id/key map.
-                idkeymap_[id] = key;
+                // Save the pair in the id/key map, ready for encryption.
+                setRecipientKey( id, key );
             }
             
             //! Set the Facebook ID for decryption
             void setUserId(const FacebookId& id) {
                 id_.val = id.val;
             }
+            
+            //! Drop (and zeroise) every cached message key.
+            void wipeCachedKeys()
+            {
+                key_cache_.clear();
+                key_cache_order_.clear();
+            }
+            
+            //! SHA-256 digest of a byte array, using a hash object of its own so workers can call it at the same time.
+            std::vector<byte> messageDigest( const byte* data, unsigned int size ) const
+            {
+                Botan::HashFunction* hash = Botan::get_hash("SHA-256");
+                Botan::SecureVector<byte> digest = hash->process( data, size );
+                delete hash;
+                return std::vector<byte>( digest.begin(), digest.end() );
+            }
     };
 }
 
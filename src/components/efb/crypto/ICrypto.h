@@ -19,6 +19,7 @@ namespace efb {
     class ICrypto
     {
         public :
+            virtual ~ICrypto() {}
             //! Returns the predicted header size so we can leave room before encryption.
             virtual unsigned int calculateHeaderSize( unsigned int numOfIds ) const = 0;
             //! Retrieves header of any stored data size so we can skip this after decryption.
@@ -29,6 +30,21 @@ namespace efb {
                 std::vector<FacebookId>& ids,
                 std::vector<byte>& data // with header-size offset before data bytes begin
             ) = 0;
+            //! Start a message which will be encrypted a piece at a time (see encryptMessagePart), writing its header (calculateHeaderSize bytes) into header. The payload is flagged as compressed or not, as encryptMessage would have decided.
+            virtual void beginMessage
+            (
+                std::vector<FacebookId>& ids,
+                std::vector<byte>& header,
+                bool compressed
+            ) = 0;
+            //! Encrypt the next piece of the message started by beginMessage, appending the ciphertext to out (which may lag the input).
+            virtual void encryptMessagePart( const byte* data, unsigned int size, std::vector<byte>& out ) = 0;
+            //! Start decrypting a message a piece at a time (see decryptMessagePart), from its header, which must be complete (retrieveHeaderSize bytes) but need not be followed by any of the payload. Returns whether the payload is compressed.
+            virtual bool beginDecryption( std::vector<byte>& header ) = 0;
+            //! Decrypt the next piece of the message started by beginDecryption, appending the plaintext to out (which may lag the input).
+            virtual void decryptMessagePart( const byte* data, unsigned int size, std::vector<byte>& out ) = 0;
+            //! End the message started by beginMessage or beginDecryption, appending any remaining output to out.
+            virtual void endMessage( std::vector<byte>& out ) = 0;
             //! Parses any data header and attempts to decrypt the data, leaving the header in place.
             virtual void decryptMessage( std::vector<byte>& data ) = 0;
             //! Generate and write a new private/public key pair to disk.
@@ -53,6 +69,10 @@ namespace efb {
             ) = 0;
             //! Set the Facebook ID for decryption
             virtual void setUserId(const FacebookId& id) = 0;
+            //! Wipe any message keys cached in memory. By default none are kept.
+            virtual void wipeCachedKeys() {}
+            //! Compute a collision resistant digest of a byte array, e.g. to recognise a ciphertext which has been seen before. Must be safe to call from several threads at once, and alongside the other methods, so it may not use any per-object state.
+            virtual std::vector<byte> messageDigest( const byte* data, unsigned int size ) const = 0;
     };
 }
 
@@ -0,0 +1,187 @@
+#ifndef EFB_PAYLOADCOMPRESSION_H
+#define EFB_PAYLOADCOMPRESSION_H
+
+// Standard library includes
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+// zlib compression library includes
+#include <zlib.h>
+
+// eFB Library sub-component includes
+#include "ICrypto.h"
+
+namespace efb {
+
+    //! Compressed payload layout and limits.
+    /**
+        A compressed payload is the original size (32-bit, little endian) followed by a zlib stream. Level 1 is used, since it gets most of the gain on text for a fraction of the time taken by higher levels. The size limit stops a forged header from making the reader allocate an arbitrary amount of memory.
+    */
+    enum { COMPRESSION_LEVEL = 1, COMPRESSED_SIZE_LEN = 4, MAX_DECOMPRESSED_SIZE = 64*1024*1024 };
+
+    //! Compress the payload which follows a header of head_size bytes, in place. Returns false, leaving the data untouched, if that wouldn't make it any smaller.
+    inline bool compressPayload( std::vector<byte>& data, unsigned int head_size )
+    {
+        unsigned int size = data.size() - head_size;
+        if (size == 0) return false;
+        uLongf bound = compressBound( size );
+        std::vector<byte> compressed( head_size + COMPRESSED_SIZE_LEN + bound );
+        if (compress2( &compressed[head_size + COMPRESSED_SIZE_LEN], &bound,
+                       &data[head_size], size, COMPRESSION_LEVEL ) != Z_OK)
+            return false;
+        if (COMPRESSED_SIZE_LEN + bound >= size) return false; // doesn't compress
+        for (unsigned int j=0; j<COMPRESSED_SIZE_LEN; j++)
+            compressed[head_size + j] = (byte) (size >> (j*8));
+        compressed.resize( head_size + COMPRESSED_SIZE_LEN + bound );
+        std::copy( data.begin(), data.begin() + head_size, compressed.begin() );
+        data.swap( compressed );
+        return true;
+    }
+
+    //! Decompress the payload which follows a header of head_size bytes, in place.
+    inline void decompressPayload( std::vector<byte>& data, unsigned int head_size )
+    {
+        if (data.size() < head_size + COMPRESSED_SIZE_LEN)
+            throw DecryptionException("Compressed payload is truncated.");
+        unsigned int size = 0;
+        for (unsigned int j=0; j<COMPRESSED_SIZE_LEN; j++)
+            size |= ((unsigned int) data[head_size + j]) << (j*8);
+        if (size > MAX_DECOMPRESSED_SIZE)
+            throw DecryptionException("Compressed payload is too large.");
+        std::vector<byte> decompressed( head_size + size );
+        uLongf decompressed_size = size;
+        if (size > 0 && (uncompress( &decompressed[head_size], &decompressed_size,
+                &data[head_size + COMPRESSED_SIZE_LEN], data.size() - head_size - COMPRESSED_SIZE_LEN ) != Z_OK
+            || decompressed_size != size))
+            throw DecryptionException("Compressed payload is corrupt.");
+        std::copy( data.begin(), data.begin() + head_size, decompressed.begin() );
+        data.swap( decompressed );
+    }
+
+    //! Compressor producing the payload layout of compressPayload from input supplied a piece at a time, so a large file need never be held in memory whole.
+    class PayloadCompressor
+    {
+        enum { OUTPUT_CHUNK = 16*1024 };
+        z_stream stream_;
+        const unsigned int size_;
+        bool started_;
+
+        // Not copyable
+        PayloadCompressor( const PayloadCompressor& );
+        PayloadCompressor& operator=( const PayloadCompressor& );
+
+        public :
+            //! Constructor, taking the total size of the input.
+            PayloadCompressor( unsigned int size ) :
+                size_( size ),
+                started_( false )
+            {
+                std::memset( &stream_, 0, sizeof(stream_) );
+                if (deflateInit( &stream_, COMPRESSION_LEVEL ) != Z_OK)
+                    throw EncryptionException("Failed to start compression.");
+            }
+
+            ~PayloadCompressor() { deflateEnd( &stream_ ); }
+
+            //! Compress the next piece of input, appending the output to out. The last piece must be flagged, to flush the stream.
+            void write( const byte* data, unsigned int size, std::vector<byte>& out, bool last )
+            {
+                if (!started_) {
+                    for (unsigned int j=0; j<COMPRESSED_SIZE_LEN; j++)
+                        out.push_back( (byte) (size_ >> (j*8)) );
+                    started_ = true;
+                }
+                stream_.next_in = const_cast<Bytef*>( data );
+                stream_.avail_in = size;
+                do {
+                    size_t old_size = out.size();
+                    out.resize( old_size + OUTPUT_CHUNK );
+                    stream_.next_out = &out[old_size];
+                    stream_.avail_out = OUTPUT_CHUNK;
+                    if (deflate( &stream_, last ? Z_FINISH : Z_NO_FLUSH ) == Z_STREAM_ERROR)
+                        throw EncryptionException("Compression failed.");
+                    out.resize( old_size + OUTPUT_CHUNK - stream_.avail_out );
+                } while (stream_.avail_out == 0);
+            }
+    };
+
+    //! Decompressor for the payload layout of compressPayload, supplied a piece at a time, so a large message need never be held in memory whole.
+    class PayloadDecompressor
+    {
+        enum { OUTPUT_CHUNK = 64*1024 };
+        z_stream stream_;
+        byte prefix_[COMPRESSED_SIZE_LEN];
+        unsigned int prefix_read_;
+        unsigned int size_;     // decompressed size, from the prefix
+        unsigned int written_;  // decompressed bytes so far
+        bool ended_;
+
+        // Not copyable
+        PayloadDecompressor( const PayloadDecompressor& );
+        PayloadDecompressor& operator=( const PayloadDecompressor& );
+
+        public :
+            PayloadDecompressor() :
+                prefix_read_( 0 ),
+                size_( 0 ),
+                written_( 0 ),
+                ended_( false )
+            {
+                std::memset( &stream_, 0, sizeof(stream_) );
+                if (inflateInit( &stream_ ) != Z_OK)
+                    throw DecryptionException("Failed to start decompression.");
+            }
+
+            ~PayloadDecompressor() { inflateEnd( &stream_ ); }
+
+            //! Decompress the next piece of the payload, appending the output to out.
+            void write( const byte* data, unsigned int size, std::vector<byte>& out )
+            {
+                // Read the size first, which may be split across pieces
+                while (prefix_read_ < COMPRESSED_SIZE_LEN && size > 0) {
+                    prefix_[prefix_read_++] = *data++;
+                    size--;
+                    if (prefix_read_ == COMPRESSED_SIZE_LEN) {
+                        for (unsigned int j=0; j<COMPRESSED_SIZE_LEN; j++)
+                            size_ |= ((unsigned int) prefix_[j]) << (j*8);
+                        if (size_ > MAX_DECOMPRESSED_SIZE)
+                            throw DecryptionException("Compressed payload is too large.");
+                    }
+                }
+                if (size == 0) return;
+                if (ended_) throw DecryptionException("Compressed payload is corrupt.");
+
+                stream_.next_in = const_cast<Bytef*>( data );
+                stream_.avail_in = size;
+                // Carry on while there is input left, or the output filled up and so more may be waiting
+                do {
+                    size_t old_size = out.size();
+                    out.resize( old_size + OUTPUT_CHUNK );
+                    stream_.next_out = &out[old_size];
+                    stream_.avail_out = OUTPUT_CHUNK;
+                    int status = inflate( &stream_, Z_NO_FLUSH );
+                    if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+                        throw DecryptionException("Compressed payload is corrupt.");
+                    unsigned int produced = OUTPUT_CHUNK - stream_.avail_out;
+                    out.resize( old_size + produced );
+                    written_ += produced;
+                    if (written_ > size_)
+                        throw DecryptionException("Compressed payload is corrupt.");
+                    ended_ = status == Z_STREAM_END;
+                    if (status == Z_BUF_ERROR && produced == 0) break;
+                } while (!ended_ && (stream_.avail_in > 0 || stream_.avail_out == 0));
+                if (stream_.avail_in > 0)
+                    throw DecryptionException("Compressed payload is corrupt.");
+            }
+
+            //! Check the payload was complete, throwing a DecryptionException if it wasn't.
+            void finish()
+            {
+                if (!ended_ || written_ != size_)
+                    throw DecryptionException("Compressed payload is corrupt.");
+            }
+    };
+}
+
+#endif //EFB_PAYLOADCOMPRESSION_H
@@ -0,0 +1,299 @@
+#ifndef EFB_GALOISKERNELS_H
+#define EFB_GALOISKERNELS_H
+
+// Shiffra Reed Solomon library includes
+#include "schifra/schifra_galois_field.hpp"
+#include "schifra/schifra_galois_field_polynomial.hpp"
+
+// Library sub-component includes
+#include "../Common.h"
+
+// Vectorised kernels are available for x86 with GCC-compatible compilers. Neither SSSE3 nor AVX2 is part of the x86-64 baseline, so both are compiled in alongside the scalar code and chosen at runtime.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+    #define EFB_GALOIS_SIMD 1
+    #include <immintrin.h>
+#endif
+
+namespace efb {
+
+    //! Split nibble table for multiplying by a constant c in GF(2^8), so that c*x = lo[x & 0x0f] ^ hi[x >> 4].
+    struct NibbleTable
+    {
+        byte lo[16];
+        byte hi[16];
+
+        //! Tabulate multiplication by c.
+        void set( const schifra::galois::field& field, schifra::galois::field_symbol c )
+        {
+            for (unsigned int x=0; x<16; x++) {
+                lo[x] = field.mul( c, x );
+                hi[x] = field.mul( c, x << 4 );
+            }
+        }
+
+        //! Multiply x by the constant.
+        byte mul( byte x ) const
+        {
+            return lo[x & 0x0f] ^ hi[x >> 4];
+        }
+    };
+
+    //! Tables for a systematic Reed Solomon encoder over GF(2^8), computing the parity symbols with a linear feedback shift register of up to 32 symbols.
+    /**
+        The register is kept highest order first (the first symbol out is the first FEC symbol). For each message symbol f = m ^ reg[0], the register shifts down by one symbol and f*g is added, where g holds the generator coefficients in the same order. Row n of lo/hi holds the register-wide product for a feedback nibble of n / (n << 4).
+    */
+    struct GaloisEncoderTables
+    {
+        enum { WIDTH = 32 };
+        byte lo[16][WIDTH];
+        byte hi[16][WIDTH];
+        unsigned int fec_length;
+    };
+
+    //! Tables for evaluating up to 32 Reed Solomon syndromes of a GF(2^8) codeword of up to 256 symbols.
+    /**
+        The codeword is padded at the front with zeros to 256 symbols and split into 16 lanes, lane j holding symbols j, j+16, j+32 and so on. Each lane is evaluated with Horner's rule at root^16, then the lanes are folded together (8 at a time with root^8, then root^4, root^2 and root) to give the syndrome. Every step multiplies all lanes by the same constant, so maps directly onto a byte shuffle.
+    */
+    struct GaloisSyndromeTables
+    {
+        enum { MAX_ROOTS = 32, STEPS = 5 };
+        //! Multiplication by root^16, root^8, root^4, root^2 and root for each root.
+        NibbleTable powers[MAX_ROOTS][STEPS];
+        unsigned int num_roots;
+    };
+
+#ifdef EFB_GALOIS_SIMD
+    #pragma GCC push_options
+    #pragma GCC target("ssse3")
+    //! SSSE3 GF(2^8) kernels. Only called when the CPU supports SSSE3.
+    namespace galois_ssse3 {
+
+        //! Multiply 16 symbols by the constant tabulated in t.
+        static inline __m128i mul( __m128i x, const NibbleTable& t )
+        {
+            const __m128i mask = _mm_set1_epi8( 0x0f );
+            __m128i lo = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*) t.lo ), _mm_and_si128( x, mask ) );
+            __m128i hi = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*) t.hi ), _mm_and_si128( _mm_srli_epi16( x, 4 ), mask ) );
+            return _mm_xor_si128( lo, hi );
+        }
+
+        static void encode( const GaloisEncoderTables& t, const byte* message, unsigned int length, byte* fec )
+        {
+            __m128i r0 = _mm_setzero_si128(), r1 = _mm_setzero_si128();
+            for (unsigned int i=0; i<length; i++) {
+                unsigned int f = (message[i] ^ _mm_cvtsi128_si32( r0 )) & 0xff;
+                __m128i s0 = _mm_alignr_epi8( r1, r0, 1 );
+                __m128i s1 = _mm_srli_si128( r1, 1 );
+                r0 = _mm_xor_si128( s0, _mm_xor_si128(
+                    _mm_loadu_si128( (const __m128i*) &t.lo[f & 0x0f][0] ),
+                    _mm_loadu_si128( (const __m128i*) &t.hi[f >> 4][0] ) ) );
+                r1 = _mm_xor_si128( s1, _mm_xor_si128(
+                    _mm_loadu_si128( (const __m128i*) &t.lo[f & 0x0f][16] ),
+                    _mm_loadu_si128( (const __m128i*) &t.hi[f >> 4][16] ) ) );
+            }
+            byte reg[GaloisEncoderTables::WIDTH];
+            _mm_storeu_si128( (__m128i*) reg, r0 );
+            _mm_storeu_si128( (__m128i*) (reg + 16), r1 );
+            for (unsigned int i=0; i<t.fec_length; i++) fec[i] = reg[i];
+        }
+
+        static byte syndrome( const NibbleTable* powers, const byte* padded )
+        {
+            __m128i acc = _mm_setzero_si128();
+            for (unsigned int q=0; q<16; q++)
+                acc = _mm_xor_si128( mul( acc, powers[0] ), _mm_loadu_si128( (const __m128i*) (padded + 16*q) ) );
+            acc = _mm_xor_si128( mul( acc, powers[1] ), _mm_srli_si128( acc, 8 ) );
+            acc = _mm_xor_si128( mul( acc, powers[2] ), _mm_srli_si128( acc, 4 ) );
+            acc = _mm_xor_si128( mul( acc, powers[3] ), _mm_srli_si128( acc, 2 ) );
+            acc = _mm_xor_si128( mul( acc, powers[4] ), _mm_srli_si128( acc, 1 ) );
+            return (byte) _mm_cvtsi128_si32( acc );
+        }
+
+        static unsigned int syndromes( const GaloisSyndromeTables& t, const byte* padded, byte* syndrome )
+        {
+            unsigned int flag = 0;
+            for (unsigned int r=0; r<t.num_roots; r++)
+                flag |= syndrome[r] = galois_ssse3::syndrome( t.powers[r], padded );
+            return flag;
+        }
+
+    }
+    #pragma GCC pop_options
+
+    #pragma GCC push_options
+    #pragma GCC target("avx2")
+    //! AVX2 GF(2^8) kernels, evaluating two syndromes at once (one per 128-bit lane). Only called when the CPU supports AVX2.
+    namespace galois_avx2 {
+
+        //! Multiply 16 symbols in each lane by the constants tabulated in a (low lane) and b (high lane).
+        static inline __m256i mul( __m256i x, const NibbleTable& a, const NibbleTable& b )
+        {
+            const __m256i mask = _mm256_set1_epi8( 0x0f );
+            __m256i lo_table = _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_loadu_si128( (const __m128i*) a.lo ) ), _mm_loadu_si128( (const __m128i*) b.lo ), 1 );
+            __m256i hi_table = _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_loadu_si128( (const __m128i*) a.hi ) ), _mm_loadu_si128( (const __m128i*) b.hi ), 1 );
+            __m256i lo = _mm256_shuffle_epi8( lo_table, _mm256_and_si256( x, mask ) );
+            __m256i hi = _mm256_shuffle_epi8( hi_table, _mm256_and_si256( _mm256_srli_epi16( x, 4 ), mask ) );
+            return _mm256_xor_si256( lo, hi );
+        }
+
+        static void encode( const GaloisEncoderTables& t, const byte* message, unsigned int length, byte* fec )
+        {
+            __m256i r = _mm256_setzero_si256();
+            for (unsigned int i=0; i<length; i++) {
+                unsigned int f = (message[i] ^ _mm_cvtsi128_si32( _mm256_castsi256_si128( r ) )) & 0xff;
+                // Shift the whole register down one symbol, carrying across the 128-bit lanes
+                __m256i s = _mm256_alignr_epi8( _mm256_permute2x128_si256( r, r, 0x81 ), r, 1 );
+                r = _mm256_xor_si256( s, _mm256_xor_si256(
+                    _mm256_loadu_si256( (const __m256i*) &t.lo[f & 0x0f][0] ),
+                    _mm256_loadu_si256( (const __m256i*) &t.hi[f >> 4][0] ) ) );
+            }
+            byte reg[GaloisEncoderTables::WIDTH];
+            _mm256_storeu_si256( (__m256i*) reg, r );
+            for (unsigned int i=0; i<t.fec_length; i++) fec[i] = reg[i];
+        }
+
+        static unsigned int syndromes( const GaloisSyndromeTables& t, const byte* padded, byte* syndrome )
+        {
+            unsigned int flag = 0, r = 0;
+            for (; r+2 <= t.num_roots; r+=2) {
+                const NibbleTable* a = t.powers[r];
+                const NibbleTable* b = t.powers[r+1];
+                __m256i acc = _mm256_setzero_si256();
+                for (unsigned int q=0; q<16; q++)
+                    acc = _mm256_xor_si256( mul( acc, a[0], b[0] ),
+                        _mm256_broadcastsi128_si256( _mm_loadu_si128( (const __m128i*) (padded + 16*q) ) ) );
+                acc = _mm256_xor_si256( mul( acc, a[1], b[1] ), _mm256_srli_si256( acc, 8 ) );
+                acc = _mm256_xor_si256( mul( acc, a[2], b[2] ), _mm256_srli_si256( acc, 4 ) );
+                acc = _mm256_xor_si256( mul( acc, a[3], b[3] ), _mm256_srli_si256( acc, 2 ) );
+                acc = _mm256_xor_si256( mul( acc, a[4], b[4] ), _mm256_srli_si256( acc, 1 ) );
+                flag |= syndrome[r] = (byte) _mm_cvtsi128_si32( _mm256_castsi256_si128( acc ) );
+                flag |= syndrome[r+1] = (byte) _mm_cvtsi128_si32( _mm256_extracti128_si256( acc, 1 ) );
+            }
+            // Odd one out
+            if (r < t.num_roots)
+                flag |= syndrome[r] = galois_ssse3::syndrome( t.powers[r], padded );
+            return flag;
+        }
+
+    }
+    #pragma GCC pop_options
+#endif
+
+    //! GF(2^8) Reed Solomon kernels with the best implementation chosen at runtime.
+    /**
+        These replace the polynomial division in schifra's encoder and the polynomial evaluation in its decoder's syndrome computation for 8-bit fields. All paths produce identical output to each other and to schifra.
+    */
+    struct GaloisKernels
+    {
+        //! Available kernel implementations.
+        enum Path { SCALAR, SSSE3, AVX2 };
+
+        //! Check whether a kernel can be used on this machine.
+        static bool supported( Path path )
+        {
+            switch (path) {
+                case SCALAR : return true;
+#ifdef EFB_GALOIS_SIMD
+                case SSSE3 : {
+                    static const bool ssse3 = __builtin_cpu_supports("ssse3");
+                    return ssse3;
+                }
+                case AVX2 : {
+                    static const bool avx2 = __builtin_cpu_supports("avx2");
+                    return avx2;
+                }
+#endif
+                default : return false;
+            }
+        }
+
+        //! Get the widest kernel supported on this machine.
+        static Path best()
+        {
+            if (supported( AVX2 )) return AVX2;
+            if (supported( SSSE3 )) return SSSE3;
+            return SCALAR;
+        }
+
+        //! Check whether the kernels can be used for a code over the given field with fec_length parity symbols.
+        static bool applicable( const schifra::galois::field& field, unsigned int fec_length )
+        {
+            return field.pwr() == 8
+                && fec_length <= GaloisEncoderTables::WIDTH
+                && fec_length <= GaloisSyndromeTables::MAX_ROOTS;
+        }
+
+        //! Tabulate the encoder for a monic generator polynomial of degree fec_length. Returns false if the generator isn't monic.
+        static bool init( GaloisEncoderTables& t, const schifra::galois::field& field, const schifra::galois::field_polynomial& generator, unsigned int fec_length )
+        {
+            t.fec_length = fec_length;
+            if (generator.deg() != (int) fec_length || generator[fec_length].poly() != 1) return false;
+            for (unsigned int n=0; n<16; n++) {
+                for (unsigned int i=0; i<GaloisEncoderTables::WIDTH; i++) {
+                    schifra::galois::field_symbol g = (i < fec_length) ? generator[fec_length-1-i].poly() : 0;
+                    t.lo[n][i] = field.mul( g, n );
+                    t.hi[n][i] = field.mul( g, n << 4 );
+                }
+            }
+            return true;
+        }
+
+        //! Tabulate the syndrome evaluation at roots alpha^first_root_index, alpha^(first_root_index+1) and so on.
+        static void init( GaloisSyndromeTables& t, const schifra::galois::field& field, unsigned int first_root_index, unsigned int num_roots )
+        {
+            t.num_roots = num_roots;
+            for (unsigned int r=0; r<num_roots; r++) {
+                schifra::galois::field_symbol root = field.alpha( first_root_index + r );
+                schifra::galois::field_symbol power = root;
+                for (int step=GaloisSyndromeTables::STEPS-1; step>=0; step--) {
+                    t.powers[r][step].set( field, power );
+                    power = field.mul( power, power );
+                }
+            }
+        }
+
+        //! Compute the parity symbols for a message, written to fec.
+        static void encode( const GaloisEncoderTables& t, const byte* message, unsigned int length, byte* fec, Path path = best() )
+        {
+#ifdef EFB_GALOIS_SIMD
+            if (path == AVX2) return galois_avx2::encode( t, message, length, fec );
+            if (path == SSSE3) return galois_ssse3::encode( t, message, length, fec );
+#endif
+            byte reg[GaloisEncoderTables::WIDTH+1] = { 0 };
+            for (unsigned int i=0; i<length; i++) {
+                unsigned int f = message[i] ^ reg[0];
+                for (unsigned int k=0; k<GaloisEncoderTables::WIDTH; k++)
+                    reg[k] = reg[k+1] ^ t.lo[f & 0x0f][k] ^ t.hi[f >> 4][k];
+            }
+            for (unsigned int i=0; i<t.fec_length; i++) fec[i] = reg[i];
+        }
+
+        //! Evaluate the syndromes of a codeword of length symbols (at most 256), highest order first. Returns non-zero if any syndrome is non-zero.
+        static unsigned int syndromes( const GaloisSyndromeTables& t, const byte* codeword, unsigned int length, byte* syndrome, Path path = best() )
+        {
+            byte padded[256] = { 0 };
+            for (unsigned int i=0; i<length; i++) padded[256-length+i] = codeword[i];
+#ifdef EFB_GALOIS_SIMD
+            if (path == AVX2) return galois_avx2::syndromes( t, padded, syndrome );
+            if (path == SSSE3) return galois_ssse3::syndromes( t, padded, syndrome );
+#endif
+            unsigned int flag = 0;
+            for (unsigned int r=0; r<t.num_roots; r++) {
+                const NibbleTable* powers = t.powers[r];
+                byte acc[16] = { 0 };
+                for (unsigned int q=0; q<16; q++)
+                    for (unsigned int j=0; j<16; j++)
+                        acc[j] = powers[0].mul( acc[j] ) ^ padded[16*q + j];
+                for (unsigned int step=1, width=8; step<GaloisSyndromeTables::STEPS; step++, width/=2)
+                    for (unsigned int j=0; j<width; j++)
+                        acc[j] = powers[step].mul( acc[j] ) ^ acc[j+width];
+                flag |= syndrome[r] = acc[0];
+            }
+            return flag;
+        }
+    };
+
+}
+
+#endif //EFB_GALOISKERNELS_H
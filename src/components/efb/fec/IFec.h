@@ -19,6 +19,7 @@ namespace efb {
     class IFec
     {
         public :
+            virtual ~IFec() {}
             //! Calculate the overall size after adding error correction.
             virtual unsigned int codeLength( unsigned int data_length) const = 0;
             //! Calculate the data size before adding error correction.
@@ -27,6 +28,11 @@ namespace efb {
             virtual void encode( std::vector<byte>& data) const =0;
             //! Decode (correct) data in place.
             virtual void decode( std::vector<byte>& data) const =0;
+            //! Decode (correct) data in place, given a reliability score for each byte from 0 (a guess) to 255 (certain). By default the scores are ignored.
+            virtual void decodeWithReliability( std::vector<byte>& data, const std::vector<byte>& reliability ) const
+            {
+                decode( data );
+            }
     };
 
 }
@@ -1,6 +1,11 @@
 #ifndef EFB_SCHIFRAFEC_H
 #define EFB_SCHIFRAFEC_H
 
+// Standard libary includes
+#include <cstring>
+#include <algorithm>
+#include <utility>
+
 // Shiffra Reed Solomon library includes
 #include "schifra/schifra_galois_field.hpp"
 #include "schifra/schifra_galois_field_polynomial.hpp"
@@ -12,10 +17,19 @@
 
 // Library sub-component includes
 #include "IFec.h"
+#include "GaloisKernels.h"
+#include "../Threading.h"
 
 namespace efb {
     
     //! Schifra Reed Solomon error correction library template class where code rate is (N,M)
+    /**
+        Blocks are encoded and decoded straight from the contiguous data buffer and split across a pool of worker threads, each with its own block and syndrome workspace. When the FEC object is itself used from a pool worker (one per worker, in the batch and image set paths), its blocks are coded serially on that worker instead. Decoding first evaluates the syndromes of each block using precomputed log and antilog tables, so only blocks which actually contain errors are passed to the Schifra decoder.
+
+        For 8-bit fields (with up to 32 FEC symbols) the parity symbols and syndromes are instead computed by the vectorised GaloisKernels, which give identical results to Schifra's polynomial division and evaluation.
+
+        Given a reliability score for each byte, blocks which can't be corrected for errors alone are retried with their least reliable bytes passed to the Schifra decoder as erasures, a quarter of the FEC length more each time. Each erasure costs half as much of the code's capacity as an error, so more damage can be corrected, while a quarter of the FEC symbols are always kept spare to detect miscorrections.
+    */
     template <int N, int M>
     class SchifraFec : public IFec
     {        
@@ -52,8 +66,27 @@ namespace efb {
                 ),
                 // Instantiate Encoder and Decoder (Codec)
                 encoder_(field_,generator_polynomial_),
-                decoder_(field_,generator_polynommial_index_)
-            {}
+                decoder_(field_,generator_polynommial_index_),
+                log_table_(field_.size()+1),
+                exp_table_(3*field_.size(), 0),
+                power_table_(N*(N-M))
+            {
+                // Tabulate logs (with zero mapped clear of the others, so its products all land on zero) and antilogs...
+                const unsigned int size = field_.size();
+                log_table_[0] = 2*size;
+                for (unsigned int s=1; s<=size; s++) log_table_[s] = field_.index( s );
+                for (unsigned int k=0; k<2*size; k++) exp_table_[k] = field_.alpha( k % size );
+                // ...and the log of each generator root raised to the power of each symbol position, as used to evaluate the syndromes
+                for (unsigned int r=0; r<N-M; r++) {
+                    unsigned int root = field_.index( field_.alpha( generator_polynommial_index_ + r ) );
+                    for (unsigned int i=0; i<N; i++)
+                        power_table_[r*N + i] = (root * (N-1-i)) % size;
+                }
+                // Use the GF(2^8) kernels where the code allows
+                galois_ = GaloisKernels::applicable( field_, N-M )
+                    && GaloisKernels::init( galois_encoder_, field_, generator_polynomial_, N-M );
+                if (galois_) GaloisKernels::init( galois_syndromes_, field_, generator_polynommial_index_, N-M );
+            }
             
             //! Calculate the overall size after adding error correction.
             unsigned int codeLength( unsigned int data_length) const
@@ -72,41 +105,69 @@ namespace efb {
             //! Encode data by appending error correction codes.
             void encode( std::vector<byte>& data) const
             {
-                // Cycle through each block, appending FEC code at the back of the array. Note that any final partial block will be padded automatically by this process, provided enough blocks exist.
-                unsigned int num_blocks = (data.size()/data_width_) + (data.size()%data_width_==0?0:1);
+                // FEC codes are appended at the back of the array, in block order. Note that any final partial block will be padded automatically by this process (with the FEC codes of the first blocks), provided enough blocks exist.
+                unsigned int data_size = data.size();
+                unsigned int num_blocks = (data_size/data_width_) + (data_size%data_width_==0?0:1);
                 if ( num_blocks*fec_width_ < data_width_ )
                     throw FecEncodeException(
                     "Not enough data blocks to pad (possible) partial last block.");
+                data.resize( data_size + num_blocks*fec_width_ );
                 
-                for (unsigned int i=0; i<num_blocks*data_width_;i+=data_width_) {
-                    std::string message((char*) &data[i], data_width_);
-                    std::string fec(fec_width_, static_cast<byte>(0x00));
-                    encodeBlock(message, fec);   
-                    for (unsigned int j=0;j<fec_width_;j++) data.push_back( fec[j] );
-                }            
+                // Whole blocks are independent, so encode them in parallel...
+                unsigned int whole_blocks = data_size / data_width_;
+                std::vector<byte> failed( num_blocks, 0 );
+                CodecTask task( *this, &data[0], data_size, false, failed );
+                pool_.run( task, whole_blocks );
+                
+                // ...but a partial block depends on the codes written above
+                if (whole_blocks < num_blocks)
+                    task.run( whole_blocks, 0 );
+                
+                for (unsigned int b=0; b<num_blocks; b++)
+                    if (failed[b])
+                        throw FecEncodeException("Error - Critical encoding failure!");
             }
             
             //! Decode (i.e. correct) data in place.
             void decode( std::vector<byte>& data) const
             {
-                // We decode backwards since the last block may contain encoded FEC codes for the initial blocks.
-                unsigned int num_blocks = (data.size()/code_width_) + (data.size()%code_width_==0?0:1);
-                
-                for (int i=(num_blocks-1)*data_width_; i>=0; i-=data_width_) {
-                    std::string message((char*) &data[i], data_width_);
-                    std::string fec((char*) &data[data.size()-fec_width_], fec_width_ );
-                    try{decodeBlock(message,fec);}
-                    catch (FecDecodeException &e) {
-                        std::cout << "block didn't decode " << i/data_width_ << std::endl;
-                    }
-                    //remove used fec
-                    for (unsigned int j=0;j<fec_width_;j++) data.pop_back();
-                    //write back corrected data
-                    for (unsigned int j=0;j<data_width_;j++) data[i+j] = message[j];
-                }   
+                decodeBlocks( data, NULL );
+            }
+            
+            //! Decode (i.e. correct) data in place, treating the least reliable bytes of each block as erasures.
+            void decodeWithReliability( std::vector<byte>& data, const std::vector<byte>& reliability ) const
+            {
+                if (reliability.size() != data.size())
+                    throw FecDecodeException("Reliability scores don't match the data.");
+                decodeBlocks( data, reliability.empty() ? NULL : &reliability[0] );
             }
         
         private :
+            //! Bytes scoring below this reliability are candidate erasures.
+            enum { ERASURE_THRESHOLD = 64 };
+            
+            //! Decode data in place, with optional reliability scores laid out in the same way as the data.
+            void decodeBlocks( std::vector<byte>& data, const byte* reliability ) const
+            {
+                // FEC codes for block b lie (num_blocks - b) codes from the end of the array.
+                unsigned int num_blocks = (data.size()/code_width_) + (data.size()%code_width_==0?0:1);
+                if (num_blocks == 0) return;
+                if (data.size() < num_blocks*data_width_ || data.size() < num_blocks*fec_width_)
+                    throw FecDecodeException("Not enough data to decode.");
+                unsigned int data_size = data.size() - num_blocks*fec_width_;
+                std::vector<byte> failed( num_blocks, 0 );
+                CodecTask task( *this, &data[0], data_size, true, failed, reliability );
+                
+                // We decode the last block first since, if partial, it contains FEC codes for the initial blocks. The rest are independent, so decode them in parallel.
+                task.run( num_blocks-1, 0 );
+                pool_.run( task, num_blocks-1 );
+                for (int b=num_blocks-1; b>=0; b--)
+                    if (failed[b]) std::cout << "block didn't decode " << b << std::endl;
+                
+                // Remove the FEC codes
+                data.resize( data_size );
+            }
+            
             // Finite Field Parameters
             const std::size_t field_descriptor_;
             const std::size_t generator_polynommial_index_;
@@ -123,33 +184,162 @@ namespace efb {
             schifra::reed_solomon::encoder<N,N-M> encoder_;
             schifra::reed_solomon::decoder<N,N-M> decoder_;
         
-            //! Generate FEC code from a message   
-            void encodeBlock(
-                std::string & message,
-                std::string	& fec
-            ) const
+            // Thread pool and tables for the block codec
+            const WorkerPool pool_;
+            std::vector<unsigned short> log_table_;
+            std::vector<byte> exp_table_;
+            std::vector<unsigned short> power_table_;
+            // Vectorised kernel tables, used if galois_ is set
+            bool galois_;
+            GaloisEncoderTables galois_encoder_;
+            GaloisSyndromeTables galois_syndromes_;
+            
+            //! Per-worker codec state, allocated once per call rather than per block.
+            struct Workspace
             {
-                // Instantiate RS Block For Codec
                 schifra::reed_solomon::block<N,N-M> block;
+                schifra::reed_solomon::erasure_locations_t erasures;
+                unsigned short logs[N];
+                byte syndrome[N-M];
+                byte codeword[N];
+                byte corrected[N];
+                std::vector< std::pair<byte, std::size_t> > suspects;
+            };
+            
+            //! Task which encodes or decodes a single block of a contiguous buffer.
+            class CodecTask : public IParallelTask
+            {
+                const SchifraFec& fec_;
+                byte* data_;
+                const unsigned int data_size_;
+                const bool decode_;
+                std::vector<byte>& failed_;
+                const byte* reliability_;
+                std::vector<Workspace> workspaces_;
+                
+                public :
+                    CodecTask
+                    (
+                        const SchifraFec& fec,
+                        byte* data,
+                        unsigned int data_size,
+                        bool decode,
+                        std::vector<byte>& failed,
+                        const byte* reliability = NULL
+                    ) :
+                        fec_( fec ),
+                        data_( data ),
+                        data_size_( data_size ),
+                        decode_( decode ),
+                        failed_( failed ),
+                        reliability_( reliability ),
+                        workspaces_( fec.pool_.available() )
+                    {}
+                    
+                    void run( unsigned int item, unsigned int worker )
+                    {
+                        byte* message = data_ + item*fec_.data_width_;
+                        byte* fec = data_ + data_size_ + item*fec_.fec_width_;
+                        Workspace& ws = workspaces_[worker];
+                        const byte* reliability = reliability_ ? reliability_ + (message - data_) : NULL;
+                        const byte* fec_reliability = reliability_ ? reliability_ + (fec - data_) : NULL;
+                        bool ok = decode_ ?
+                            fec_.decodeBlock( message, fec, ws, reliability, fec_reliability ) :
+                            fec_.encodeBlock( message, fec, ws );
+                        if (!ok) failed_[item] = 1;
+                    }
+            };
+            
+            //! Generate FEC code from a message.
+            bool encodeBlock( const byte* message, byte* fec, Workspace& ws ) const
+            {
+                if (galois_) {
+                    GaloisKernels::encode( galois_encoder_, message, M, fec );
+                    return true;
+                }
+                for (unsigned int i=0; i<data_width_; i++)
+                    ws.block.data[i] = message[i] & field_.mask();
                 // Transform message into Reed-Solomon encoded codeword
-                if (!encoder_.encode(message,block))
-                    throw FecEncodeException("Error - Critical encoding failure!");
-                block.fec_to_string(fec);
+                if (!encoder_.encode( ws.block )) return false;
+                for (unsigned int i=0; i<fec_width_; i++)
+                    fec[i] = (byte) ws.block.fec(i);
+                return true;
             }
             
-            //! Try and fix any errors in a block-size message using FEC code
-            void decodeBlock(
-                std::string & message,
-                std::string	& fec
-            ) const
+            //! Evaluate the syndromes of a block as sums of (symbol x root^position), working in the log domain so every term is independent (or with the GF(2^8) kernels). Returns true if they are all zero (no errors).
+            bool checkSyndromes( const byte* message, const byte* fec, Workspace& ws ) const
             {
-                // Instantiate RS Block For Codec
-                schifra::reed_solomon::block<N,N-M> block(message, fec);
-    
+                if (galois_) {
+                    std::memcpy( ws.codeword, message, M );
+                    std::memcpy( ws.codeword + M, fec, N-M );
+                    return GaloisKernels::syndromes( galois_syndromes_, ws.codeword, N, ws.syndrome ) == 0;
+                }
+                const unsigned int mask = field_.mask();
+                const unsigned short* log_table = &log_table_[0];
+                for (unsigned int i=0; i<M; i++) ws.logs[i] = log_table[ message[i] & mask ];
+                for (unsigned int i=0; i<N-M; i++) ws.logs[M+i] = log_table[ fec[i] & mask ];
+                
+                const byte* exp_table = &exp_table_[0];
+                const unsigned short* powers = &power_table_[0];
+                unsigned int error_flag = 0;
+                for (unsigned int r=0; r<N-M; r++, powers+=N) {
+                    unsigned int s = 0;
+                    for (unsigned int i=0; i<N; i++)
+                        s ^= exp_table[ ws.logs[i] + powers[i] ];
+                    ws.syndrome[r] = s;
+                    error_flag |= s;
+                }
+                return error_flag == 0;
+            }
+            
+            //! Rank the symbols of a block scoring below ERASURE_THRESHOLD, least reliable first.
+            void findSuspects( const byte* reliability, const byte* fec_reliability, Workspace& ws ) const
+            {
+                ws.suspects.clear();
+                for (unsigned int i=0; i<M; i++)
+                    if (reliability[i] < ERASURE_THRESHOLD) ws.suspects.push_back( std::make_pair( reliability[i], (std::size_t) i ) );
+                for (unsigned int i=0; i<N-M; i++)
+                    if (fec_reliability[i] < ERASURE_THRESHOLD) ws.suspects.push_back( std::make_pair( fec_reliability[i], (std::size_t) (M+i) ) );
+                std::sort( ws.suspects.begin(), ws.suspects.end() );
+            }
+            
+            //! Run the Schifra decoder on a block with the current erasures, writing the message back if it succeeds.
+            /**
+                Schifra doesn't check that the error locator has as many roots as its degree, so a block with more damage than the code can correct is sometimes "corrected" to something which isn't a codeword - far more often when many of its symbols are erased. The result is only accepted if its syndromes are all zero.
+            */
+            bool correctBlock( byte* message, const byte* fec, Workspace& ws, const schifra::galois::field_polynomial& syndrome ) const
+            {
+                for (unsigned int i=0; i<data_width_; i++) ws.block.data[i] = message[i];
+                for (unsigned int i=0; i<fec_width_; i++) ws.block.fec(i) = fec[i];
+                if (!decoder_.decode( ws.block, ws.erasures, syndrome )) return false;
+                for (unsigned int i=0; i<N; i++) ws.corrected[i] = (byte) ws.block.data[i];
+                if (!checkSyndromes( ws.corrected, ws.corrected + M, ws )) return false;
+                std::memcpy( message, ws.corrected, data_width_ );
+                return true;
+            }
+            
+            //! Try and fix any errors in a block-size message using FEC code, falling back on treating unreliable symbols as erasures if reliability scores are given. The message is left untouched if it can't be corrected.
+            bool decodeBlock( byte* message, const byte* fec, Workspace& ws, const byte* reliability = NULL, const byte* fec_reliability = NULL ) const
+            {
+                // Leave the block alone if it has no errors
+                if (checkSyndromes( message, fec, ws )) return true;
+                
                 // Try and fix any errors in the message
-                if (!decoder_.decode(block))
-                    throw FecDecodeException("Error - Critical decoding failure!");
-                block.data_to_string(message);
+                schifra::galois::field_polynomial syndrome( field_, N-M-1 );
+                for (unsigned int r=0; r<N-M; r++) syndrome[r] = ws.syndrome[r];
+                ws.erasures.clear();
+                if (correctBlock( message, fec, ws, syndrome )) return true;
+                if (!reliability) return false;
+                
+                // Try again, erasing more of the least reliable symbols each time
+                findSuspects( reliability, fec_reliability, ws );
+                const std::size_t step = (N-M+3) / 4;
+                for (std::size_t count=step; count<=3*(N-M)/4 && count-step<ws.suspects.size(); count+=step) {
+                    ws.erasures.clear();
+                    for (std::size_t k=0; k<count && k<ws.suspects.size(); k++) ws.erasures.push_back( ws.suspects[k].second );
+                    if (correctBlock( message, fec, ws, syndrome )) return true;
+                }
+                return false;
             }
     };
 
@@ -87,6 +87,35 @@ namespace schifra
                return true;
             }
 
+            return correct(rsblock,erasure_list,syndrome);
+         }
+
+         /*
+            Decode using syndromes which the caller has already
+            evaluated (and found to be non-zero), as given by
+            compute_syndrome.
+         */
+         bool decode(block_type& rsblock,
+                     const erasure_locations_t& erasure_list,
+                     const galois::field_polynomial& syndrome) const
+         {
+            if ((!decoder_valid_) || (erasure_list.size() > fec_length))
+            {
+               rsblock.errors_detected  = 0;
+               rsblock.errors_corrected = 0;
+               rsblock.unrecoverable    = true;
+               return false;
+            }
+
+            return correct(rsblock,erasure_list,syndrome);
+         }
+
+      private:
+
+         bool correct(block_type& rsblock,
+                      const erasure_locations_t& erasure_list,
+                      const galois::field_polynomial& syndrome) const
+         {
             erasure_locations_t erasure_locations;
             prepare_erasure_list(erasure_locations,erasure_list);
 
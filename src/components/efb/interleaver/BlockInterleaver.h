@@ -0,0 +1,66 @@
+#ifndef EFB_BLOCKINTERLEAVER_H
+#define EFB_BLOCKINTERLEAVER_H
+
+// Library sub-component includes
+#include "IInterleaver.h"
+
+namespace efb {
+    
+    //! Row-column block interleaver.
+    /**
+        Data is written into a matrix a row of columns_ bytes at a time and read out a column at a time, i.e. transposed. With columns_ set to the FEC data block size, each message block lies along one row, so neighbouring bytes in the image come from different codewords (the FEC codes, which follow the messages, are spread in the same way). Any bytes beyond the last whole row are left where they are.
+        
+        The transpose works through the matrix in square tiles, so both the rows being read and the columns being written stay in cache.
+    */
+    class BlockInterleaver : public IInterleaver
+    {
+        //! Number of columns in the matrix.
+        const unsigned int columns_;
+        
+        //! Tile size for the transpose.
+        enum { TILE = 32 };
+        
+        //! Transpose the rows x cols matrix at in, writing it to out.
+        static void transpose( const byte* in, byte* out, unsigned int rows, unsigned int cols )
+        {
+            for (unsigned int r0=0; r0<rows; r0+=TILE) {
+                unsigned int r1 = (r0+TILE < rows) ? r0+TILE : rows;
+                for (unsigned int c0=0; c0<cols; c0+=TILE) {
+                    unsigned int c1 = (c0+TILE < cols) ? c0+TILE : cols;
+                    for (unsigned int r=r0; r<r1; r++)
+                        for (unsigned int c=c0; c<c1; c++)
+                            out[c*rows + r] = in[r*cols + c];
+                }
+            }
+        }
+        
+        //! Transpose the whole rows of data in place, treating them as a rows x cols matrix.
+        static void transpose( std::vector<byte>& data, unsigned int rows, unsigned int cols )
+        {
+            if (rows < 2 || cols < 2) return;
+            std::vector<byte> temp( data.begin(), data.begin() + rows*cols );
+            transpose( &temp[0], &data[0], rows, cols );
+        }
+        
+        public :
+            //! Constructor, taking the number of columns (usually the FEC data block size).
+            BlockInterleaver( unsigned int columns ) :
+                columns_( columns )
+            {}
+            
+            //! Write the data in rows and read it out in columns.
+            void interleave( std::vector<byte>& data ) const
+            {
+                transpose( data, data.size() / columns_, columns_ );
+            }
+            
+            //! Write the data in columns and read it out in rows.
+            void deinterleave( std::vector<byte>& data ) const
+            {
+                transpose( data, columns_, data.size() / columns_ );
+            }
+    };
+
+}
+
+#endif //EFB_BLOCKINTERLEAVER_H
@@ -0,0 +1,25 @@
+#ifndef EFB_IINTERLEAVER_H
+#define EFB_IINTERLEAVER_H
+
+// Standard library includes
+#include <vector>
+
+// Library sub-component includes
+#include "../Common.h"
+
+namespace efb {
+    
+    //! Abstract class defining an interleaver, which reorders error corrected data before it is implanted so that a burst of damage to the image is spread over many FEC codewords.
+    class IInterleaver
+    {
+        public :
+            virtual ~IInterleaver() {}
+            //! Reorder data in place, ready for implantation.
+            virtual void interleave( std::vector<byte>& data ) const = 0;
+            //! Restore the original order of extracted data (or of anything laid out in the same way, e.g. reliability scores).
+            virtual void deinterleave( std::vector<byte>& data ) const = 0;
+    };
+
+}
+
+#endif //EFB_IINTERLEAVER_H